@@ -14,6 +14,8 @@
 
 #include "log.h"
 #include "config.h"
+#include "connector.h"
+#include "corkwriter.h"
 #include "noncopyable.h"
 #include "singleton.h"
 #include "util.h"
@@ -27,5 +29,7 @@
 #include "hook.h"
 #include "fdmanager.h"
 #include "address.h"
+#include "datagram.h"
+#include "epoch.h"
 
 #endif
@@ -1,6 +1,13 @@
 #include "config.h"
+#include "iomanager.h"
 #include "util.h"
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -17,10 +24,23 @@ ConfigVarBase::ptr Config::LookupBase(const std::string& name) {
     return it == GetDatas().end() ? nullptr : it->second;
 }
 
+// 一次加锁查找一批配置项
+void Config::LookupAll(const MemberList& members, std::vector<ConfigVarBase::ptr>& vars) {
+    vars.resize(members.size());
+    RWMutexType::ReadLock lock(GetMutex());
+    ConfigVarMap& datas = GetDatas();
+    for(size_t i = 0; i < members.size(); ++i) {
+        auto it = datas.find(members[i].first);
+        if(it != datas.end()) {
+            vars[i] = it->second;
+        }
+    }
+}
+
 /* 解析出所有的yaml node */
 static void ListAllMember(const std::string& prefix,
                         const YAML::Node& node,
-                        std::list<std::pair<std::string, const YAML::Node> >& output) {
+                        std::vector<std::pair<std::string, YAML::Node> >& output) {
     if(prefix.find_first_not_of("abcdefghikjlmnopqrstuvwxyz._0123456789")   // 默认以字母、'.'、下划线数字开头
             != std::string::npos) {
         APOLLO_LOG_ERROR(g_logger) << "CONFIG INVALID NAME " << prefix << " : " << node;
@@ -38,27 +58,204 @@ static void ListAllMember(const std::string& prefix,
 
 /* 从文件中加载yaml配置，会复写已存在配置项的参数 */
 void Config::LoadFromYaml(const YAML::Node& root) {
-    std::list<std::pair<std::string, const YAML::Node>> all_nodes;
+    ApplyYaml(root, false);
+}
+
+/* 按批应用yaml配置, 只提交有变化的配置项 */
+int Config::ApplyYaml(const YAML::Node& root, bool strict) {
+    // 配置名经ListAllMember校验, 只含小写字母
+    MemberList all_nodes;
     ListAllMember("", root, all_nodes);
+    std::vector<ConfigVarBase::ptr> vars;
+    LookupAll(all_nodes, vars);
+
+    std::vector<ConfigChange::ptr> changes;
+    for(size_t i = 0; i < all_nodes.size(); ++i) {
+        ConfigVarBase::ptr& var = vars[i];
+        if(!var) {
+            continue;
+        }
+
+        // 直接从节点解析, 不经过字符串
+        try {
+            ConfigChange::ptr change = var->diff(all_nodes[i].second);
+            if(change) {
+                changes.push_back(change);
+            }
+        } catch(const std::exception& e) {
+            APOLLO_LOG_ERROR(g_logger) << "Config::ApplyYaml EXCEPTION " << e.what()
+                << " CONVERT " << all_nodes[i].first << " = " << all_nodes[i].second
+                << " TO " << var->getTypeName() << " FAILED";
+            if(strict) {
+                return -1;
+            }
+        }
+    }
+    Commit(changes);
+    return changes.size();
+}
+
+// 发布一批变更
+void Config::Commit(const std::vector<ConfigChange::ptr>& changes) {
+    if(changes.empty()) {
+        return;
+    }
+    {
+        // 同一批变更一起发布, 不与其他批次交错
+        MutexType::Lock lock(GetApplyMutex());
+        for(auto& i : changes) {
+            i->publish();
+        }
+    }
+    for(auto& i : changes) {
+        i->notify();
+    }
+}
 
-    for(auto& i : all_nodes) {
-        std::string key = i.first;
-        if(key.empty()) continue;
-
-        std::transform(key.begin(), key.end(), key.begin(), ::tolower);
-        ConfigVarBase::ptr var = LookupBase(key);
-
-        if(var) {
-            // 新值覆盖旧值
-            if(i.second.IsScalar()) {
-                var->fromString(i.second.Scalar()); 
-            } else {
-                std::stringstream ss;
-                ss << i.second;
-                var->fromString(ss.str());
+/* 递归列出目录下的yaml文件 */
+static void ListConfFiles(const std::string& path, std::vector<std::string>& files) {
+    DIR* dir = opendir(path.c_str());
+    if(!dir) {
+        APOLLO_LOG_ERROR(g_logger) << "opendir " << path << " errno=" << errno
+            << " errstr=" << strerror(errno);
+        return;
+    }
+    struct dirent* dp = nullptr;
+    while((dp = readdir(dir)) != nullptr) {
+        std::string name = dp->d_name;
+        // 跳过 . .. 以及隐藏文件(编辑器的临时文件)
+        if(name.empty() || name[0] == '.') {
+            continue;
+        }
+        std::string file = path + "/" + name;
+        struct stat st;
+        if(stat(file.c_str(), &st)) {
+            continue;
+        }
+        if(S_ISDIR(st.st_mode)) {
+            ListConfFiles(file, files);
+        } else if(S_ISREG(st.st_mode)) {
+            size_t pos = name.rfind('.');
+            if(pos != std::string::npos
+                    && (name.compare(pos, std::string::npos, ".yml") == 0
+                        || name.compare(pos, std::string::npos, ".yaml") == 0)) {
+                files.push_back(file);
             }
         }
     }
+    closedir(dir);
+}
+
+/* 在threads个线程(含当前线程)上执行cb(0) ~ cb(n - 1) */
+static void ParallelFor(size_t n, size_t threads, const std::function<void(size_t)>& cb) {
+    threads = std::min(threads, n);
+    if(threads <= 1) {
+        for(size_t i = 0; i < n; ++i) {
+            cb(i);
+        }
+        return;
+    }
+    std::atomic<size_t> next {0};
+    auto work = [&next, n, &cb]() {
+        for(size_t i = next++; i < n; i = next++) {
+            cb(i);
+        }
+    };
+    std::vector<Thread::ptr> thrs;
+    for(size_t i = 0; i < threads - 1; ++i) {
+        thrs.push_back(Thread::ptr(new Thread(work, "conf_load_" + std::to_string(i))));
+    }
+    work();
+    for(auto& i : thrs) {
+        i->join();
+    }
+}
+
+/* 并行加载目录下的全部配置文件 */
+int Config::LoadFromConfDir(const std::string& path, bool strict, size_t threads) {
+    std::vector<std::string> files;
+    ListConfFiles(path, files);
+    if(files.empty()) {
+        return 0;
+    }
+    std::sort(files.begin(), files.end());
+    if(threads == 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    // 1. 并行解析并展开各文件
+    std::vector<MemberList> members(files.size());
+    std::atomic<bool> failed {false};
+    ParallelFor(files.size(), threads, [&](size_t i) {
+        try {
+            ListAllMember("", YAML::LoadFile(files[i]), members[i]);
+        } catch(const std::exception& e) {
+            failed = true;
+            members[i].clear();
+            APOLLO_LOG_ERROR(g_logger) << "Config::LoadFromConfDir load " << files[i]
+                << " failed: " << e.what();
+        }
+    });
+    if(strict && failed) {
+        return -1;
+    }
+
+    // 2. 按文件顺序合并, 同名配置项以最后出现的为准
+    std::unordered_map<std::string, std::pair<size_t, size_t> > owner;
+    for(size_t i = 0; i < files.size(); ++i) {
+        for(size_t j = 0; j < members[i].size(); ++j) {
+            owner[members[i][j].first] = std::make_pair(i, j);
+        }
+    }
+
+    // 3. 一次加锁查找, 每个文件只保留归属于它的已注册配置项
+    std::vector<std::vector<std::pair<size_t, ConfigVarBase::ptr> > > owned(files.size());
+    {
+        RWMutexType::ReadLock lock(GetMutex());
+        ConfigVarMap& datas = GetDatas();
+        for(size_t i = 0; i < files.size(); ++i) {
+            for(size_t j = 0; j < members[i].size(); ++j) {
+                const std::string& key = members[i][j].first;
+                if(owner[key] != std::make_pair(i, j)) {
+                    continue;
+                }
+                auto it = datas.find(key);
+                if(it != datas.end()) {
+                    owned[i].push_back(std::make_pair(j, it->second));
+                }
+            }
+        }
+    }
+
+    // 4. 并行转换并与当前值比较, 同一文件的节点只在一个线程中访问
+    std::vector<std::vector<ConfigChange::ptr> > file_changes(files.size());
+    ParallelFor(files.size(), threads, [&](size_t i) {
+        for(auto& j : owned[i]) {
+            const std::pair<std::string, YAML::Node>& m = members[i][j.first];
+            try {
+                ConfigChange::ptr change = j.second->diff(m.second);
+                if(change) {
+                    file_changes[i].push_back(change);
+                }
+            } catch(const std::exception& e) {
+                failed = true;
+                APOLLO_LOG_ERROR(g_logger) << "Config::LoadFromConfDir EXCEPTION " << e.what()
+                    << " CONVERT " << m.first << " IN " << files[i]
+                    << " TO " << j.second->getTypeName() << " FAILED";
+            }
+        }
+    });
+    if(strict && failed) {
+        return -1;
+    }
+
+    // 5. 按文件顺序一起发布
+    std::vector<ConfigChange::ptr> changes;
+    for(auto& i : file_changes) {
+        changes.insert(changes.end(), i.begin(), i.end());
+    }
+    Commit(changes);
+    return changes.size();
 }
 
 /* 加载配置模块里面的所有配置项 */
@@ -72,5 +269,341 @@ void Config::Visit(std::function<void(ConfigVarBase::ptr)> cb) {
     }
 }
 
+// 快照文件头, 之后是count个(名称, 类型名, 值长度, 值)
+struct SnapshotHeader {
+    uint32_t magic;
+    // 格式版本, 编码方式变化时递增
+    uint32_t version;
+    // 配置源文件指纹
+    uint64_t sources;
+    // 已注册配置项指纹(含默认值), 程序或库的默认值改变后快照失效
+    uint64_t schema;
+    uint32_t count;
+    uint32_t reserved;
+};
+
+static const uint32_t s_snapshot_magic = 0x47464341;   // "ACFG"
+static const uint32_t s_snapshot_version = 2;
+
+static uint64_t fnv1a(const void* data, size_t len, uint64_t h = 14695981039346656037ull) {
+    const unsigned char* p = (const unsigned char*)data;
+    for(size_t i = 0; i < len; ++i) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// 与遍历顺序无关: 各配置项的哈希求和
+uint64_t Config::SchemaFingerprint() {
+    uint64_t h = 0;
+    for(auto& i : GetDatas()) {
+        std::string type = i.second->getTypeName();
+        uint64_t x = fnv1a(i.first.c_str(), i.first.size() + 1);
+        x = fnv1a(type.c_str(), type.size() + 1, x);
+        uint64_t def = i.second->getDefaultHash();
+        h += fnv1a(&def, sizeof(def), x);
+    }
+    return h;
+}
+
+uint64_t Config::ConfDirFingerprint(const std::string& path) {
+    std::vector<std::string> files;
+    ListConfFiles(path, files);
+    std::sort(files.begin(), files.end());
+    uint64_t h = fnv1a(nullptr, 0);
+    for(auto& i : files) {
+        struct stat st;
+        if(stat(i.c_str(), &st)) {
+            continue;
+        }
+        int64_t meta[3] = {(int64_t)st.st_size, (int64_t)st.st_mtim.tv_sec, (int64_t)st.st_mtim.tv_nsec};
+        h = fnv1a(i.c_str(), i.size() + 1, h);
+        h = fnv1a(meta, sizeof(meta), h);
+    }
+    return h;
+}
+
+bool Config::SaveSnapshot(const std::string& file, uint64_t sources) {
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = s_snapshot_magic;
+    header.version = s_snapshot_version;
+    header.sources = sources;
+
+    std::string buf(sizeof(header), '\0');
+    {
+        RWMutexType::ReadLock lock(GetMutex());
+        header.schema = SchemaFingerprint();
+        header.count = GetDatas().size();
+        for(auto& i : GetDatas()) {
+            try {
+                ToBinary<std::string>()(buf, i.first);
+                ToBinary<std::string>()(buf, i.second->getTypeName());
+                size_t pos = buf.size();
+                buf.append(sizeof(uint32_t), '\0');
+                i.second->toBinary(buf);
+                uint32_t len = buf.size() - pos - sizeof(uint32_t);
+                memcpy(&buf[pos], &len, sizeof(len));
+            } catch(const std::exception& e) {
+                APOLLO_LOG_ERROR(g_logger) << "Config::SaveSnapshot EXCEPTION " << e.what()
+                    << " CONVERT " << i.first << " FAILED";
+                return false;
+            }
+        }
+    }
+    memcpy(&buf[0], &header, sizeof(header));
+
+    // 写临时文件再改名, 读者不会看到写了一半的快照
+    std::string tmp = file + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if(!fp) {
+        APOLLO_LOG_ERROR(g_logger) << "Config::SaveSnapshot open " << tmp << " errno=" << errno
+            << " errstr=" << strerror(errno);
+        return false;
+    }
+    bool ok = fwrite(buf.data(), 1, buf.size(), fp) == buf.size();
+    ok = (fclose(fp) == 0) && ok;
+    if(!ok || rename(tmp.c_str(), file.c_str())) {
+        APOLLO_LOG_ERROR(g_logger) << "Config::SaveSnapshot write " << file << " errno=" << errno
+            << " errstr=" << strerror(errno);
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+int Config::LoadSnapshot(const std::string& file, uint64_t sources) {
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if(fstat(fd, &st) || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED) {
+        APOLLO_LOG_ERROR(g_logger) << "Config::LoadSnapshot mmap " << file << " errno=" << errno
+            << " errstr=" << strerror(errno);
+        return -1;
+    }
+
+    std::vector<ConfigChange::ptr> changes;
+    int rt = -1;
+    try {
+        SnapshotReader in((const char*)addr, size);
+        SnapshotHeader header = in.readPod<SnapshotHeader>();
+        if(header.magic != s_snapshot_magic || header.version != s_snapshot_version
+                || header.sources != sources) {
+            throw std::runtime_error("snapshot stale");
+        }
+
+        // 1. 校验配置项集合, 取出各配置项的值
+        std::vector<std::pair<ConfigVarBase::ptr, std::pair<const char*, uint32_t> > > entries;
+        {
+            RWMutexType::ReadLock lock(GetMutex());
+            ConfigVarMap& datas = GetDatas();
+            if(header.count != datas.size() || header.schema != SchemaFingerprint()) {
+                throw std::runtime_error("config vars changed");
+            }
+            entries.reserve(header.count);
+            for(uint32_t i = 0; i < header.count; ++i) {
+                std::string name = in.readString();
+                std::string type = in.readString();
+                uint32_t len = in.readPod<uint32_t>();
+                const char* data = in.read(len);
+                auto it = datas.find(name);
+                if(it == datas.end() || it->second->getTypeName() != type) {
+                    throw std::runtime_error("config var " + name + " changed");
+                }
+                entries.push_back(std::make_pair(it->second, std::make_pair(data, len)));
+            }
+        }
+
+        // 2. 解码并与当前值比较, 全部成功才发布
+        for(auto& i : entries) {
+            ConfigChange::ptr change = i.first->diffBinary(i.second.first, i.second.second);
+            if(change) {
+                changes.push_back(change);
+            }
+        }
+        rt = changes.size();
+    } catch(const std::exception& e) {
+        APOLLO_LOG_INFO(g_logger) << "Config::LoadSnapshot " << file << " skipped: " << e.what();
+        changes.clear();
+    }
+    munmap(addr, size);
+    Commit(changes);
+    return rt;
+}
+
+int Config::LoadFromConfDirCached(const std::string& path, const std::string& snapshot
+                                ,size_t threads) {
+    uint64_t sources = ConfDirFingerprint(path);
+    int rt = LoadSnapshot(snapshot, sources);
+    if(rt >= 0) {
+        return rt;
+    }
+    rt = LoadFromConfDir(path, false, threads);
+    SaveSnapshot(snapshot, sources);
+    return rt;
+}
+
+ConfigWatcher::ConfigWatcher(IOManager* iom, uint64_t delay_ms)
+    : m_iom(iom)
+    , m_delay(delay_ms) {
+    m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(m_fd < 0) {
+        APOLLO_LOG_ERROR(g_logger) << "ConfigWatcher inotify_init1 errno=" << errno
+            << " errstr=" << strerror(errno);
+    }
+}
+
+ConfigWatcher::~ConfigWatcher() {
+    if(m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+// 监听文件: 编辑器常以改名方式替换文件, 因此监听所在目录
+bool ConfigWatcher::addFile(const std::string& path) {
+    if(m_fd < 0) {
+        return false;
+    }
+    size_t pos = path.rfind('/');
+    std::string dir = pos == std::string::npos ? "." : (pos == 0 ? "/" : path.substr(0, pos));
+    std::string name = pos == std::string::npos ? path : path.substr(pos + 1);
+    if(name.empty()) {
+        return false;
+    }
+    int wd = inotify_add_watch(m_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if(wd < 0) {
+        APOLLO_LOG_ERROR(g_logger) << "ConfigWatcher watch " << dir << " errno=" << errno
+            << " errstr=" << strerror(errno);
+        return false;
+    }
+    MutexType::Lock lock(m_mutex);
+    m_files[wd][name] = path;
+    return true;
+}
+
+bool ConfigWatcher::start() {
+    MutexType::Lock lock(m_mutex);
+    if(m_fd < 0 || m_started || m_stopping) {
+        return false;
+    }
+    m_started = true;
+    m_iom->schedule(std::bind(&ConfigWatcher::run, shared_from_this()));
+    return true;
+}
+
+void ConfigWatcher::stop() {
+    MutexType::Lock lock(m_mutex);
+    if(m_stopping) {
+        return;
+    }
+    m_stopping = true;
+    if(m_started) {
+        // 唤醒挂起在读事件上的监听协程
+        m_iom->cancelEvent(m_fd, IOManager::READ);
+    }
+}
+
+void ConfigWatcher::run() {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while(true) {
+        {
+            MutexType::Lock lock(m_mutex);
+            if(m_stopping) {
+                break;
+            }
+            if(m_iom->addEvent(m_fd, IOManager::READ)) {
+                APOLLO_LOG_ERROR(g_logger) << "ConfigWatcher addEvent fd=" << m_fd << " failed";
+                break;
+            }
+        }
+        Fiber::YieldToHold();
+
+        std::vector<std::string> changed;
+        while(true) {
+            ssize_t n = read(m_fd, buf, sizeof(buf));
+            if(n < 0 && errno == EINTR) {
+                continue;
+            }
+            if(n <= 0) {
+                break;
+            }
+            MutexType::Lock lock(m_mutex);
+            for(char* p = buf; p < buf + n; ) {
+                struct inotify_event* ev = (struct inotify_event*)p;
+                p += sizeof(struct inotify_event) + ev->len;
+                if(ev->mask & IN_Q_OVERFLOW) {
+                    // 事件丢失, 全部重新加载
+                    for(auto& i : m_files) {
+                        for(auto& j : i.second) {
+                            changed.push_back(j.second);
+                        }
+                    }
+                    continue;
+                }
+                if(!ev->len) {
+                    continue;
+                }
+                auto it = m_files.find(ev->wd);
+                if(it == m_files.end()) {
+                    continue;
+                }
+                auto fit = it->second.find(ev->name);
+                if(fit != it->second.end()) {
+                    changed.push_back(fit->second);
+                }
+            }
+        }
+        for(auto& i : changed) {
+            onChanged(i);
+        }
+    }
+}
+
+void ConfigWatcher::onChanged(const std::string& path) {
+    {
+        MutexType::Lock lock(m_mutex);
+        if(m_stopping || !m_pending.insert(path).second) {
+            return;
+        }
+    }
+    ConfigWatcher::ptr self = shared_from_this();
+    m_iom->addTimer(m_delay, [self, path]() {
+        {
+            MutexType::Lock lock(self->m_mutex);
+            self->m_pending.erase(path);
+        }
+        self->reload(path);
+    });
+}
+
+int ConfigWatcher::reload(const std::string& path) {
+    YAML::Node root;
+    try {
+        root = YAML::LoadFile(path);
+    } catch(const std::exception& e) {
+        ++m_failures;
+        APOLLO_LOG_ERROR(g_logger) << "ConfigWatcher load " << path << " failed: " << e.what();
+        return -1;
+    }
+    int rt = Config::ApplyYaml(root);
+    if(rt < 0) {
+        ++m_failures;
+    } else {
+        ++m_reloads;
+    }
+    APOLLO_LOG_INFO(g_logger) << "ConfigWatcher reload " << path << " changed=" << rt;
+    return rt;
+}
+
 }
 // namespace apollo
@@ -11,13 +11,37 @@
 #include <iostream>
 #include <yaml-cpp/yaml.h>
 #include <functional>
+#include <stdexcept>
+#include <string.h>
+#include <type_traits>
 
 #include "log.h"
 #include "util.h"
 #include "thread.h"
 #include "mutex.h"
+#include "epoch.h"
+#include "noncopyable.h"
+#include "scheduler.h"
 
 namespace apollo {
+class IOManager;
+
+/*
+    配置项的一次待提交变更, 由Config按批发布
+*/
+class ConfigChange {
+public:
+    typedef std::shared_ptr<ConfigChange> ptr;
+
+    virtual ~ConfigChange() {}
+
+    // 发布新值快照, 在批次锁内调用
+    virtual void publish() = 0;
+
+    // 触发监听器并回收旧快照, 在publish之后且不持有任何锁时调用
+    virtual void notify() = 0;
+};
+
 /*
     config基类
 */
@@ -35,14 +59,23 @@ public:
 
     const std::string& getName() const {return m_name;};
     const std::string& getDescription() const {return m_description;};
+    // 编译期默认值的哈希, 默认值改变后旧的快照失效
+    uint64_t getDefaultHash() const {return m_defaultHash;}
 
     virtual std::string toString() = 0;
     virtual bool fromString(const std::string& val) = 0;
+    // 解析node并与当前值比较, 有变化返回待提交的变更, 无变化返回nullptr, 解析失败抛出异常
+    virtual ConfigChange::ptr diff(const YAML::Node& node) = 0;
+    // 当前值编码为二进制追加到out
+    virtual void toBinary(std::string& out) = 0;
+    // 从二进制解码并与当前值比较, 返回值同diff
+    virtual ConfigChange::ptr diffBinary(const char* data, size_t size) = 0;
 
     virtual std::string getTypeName() const = 0;
 protected:
     std::string m_name;
     std::string m_description;
+    uint64_t m_defaultHash = 0;
 };
 
 /*
@@ -63,254 +96,671 @@ public:
 };
 
 /**
- *  类型转换模板类偏特化(YAML String 转换成 std::vector<T>)
+ * YAML节点转换模板类(YAML Node 转换成 T)
+ * 标量直接取节点文本, 其余类型序列化后交给LexicalCast, 兼容自定义的LexicalCast特化
+ * 当类型不可转换时抛出异常
  */
 template<class T>
-class LexicalCast<std::string, std::vector<T> > {
+class FromNode {
 public:
-    std::vector<T> operator()(const std::string& v) {
-        YAML::Node node = YAML::Load(v);
-        typename std::vector<T> vec;
+    T operator()(const YAML::Node& node) {
+        if(node.IsScalar()) {
+            return LexicalCast<std::string, T>()(node.Scalar());
+        }
+        std::stringstream ss;
+        ss << node;
+        return LexicalCast<std::string, T>()(ss.str());
+    }
+};
+
+/**
+ * YAML节点转换模板类(T 转换成 YAML Node)
+ */
+template<class T>
+class ToNode {
+public:
+    YAML::Node operator()(const T& v) {
+        return YAML::Load(LexicalCast<T, std::string>()(v));
+    }
+};
+
+/**
+ * YAML节点转换模板类特化(std::string 与 YAML Node), 不经过lexical_cast
+ */
+template<>
+class FromNode<std::string> {
+public:
+    std::string operator()(const YAML::Node& node) {
+        if(node.IsScalar()) {
+            return node.Scalar();
+        }
         std::stringstream ss;
-        for(size_t i = 0; i < node.size(); ++i) {
-            ss.str("");
-            ss << node[i];
-            vec.push_back(LexicalCast<std::string, T>()(ss.str()));
+        ss << node;
+        return ss.str();
+    }
+};
+
+template<>
+class ToNode<std::string> {
+public:
+    YAML::Node operator()(const std::string& v) {
+        return YAML::Node(v);
+    }
+};
+
+/**
+ * YAML节点转换模板类偏特化(YAML Node 转换成 std::vector<T>)
+ */
+template<class T>
+class FromNode<std::vector<T> > {
+public:
+    std::vector<T> operator()(const YAML::Node& node) {
+        typename std::vector<T> vec;
+        for(auto it = node.begin();
+                it != node.end(); ++it) {
+            vec.push_back(FromNode<T>()(*it));
         }
         return vec;
     }
 };
 
 /**
- * 类型转换模板类偏特化(std::vector<T> 转换成 YAML String)
+ * YAML节点转换模板类偏特化(std::vector<T> 转换成 YAML Node)
  */
 template<class T>
-class LexicalCast<std::vector<T>, std::string> {
+class ToNode<std::vector<T> > {
 public:
-    std::string operator()(const std::vector<T>& v) {
+    YAML::Node operator()(const std::vector<T>& v) {
         YAML::Node node(YAML::NodeType::Sequence);
         for(auto& i : v) {
-            node.push_back(YAML::Load(LexicalCast<T, std::string>()(i)));
+            node.push_back(ToNode<T>()(i));
         }
-        std::stringstream ss;
-        ss << node;
-        return ss.str();
+        return node;
     }
 };
 
 /**
- * 类型转换模板类偏特化(YAML String 转换成 std::list<T>)
+ * YAML节点转换模板类偏特化(YAML Node 转换成 std::list<T>)
  */
 template<class T>
-class LexicalCast<std::string, std::list<T> > {
+class FromNode<std::list<T> > {
 public:
-    std::list<T> operator()(const std::string& v) {
-        YAML::Node node = YAML::Load(v);
+    std::list<T> operator()(const YAML::Node& node) {
         typename std::list<T> vec;
-        std::stringstream ss;
-        for(size_t i = 0; i < node.size(); ++i) {
-            ss.str("");
-            ss << node[i];
-            vec.push_back(LexicalCast<std::string, T>()(ss.str()));
+        for(auto it = node.begin();
+                it != node.end(); ++it) {
+            vec.push_back(FromNode<T>()(*it));
         }
         return vec;
     }
 };
 
 /**
- * 类型转换模板类偏特化(std::list<T> 转换成 YAML String)
+ * YAML节点转换模板类偏特化(std::list<T> 转换成 YAML Node)
  */
 template<class T>
-class LexicalCast<std::list<T>, std::string> {
+class ToNode<std::list<T> > {
 public:
-    std::string operator()(const std::list<T>& v) {
+    YAML::Node operator()(const std::list<T>& v) {
         YAML::Node node(YAML::NodeType::Sequence);
         for(auto& i : v) {
-            node.push_back(YAML::Load(LexicalCast<T, std::string>()(i)));
+            node.push_back(ToNode<T>()(i));
         }
-        std::stringstream ss;
-        ss << node;
-        return ss.str();
+        return node;
     }
 };
 
 /**
- * 类型转换模板类偏特化(YAML String 转换成 std::set<T>)
+ * YAML节点转换模板类偏特化(YAML Node 转换成 std::set<T>)
  */
 template<class T>
-class LexicalCast<std::string, std::set<T> > {
+class FromNode<std::set<T> > {
 public:
-    std::set<T> operator()(const std::string& v) {
-        YAML::Node node = YAML::Load(v);
+    std::set<T> operator()(const YAML::Node& node) {
         typename std::set<T> vec;
-        std::stringstream ss;
-        for(size_t i = 0; i < node.size(); ++i) {
-            ss.str("");
-            ss << node[i];
-            vec.insert(LexicalCast<std::string, T>()(ss.str()));
+        for(auto it = node.begin();
+                it != node.end(); ++it) {
+            vec.insert(FromNode<T>()(*it));
         }
         return vec;
     }
 };
 
 /**
- * 类型转换模板类偏特化(std::set<T> 转换成 YAML String)
+ * YAML节点转换模板类偏特化(std::set<T> 转换成 YAML Node)
  */
 template<class T>
-class LexicalCast<std::set<T>, std::string> {
+class ToNode<std::set<T> > {
 public:
-    std::string operator()(const std::set<T>& v) {
+    YAML::Node operator()(const std::set<T>& v) {
         YAML::Node node(YAML::NodeType::Sequence);
         for(auto& i : v) {
-            node.push_back(YAML::Load(LexicalCast<T, std::string>()(i)));
+            node.push_back(ToNode<T>()(i));
         }
-        std::stringstream ss;
-        ss << node;
-        return ss.str();
+        return node;
     }
 };
 
 /**
- * 类型转换模板类偏特化(YAML String 转换成 std::unordered_set<T>)
+ * YAML节点转换模板类偏特化(YAML Node 转换成 std::unordered_set<T>)
  */
 template<class T>
-class LexicalCast<std::string, std::unordered_set<T> > {
+class FromNode<std::unordered_set<T> > {
 public:
-    std::unordered_set<T> operator()(const std::string& v) {
-        YAML::Node node = YAML::Load(v);
+    std::unordered_set<T> operator()(const YAML::Node& node) {
         typename std::unordered_set<T> vec;
-        std::stringstream ss;
-        for(size_t i = 0; i < node.size(); ++i) {
-            ss.str("");
-            ss << node[i];
-            vec.insert(LexicalCast<std::string, T>()(ss.str()));
+        for(auto it = node.begin();
+                it != node.end(); ++it) {
+            vec.insert(FromNode<T>()(*it));
         }
         return vec;
     }
 };
 
 /**
- * 类型转换模板类偏特化(std::unordered_set<T> 转换成 YAML String)
+ * YAML节点转换模板类偏特化(std::unordered_set<T> 转换成 YAML Node)
  */
 template<class T>
-class LexicalCast<std::unordered_set<T>, std::string> {
+class ToNode<std::unordered_set<T> > {
 public:
-    std::string operator()(const std::unordered_set<T>& v) {
+    YAML::Node operator()(const std::unordered_set<T>& v) {
         YAML::Node node(YAML::NodeType::Sequence);
         for(auto& i : v) {
-            node.push_back(YAML::Load(LexicalCast<T, std::string>()(i)));
+            node.push_back(ToNode<T>()(i));
         }
-        std::stringstream ss;
-        ss << node;
-        return ss.str();
+        return node;
     }
 };
 
 /**
- * 类型转换模板类偏特化(YAML String 转换成 std::map<std::string, T>)
+ * YAML节点转换模板类偏特化(YAML Node 转换成 std::map<std::string, T>)
  */
 template<class T>
-class LexicalCast<std::string, std::map<std::string, T> > {
+class FromNode<std::map<std::string, T> > {
 public:
-    std::map<std::string, T> operator()(const std::string& v) {
-        YAML::Node node = YAML::Load(v);
+    std::map<std::string, T> operator()(const YAML::Node& node) {
         typename std::map<std::string, T> vec;
-        std::stringstream ss;
         for(auto it = node.begin();
                 it != node.end(); ++it) {
-            ss.str("");
-            ss << it->second;
             vec.insert(std::make_pair(it->first.Scalar(),
-                        LexicalCast<std::string, T>()(ss.str())));
+                        FromNode<T>()(it->second)));
         }
         return vec;
     }
 };
 
 /**
- * 类型转换模板类偏特化(std::map<std::string, T> 转换成 YAML String)
+ * YAML节点转换模板类偏特化(std::map<std::string, T> 转换成 YAML Node)
  */
 template<class T>
-class LexicalCast<std::map<std::string, T>, std::string> {
+class ToNode<std::map<std::string, T> > {
 public:
-    std::string operator()(const std::map<std::string, T>& v) {
+    YAML::Node operator()(const std::map<std::string, T>& v) {
         YAML::Node node(YAML::NodeType::Map);
         for(auto& i : v) {
-            node[i.first] = YAML::Load(LexicalCast<T, std::string>()(i.second));
+            node[i.first] = ToNode<T>()(i.second);
         }
-        std::stringstream ss;
-        ss << node;
-        return ss.str();
+        return node;
     }
 };
 
 /**
- * 类型转换模板类偏特化(YAML String 转换成 std::unordered_map<std::string, T>)
+ * YAML节点转换模板类偏特化(YAML Node 转换成 std::unordered_map<std::string, T>)
  */
 template<class T>
-class LexicalCast<std::string, std::unordered_map<std::string, T> > {
+class FromNode<std::unordered_map<std::string, T> > {
 public:
-    std::unordered_map<std::string, T> operator()(const std::string& v) {
-        YAML::Node node = YAML::Load(v);
+    std::unordered_map<std::string, T> operator()(const YAML::Node& node) {
         typename std::unordered_map<std::string, T> vec;
-        std::stringstream ss;
         for(auto it = node.begin();
                 it != node.end(); ++it) {
-            ss.str("");
-            ss << it->second;
             vec.insert(std::make_pair(it->first.Scalar(),
-                        LexicalCast<std::string, T>()(ss.str())));
+                        FromNode<T>()(it->second)));
         }
         return vec;
     }
 };
 
 /**
- * 类型转换模板类偏特化(std::unordered_map<std::string, T> 转换成 YAML String)
+ * YAML节点转换模板类偏特化(std::unordered_map<std::string, T> 转换成 YAML Node)
  */
 template<class T>
-class LexicalCast<std::unordered_map<std::string, T>, std::string> {
+class ToNode<std::unordered_map<std::string, T> > {
 public:
-    std::string operator()(const std::unordered_map<std::string, T>& v) {
+    YAML::Node operator()(const std::unordered_map<std::string, T>& v) {
         YAML::Node node(YAML::NodeType::Map);
         for(auto& i : v) {
-            node[i.first] = YAML::Load(LexicalCast<T, std::string>()(i.second));
+            node[i.first] = ToNode<T>()(i.second);
         }
+        return node;
+    }
+};
+
+/**
+ * 类型转换模板类偏特化(YAML String 与 std::vector<T> 互相转换)
+ */
+template<class T>
+class LexicalCast<std::string, std::vector<T> > {
+public:
+    std::vector<T> operator()(const std::string& v) {
+        return FromNode<std::vector<T> >()(YAML::Load(v));
+    }
+};
+
+template<class T>
+class LexicalCast<std::vector<T>, std::string> {
+public:
+    std::string operator()(const std::vector<T>& v) {
         std::stringstream ss;
-        ss << node;
+        ss << ToNode<std::vector<T> >()(v);
+        return ss.str();
+    }
+};
+
+/**
+ * 类型转换模板类偏特化(YAML String 与 std::list<T> 互相转换)
+ */
+template<class T>
+class LexicalCast<std::string, std::list<T> > {
+public:
+    std::list<T> operator()(const std::string& v) {
+        return FromNode<std::list<T> >()(YAML::Load(v));
+    }
+};
+
+template<class T>
+class LexicalCast<std::list<T>, std::string> {
+public:
+    std::string operator()(const std::list<T>& v) {
+        std::stringstream ss;
+        ss << ToNode<std::list<T> >()(v);
+        return ss.str();
+    }
+};
+
+/**
+ * 类型转换模板类偏特化(YAML String 与 std::set<T> 互相转换)
+ */
+template<class T>
+class LexicalCast<std::string, std::set<T> > {
+public:
+    std::set<T> operator()(const std::string& v) {
+        return FromNode<std::set<T> >()(YAML::Load(v));
+    }
+};
+
+template<class T>
+class LexicalCast<std::set<T>, std::string> {
+public:
+    std::string operator()(const std::set<T>& v) {
+        std::stringstream ss;
+        ss << ToNode<std::set<T> >()(v);
         return ss.str();
     }
 };
 
+/**
+ * 类型转换模板类偏特化(YAML String 与 std::unordered_set<T> 互相转换)
+ */
+template<class T>
+class LexicalCast<std::string, std::unordered_set<T> > {
+public:
+    std::unordered_set<T> operator()(const std::string& v) {
+        return FromNode<std::unordered_set<T> >()(YAML::Load(v));
+    }
+};
+
+template<class T>
+class LexicalCast<std::unordered_set<T>, std::string> {
+public:
+    std::string operator()(const std::unordered_set<T>& v) {
+        std::stringstream ss;
+        ss << ToNode<std::unordered_set<T> >()(v);
+        return ss.str();
+    }
+};
+
+/**
+ * 类型转换模板类偏特化(YAML String 与 std::map<std::string, T> 互相转换)
+ */
+template<class T>
+class LexicalCast<std::string, std::map<std::string, T> > {
+public:
+    std::map<std::string, T> operator()(const std::string& v) {
+        return FromNode<std::map<std::string, T> >()(YAML::Load(v));
+    }
+};
+
+template<class T>
+class LexicalCast<std::map<std::string, T>, std::string> {
+public:
+    std::string operator()(const std::map<std::string, T>& v) {
+        std::stringstream ss;
+        ss << ToNode<std::map<std::string, T> >()(v);
+        return ss.str();
+    }
+};
+
+/**
+ * 类型转换模板类偏特化(YAML String 与 std::unordered_map<std::string, T> 互相转换)
+ */
+template<class T>
+class LexicalCast<std::string, std::unordered_map<std::string, T> > {
+public:
+    std::unordered_map<std::string, T> operator()(const std::string& v) {
+        return FromNode<std::unordered_map<std::string, T> >()(YAML::Load(v));
+    }
+};
+
+template<class T>
+class LexicalCast<std::unordered_map<std::string, T>, std::string> {
+public:
+    std::string operator()(const std::unordered_map<std::string, T>& v) {
+        std::stringstream ss;
+        ss << ToNode<std::unordered_map<std::string, T> >()(v);
+        return ss.str();
+    }
+};
+
+/**
+ * 二进制快照的读取游标, 数据不足时抛出异常
+ */
+class SnapshotReader {
+public:
+    SnapshotReader(const char* data, size_t size)
+        : m_cur(data)
+        , m_end(data + size) {
+    }
+
+    // 读取n个字节, 返回起始地址
+    const char* read(size_t n) {
+        if(n > (size_t)(m_end - m_cur)) {
+            throw std::out_of_range("config snapshot truncated");
+        }
+        const char* p = m_cur;
+        m_cur += n;
+        return p;
+    }
+
+    template<class T>
+    T readPod() {
+        T v;
+        memcpy(&v, read(sizeof(T)), sizeof(T));
+        return v;
+    }
+
+    std::string readString() {
+        uint32_t len = readPod<uint32_t>();
+        return std::string(read(len), len);
+    }
+
+    bool eof() const { return m_cur == m_end;}
+private:
+    const char* m_cur;
+    const char* m_end;
+};
+
+/**
+ * 二进制编码模板类(T 追加到快照), 默认经由LexicalCast转为字符串
+ * 快照只在本机使用, 数值按本机字节序原样写入
+ */
+template<class T, class Enable = void>
+class ToBinary {
+public:
+    void operator()(std::string& out, const T& v) {
+        std::string str = LexicalCast<T, std::string>()(v);
+        uint32_t len = str.size();
+        out.append((const char*)&len, sizeof(len));
+        out.append(str);
+    }
+};
+
+/**
+ * 二进制解码模板类(从快照读出 T)
+ */
+template<class T, class Enable = void>
+class FromBinary {
+public:
+    T operator()(SnapshotReader& in) {
+        return LexicalCast<std::string, T>()(in.readString());
+    }
+};
+
+template<class T>
+class ToBinary<T, typename std::enable_if<std::is_arithmetic<T>::value>::type> {
+public:
+    void operator()(std::string& out, const T& v) {
+        out.append((const char*)&v, sizeof(v));
+    }
+};
+
+template<class T>
+class FromBinary<T, typename std::enable_if<std::is_arithmetic<T>::value>::type> {
+public:
+    T operator()(SnapshotReader& in) {
+        return in.readPod<T>();
+    }
+};
+
+template<>
+class ToBinary<std::string> {
+public:
+    void operator()(std::string& out, const std::string& v) {
+        uint32_t len = v.size();
+        out.append((const char*)&len, sizeof(len));
+        out.append(v);
+    }
+};
+
+template<>
+class FromBinary<std::string> {
+public:
+    std::string operator()(SnapshotReader& in) {
+        return in.readString();
+    }
+};
+
+/**
+ * 容器的二进制编码: 元素个数 + 逐个元素
+ */
+template<class T>
+class ToBinary<std::vector<T> > {
+public:
+    void operator()(std::string& out, const std::vector<T>& v) {
+        uint32_t n = v.size();
+        out.append((const char*)&n, sizeof(n));
+        for(auto& i : v) {
+            ToBinary<T>()(out, i);
+        }
+    }
+};
+
+template<class T>
+class FromBinary<std::vector<T> > {
+public:
+    std::vector<T> operator()(SnapshotReader& in) {
+        typename std::vector<T> vec;
+        uint32_t n = in.readPod<uint32_t>();
+        for(uint32_t i = 0; i < n; ++i) {
+            vec.push_back(FromBinary<T>()(in));
+        }
+        return vec;
+    }
+};
+
+template<class T>
+class ToBinary<std::list<T> > {
+public:
+    void operator()(std::string& out, const std::list<T>& v) {
+        uint32_t n = v.size();
+        out.append((const char*)&n, sizeof(n));
+        for(auto& i : v) {
+            ToBinary<T>()(out, i);
+        }
+    }
+};
+
+template<class T>
+class FromBinary<std::list<T> > {
+public:
+    std::list<T> operator()(SnapshotReader& in) {
+        typename std::list<T> vec;
+        uint32_t n = in.readPod<uint32_t>();
+        for(uint32_t i = 0; i < n; ++i) {
+            vec.push_back(FromBinary<T>()(in));
+        }
+        return vec;
+    }
+};
+
+template<class T>
+class ToBinary<std::set<T> > {
+public:
+    void operator()(std::string& out, const std::set<T>& v) {
+        uint32_t n = v.size();
+        out.append((const char*)&n, sizeof(n));
+        for(auto& i : v) {
+            ToBinary<T>()(out, i);
+        }
+    }
+};
+
+template<class T>
+class FromBinary<std::set<T> > {
+public:
+    std::set<T> operator()(SnapshotReader& in) {
+        typename std::set<T> vec;
+        uint32_t n = in.readPod<uint32_t>();
+        for(uint32_t i = 0; i < n; ++i) {
+            vec.insert(FromBinary<T>()(in));
+        }
+        return vec;
+    }
+};
+
+template<class T>
+class ToBinary<std::unordered_set<T> > {
+public:
+    void operator()(std::string& out, const std::unordered_set<T>& v) {
+        uint32_t n = v.size();
+        out.append((const char*)&n, sizeof(n));
+        for(auto& i : v) {
+            ToBinary<T>()(out, i);
+        }
+    }
+};
+
+template<class T>
+class FromBinary<std::unordered_set<T> > {
+public:
+    std::unordered_set<T> operator()(SnapshotReader& in) {
+        typename std::unordered_set<T> vec;
+        uint32_t n = in.readPod<uint32_t>();
+        for(uint32_t i = 0; i < n; ++i) {
+            vec.insert(FromBinary<T>()(in));
+        }
+        return vec;
+    }
+};
+
+template<class T>
+class ToBinary<std::map<std::string, T> > {
+public:
+    void operator()(std::string& out, const std::map<std::string, T>& v) {
+        uint32_t n = v.size();
+        out.append((const char*)&n, sizeof(n));
+        for(auto& i : v) {
+            ToBinary<std::string>()(out, i.first);
+            ToBinary<T>()(out, i.second);
+        }
+    }
+};
+
+template<class T>
+class FromBinary<std::map<std::string, T> > {
+public:
+    std::map<std::string, T> operator()(SnapshotReader& in) {
+        typename std::map<std::string, T> vec;
+        uint32_t n = in.readPod<uint32_t>();
+        for(uint32_t i = 0; i < n; ++i) {
+            std::string key = in.readString();
+            vec.insert(std::make_pair(std::move(key), FromBinary<T>()(in)));
+        }
+        return vec;
+    }
+};
+
+template<class T>
+class ToBinary<std::unordered_map<std::string, T> > {
+public:
+    void operator()(std::string& out, const std::unordered_map<std::string, T>& v) {
+        uint32_t n = v.size();
+        out.append((const char*)&n, sizeof(n));
+        for(auto& i : v) {
+            ToBinary<std::string>()(out, i.first);
+            ToBinary<T>()(out, i.second);
+        }
+    }
+};
+
+template<class T>
+class FromBinary<std::unordered_map<std::string, T> > {
+public:
+    std::unordered_map<std::string, T> operator()(SnapshotReader& in) {
+        typename std::unordered_map<std::string, T> vec;
+        uint32_t n = in.readPod<uint32_t>();
+        for(uint32_t i = 0; i < n; ++i) {
+            std::string key = in.readString();
+            vec.insert(std::make_pair(std::move(key), FromBinary<T>()(in)));
+        }
+        return vec;
+    }
+};
+
 /*
     配置参数模板子类,保存对应类型的参数值
     T：参数类型
     FromStr：从string转为T的仿函数, FromStr T operator() (const std::sring&)
     ToStr：从T转为string的仿函数, Tostr std::string operator() (const T&)
+    FromYaml：从YAML::Node转为T的仿函数, FromYaml T operator() (const YAML::Node&)
 */
 template<class T, class FromStr = LexicalCast<std::string, T>,
-                  class ToStr = LexicalCast<T, std::string>>
+                  class ToStr = LexicalCast<T, std::string>,
+                  class FromYaml = FromNode<T> >
 class ConfigVar : public ConfigVarBase {
 public:
     typedef std::shared_ptr<ConfigVar> ptr;
     // 配置项变更的回调函数封装
     typedef std::function<void (const T& old_val, const T& new_val)> on_change_cb;
 
-    typedef RWMutex RWMutexType;
+    typedef Mutex MutexType;
 
     ConfigVar(const std::string& name,
                 const T& default_val,
                 const std::string& description = "")
             : ConfigVarBase(name, description)
-            , m_val(default_val) {
+            , m_val(new T(default_val)) {
+        try {
+            std::string buf;
+            ToBinary<T>()(buf, default_val);
+            m_defaultHash = std::hash<std::string>()(buf);
+        } catch(const std::exception& e) {
+            // 无法编码的值也无法写入快照, 哈希保持为0
+            APOLLO_LOG_ERROR(APOLLO_LOG_ROOT()) << "ConfigVar::ConfigVar EXCEPTION "
+                << e.what() << " CONVERT " << name << " DEFAULT TO BINARY FAILED";
+        }
+    }
+
+    ~ConfigVar() {
+        delete m_val.load(std::memory_order_relaxed);
     }
 
     // 从参数值转为string
     std::string toString() override {
         try {
-            // return boost::lexical_cast<std::string>(m_val);
-            RWMutexType::ReadLock lock(m_mutex);
-            return ToStr()(m_val);
+            // 转换期间快照不会被回收
+            EpochGuard guard;
+            return ToStr()(getValue(guard));
         } catch(const std::exception& e) {
             APOLLO_LOG_ERROR(APOLLO_LOG_ROOT()) << "ConfigVar::toString EXCEPTION "
             << e.what() << "CONVERT " << typeid(T).name() 
@@ -333,66 +783,251 @@ public:
         return false;
     }
 
-    // GET/SET方法
-    const T& getValue() const {
-        RWMutexType::ReadLock lock(m_mutex);
-        return m_val;
+    ConfigChange::ptr diff(const YAML::Node& node) override {
+        return diffValue(FromYaml()(node));
     }
 
-    void setValue(const T& val) {
-        {
-            // 查找用读锁,加入大括号给与作用域
-            RWMutexType::ReadLock lock(m_mutex);
-            if(val == m_val) {
-                return;
-            }
+    void toBinary(std::string& out) override {
+        EpochGuard guard;
+        ToBinary<T>()(out, getValue(guard));
+    }
 
-            for(auto& i : m_cbs) {
-                i.second(m_val, val);  // 写入监听事件，old_val, new_val
-            }
+    ConfigChange::ptr diffBinary(const char* data, size_t size) override {
+        SnapshotReader in(data, size);
+        T v = FromBinary<T>()(in);
+        if(!in.eof()) {
+            throw std::length_error("config snapshot value size mismatch");
         }
+        return diffValue(std::move(v));
+    }
 
-        RWMutexType::WriteLock lock(m_mutex);
-        m_val = val;
+    /**
+     * 读取当前值: 一次原子load, 不加锁, 不拷贝
+     * 快照不可变, 被替换后经epoch延迟回收, 返回的引用只在调用方的guard作用域内有效,
+     * 作用域内不能挂起协程; 容器等较大的值在热路径上应使用此接口
+     */
+    const T& getValue(const EpochGuard&) const {
+        return *m_val.load(std::memory_order_acquire);
+    }
+
+    /**
+     * 读取当前值的副本: 在EpochGuard内拷贝,
+     * 调用方持有的值与之后的替换和回收无关, 可以跨越协程挂起
+     */
+    T getValue() const {
+        EpochGuard guard;
+        return getValue(guard);
+    }
+
+    /**
+     * 发布新快照并触发监听器, 读者不会被阻塞
+     * 监听器在锁外执行, 可以在回调中读写本配置项
+     */
+    void setValue(const T& val) {
+        uint64_t version = 0;
+        const T* old = publish(val, version);
+        if(old) {
+            notify(*old, val, version);
+            EpochMgr::GetInstance()->retire(const_cast<T*>(old));
+        }
     }
 
     // 获取T的类型名
     std::string getTypeName() const override {return typeid(T).name();}
     
-    // 增加/删除监听器 
-    uint64_t addListener(const on_change_cb& cb) {
-        RWMutexType::WriteLock lock(m_mutex);
-        static uint64_t s_key_id = 0;  // 唯一键
-        ++s_key_id;
-
-        m_cbs[s_key_id] = cb;
-        return s_key_id;
+    /**
+     * 增加监听器, 返回本配置项内唯一的键
+     * scheduler为空时在变更线程同步调用;
+     * 否则作为协程派发到scheduler, 送达前的多次变更合并为一次(最早的old_val, 最新的new_val),
+     * 同一监听器的回调不会并发执行, 最后一次回调的new_val为最新值
+     */
+    uint64_t addListener(const on_change_cb& cb, Scheduler* scheduler = nullptr) {
+        MutexType::Lock lock(m_mutex);
+        uint64_t key = ++m_keyId;
+        m_cbs[key].reset(new Listener(cb, scheduler));
+        return key;
     }
 
     on_change_cb addListener(const uint64_t key) const {
-        RWMutexType::ReadLock lock(m_mutex);
+        MutexType::Lock lock(m_mutex);
         auto it = m_cbs.find(key);
 
-        return it == m_cbs.end() ? nullptr : it->second;
+        return it == m_cbs.end() ? nullptr : it->second->cb;
     }
 
+    // 删除监听器, 尚未送达的异步通知不再派发
     void delListener(const uint64_t key) {
-        RWMutexType::WriteLock lock(m_mutex);
-        m_cbs.erase(key);
+        MutexType::Lock lock(m_mutex);
+        auto it = m_cbs.find(key);
+        if(it != m_cbs.end()) {
+            it->second->remove();
+            m_cbs.erase(it);
+        }
     }
 
     void clearListener() {
-        RWMutexType::WriteLock lock(m_mutex);
+        MutexType::Lock lock(m_mutex);
+        for(auto& i : m_cbs) {
+            i.second->remove();
+        }
         m_cbs.clear();
     }
 
 private:
-    // 配置参数
-    T m_val;
-    // 变更回调函数，key值唯一
-    std::map<uint64_t, on_change_cb> m_cbs; 
-    // mutex
-    mutable RWMutexType m_mutex;
+    // 变更监听器
+    struct Listener {
+        typedef std::shared_ptr<Listener> ptr;
+
+        Listener(const on_change_cb& c, Scheduler* s)
+            : cb(c)
+            , scheduler(s) {
+        }
+
+        void remove() {
+            Mutex::Lock lock(mutex);
+            removed = true;
+        }
+
+        on_change_cb cb;
+        Scheduler* scheduler;
+        // 以下为异步派发状态
+        Mutex mutex;
+        // 已派发的协程尚未退出
+        bool pending = false;
+        bool removed = false;
+        // 已收到的最新变更版本
+        uint64_t version = 0;
+        // 尚未送达的变更
+        std::unique_ptr<T> oldVal;
+        std::unique_ptr<T> newVal;
+    };
+
+    // 异步派发一次变更
+    static void Post(const typename Listener::ptr& l, const T& old_val, const T& new_val
+                    ,uint64_t version) {
+        {
+            Mutex::Lock lock(l->mutex);
+            // 并发写者的通知可能乱序到达, 丢弃比已收到的更旧的变更
+            if(l->removed || version <= l->version) {
+                return;
+            }
+            l->version = version;
+            if(l->newVal) {
+                // 与尚未送达的变更合并
+                *l->newVal = new_val;
+                return;
+            }
+            l->oldVal.reset(new T(old_val));
+            l->newVal.reset(new T(new_val));
+            if(l->pending) {
+                // 正在执行的协程会接着送达
+                return;
+            }
+            l->pending = true;
+        }
+        l->scheduler->schedule(std::function<void()>(std::bind(&ConfigVar::Deliver, l)));
+    }
+
+    // 派发协程: 依次送达累积的变更, 直到没有新的变更
+    static void Deliver(typename Listener::ptr l) {
+        while(true) {
+            std::unique_ptr<T> old_val;
+            std::unique_ptr<T> new_val;
+            {
+                Mutex::Lock lock(l->mutex);
+                if(l->removed || !l->newVal) {
+                    l->pending = false;
+                    return;
+                }
+                old_val.swap(l->oldVal);
+                new_val.swap(l->newVal);
+            }
+            // 合并后回到原值则不通知
+            if(!(*old_val == *new_val)) {
+                l->cb(*old_val, *new_val);
+            }
+        }
+    }
+
+    // 批量应用时暂存的新值
+    class Change : public ConfigChange {
+    public:
+        Change(ConfigVar* var, T&& val)
+            : m_var(var)
+            , m_val(std::move(val)) {
+        }
+
+        void publish() override {
+            m_old = m_var->publish(m_val, m_version);
+        }
+
+        void notify() override {
+            if(m_old) {
+                m_var->notify(*m_old, m_val, m_version);
+                EpochMgr::GetInstance()->retire(const_cast<T*>(m_old));
+                m_old = nullptr;
+            }
+        }
+    private:
+        // 配置项注册后不会被删除
+        ConfigVar* m_var;
+        T m_val;
+        const T* m_old = nullptr;
+        uint64_t m_version = 0;
+    };
+
+    // 与当前值比较, 有变化时生成待提交的变更
+    ConfigChange::ptr diffValue(T&& v) {
+        {
+            EpochGuard guard;
+            if(v == getValue(guard)) {
+                return nullptr;
+            }
+        }
+        return ConfigChange::ptr(new Change(this, std::move(v)));
+    }
+
+    // 发布新快照, 返回旧快照与新版本号; 值未变化返回nullptr
+    const T* publish(const T& val, uint64_t& version) {
+        MutexType::Lock lock(m_mutex);
+        const T* old = m_val.load(std::memory_order_relaxed);
+        if(val == *old) {
+            return nullptr;
+        }
+        m_val.store(new T(val), std::memory_order_release);
+        version = ++m_version;
+        return old;
+    }
+
+    // 在锁外依次调用或派发监听器
+    void notify(const T& old_val, const T& new_val, uint64_t version) {
+        std::vector<typename Listener::ptr> cbs;
+        {
+            MutexType::Lock lock(m_mutex);
+            cbs.reserve(m_cbs.size());
+            for(auto& i : m_cbs) {
+                cbs.push_back(i.second);
+            }
+        }
+        for(auto& i : cbs) {
+            if(i->scheduler) {
+                Post(i, old_val, new_val, version);
+            } else {
+                i->cb(old_val, new_val);  // 写入监听事件，old_val, new_val
+            }
+        }
+    }
+
+    // 配置参数的当前快照
+    std::atomic<const T*> m_val;
+    // 变更监听器，key值唯一
+    std::map<uint64_t, typename Listener::ptr> m_cbs;
+    // 上一个分配的监听器键
+    uint64_t m_keyId = 0;
+    // 值的版本号, 每次发布递增
+    uint64_t m_version = 0;
+    // 写者/监听器互斥, 读者不加锁
+    mutable MutexType m_mutex;
 };
 
 /*
@@ -404,6 +1039,7 @@ public:
     typedef std::unordered_map<std::string, ConfigVarBase::ptr> ConfigVarMap;   // 多态
 
     typedef RWMutex RWMutexType;
+    typedef Mutex MutexType;
 
     /**
         获取/创建配置参数
@@ -453,10 +1089,60 @@ public:
     /* 初始化YAML::Node配置模块 */
     static void LoadFromYaml(const YAML::Node& root);
 
+    /**
+     * 按批应用YAML配置: 只提交值有变化的配置项, 全部发布后再在锁外触发监听器
+     * strict为true时任一项解析失败则整批放弃
+     * 返回变更的配置项数, 放弃时返回-1
+     */
+    static int ApplyYaml(const YAML::Node& root, bool strict = true);
+
+    /**
+     * 加载目录(含子目录)下的全部.yml/.yaml文件
+     * 在threads个线程上并行解析与转换(0为CPU核数), 按路径排序, 后面的文件覆盖前面的同名配置项
+     * 全部变更在一次批次锁内发布, strict含义同ApplyYaml
+     * 返回变更的配置项数, 放弃时返回-1
+     */
+    static int LoadFromConfDir(const std::string& path, bool strict = false, size_t threads = 0);
+
+    /**
+     * 将全部配置项的当前值写入二进制快照(先写临时文件再改名)
+     * sources为配置源文件的指纹, 加载时用于判断快照是否过期
+     */
+    static bool SaveSnapshot(const std::string& file, uint64_t sources = 0);
+
+    /**
+     * mmap加载二进制快照, 全部解码成功后按批发布
+     * 文件不存在/格式版本/源文件指纹/配置项集合或默认值不一致或解码失败时不做修改, 返回-1
+     * 否则返回变更的配置项数
+     */
+    static int LoadSnapshot(const std::string& file, uint64_t sources = 0);
+
+    /**
+     * 启动加载: 配置目录未变化时直接加载快照,
+     * 否则LoadFromConfDir并重新生成快照
+     */
+    static int LoadFromConfDirCached(const std::string& path, const std::string& snapshot
+                                    ,size_t threads = 0);
+
+    /* 计算配置目录下yaml文件的指纹(路径, 大小, 修改时间) */
+    static uint64_t ConfDirFingerprint(const std::string& path);
+
     /* 加载配置模块里面的所有配置项 */
     static void Visit(std::function<void(ConfigVarBase::ptr)> cb);
 
 private:
+    // 展开后的yaml节点: 配置名 -> 节点
+    typedef std::vector<std::pair<std::string, YAML::Node> > MemberList;
+
+    /* 一次加锁查找members中的配置项, 未注册的为nullptr */
+    static void LookupAll(const MemberList& members, std::vector<ConfigVarBase::ptr>& vars);
+
+    /* 发布一批变更并在锁外触发监听器 */
+    static void Commit(const std::vector<ConfigChange::ptr>& changes);
+
+    /* 已注册配置项(名称, 类型, 默认值)的指纹, 调用方需持有GetMutex */
+    static uint64_t SchemaFingerprint();
+
     /* 获取所有的配置项 */
     static ConfigVarMap& GetDatas() {
         static ConfigVarMap s_datas;
@@ -469,6 +1155,72 @@ private:
         return s_mutex;
     }
 
+    /* 获取批次发布锁 */
+    static MutexType& GetApplyMutex() {
+        static MutexType s_mutex;
+        return s_mutex;
+    }
+
+};
+
+/**
+ * @brief 配置文件热加载
+ * @details 在IOManager上用inotify监听YAML文件所在目录, 文件写完或被替换后
+ *          延迟合并多次写入, 在后台协程中解析并用Config::ApplyYaml按批应用
+ *          IOManager停止前需调用stop
+ */
+class ConfigWatcher : public std::enable_shared_from_this<ConfigWatcher>, Noncopyable {
+public:
+    typedef std::shared_ptr<ConfigWatcher> ptr;
+    typedef Mutex MutexType;
+
+    /**
+     * @param[in] iom 运行监听协程与加载任务的IOManager
+     * @param[in] delay_ms 文件变化后等待的毫秒数, 用于合并编辑器的多次写入
+     */
+    ConfigWatcher(IOManager* iom, uint64_t delay_ms = 100);
+
+    ~ConfigWatcher();
+
+    // 监听文件(不会立即加载), 成功返回true
+    bool addFile(const std::string& path);
+
+    // 开始监听
+    bool start();
+
+    // 停止监听
+    void stop();
+
+    // 立即加载文件, 返回变更的配置项数, 失败返回-1
+    int reload(const std::string& path);
+
+    // 成功加载次数
+    uint64_t getReloads() const { return m_reloads;}
+
+    // 加载失败次数
+    uint64_t getFailures() const { return m_failures;}
+
+private:
+    // 监听协程
+    void run();
+
+    // 文件变化, 延迟加载
+    void onChanged(const std::string& path);
+
+private:
+    IOManager* m_iom;
+    uint64_t m_delay;
+    // inotify句柄
+    int m_fd = -1;
+    bool m_started = false;
+    bool m_stopping = false;
+    // 目录watch描述符 -> (文件名 -> 路径)
+    std::unordered_map<int, std::map<std::string, std::string> > m_files;
+    // 已安排延迟加载的文件
+    std::unordered_set<std::string> m_pending;
+    std::atomic<uint64_t> m_reloads {0};
+    std::atomic<uint64_t> m_failures {0};
+    MutexType m_mutex;
 };
 
 }
@@ -0,0 +1,302 @@
+#include "connector.h"
+#include "config.h"
+#include "fiber.h"
+#include "hook.h"
+#include "iomanager.h"
+#include "log.h"
+#include "mutex.h"
+#include "util.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+
+namespace apollo
+{
+static apollo::Logger::ptr g_logger = APOLLO_LOG_NAME("system");
+
+static apollo::ConfigVar<int>::ptr g_tcp_connect_stagger =
+    apollo::Config::Lookup("tcp.connect.stagger", 250, "tcp connect attempt delay of happy eyeballs");
+
+namespace {
+
+// 一次并发连接的共享状态, 由发起协程和各连接协程共同持有
+struct RaceState {
+    typedef std::shared_ptr<RaceState> ptr;
+
+    Mutex mutex;
+    IOManager* iom = nullptr;
+    int type = SOCK_STREAM;
+    std::vector<Address::ptr> addrs;
+    // 各连接正在等待的句柄, 不在等待时为-1
+    std::vector<int> fds;
+    // 是否已结束(有连接成功或超时)
+    bool done = false;
+    // 成功的句柄
+    int winner = -1;
+    // 成功的地址
+    Address::ptr winnerAddr;
+    // 已失败的连接数
+    size_t failed = 0;
+    // 最后一个错误
+    int error = ECONNREFUSED;
+    // 发起协程是否挂起等待中
+    bool waiting = false;
+    // 发起协程未等待时到达的唤醒
+    bool pendingWake = false;
+    // 发起协程
+    Fiber::ptr caller;
+};
+
+// 唤醒发起协程, 调用时需持有state->mutex
+void wake_caller(RaceState::ptr state) {
+    if(state->waiting) {
+        state->waiting = false;
+        state->iom->schedule(state->caller);
+        state->caller.reset();
+    } else {
+        state->pendingWake = true;
+    }
+}
+
+// 取消所有仍在等待的连接, 调用时需持有state->mutex
+void cancel_all(RaceState::ptr state) {
+    for(auto fd : state->fds) {
+        if(fd != -1) {
+            state->iom->cancelEvent(fd, IOManager::WRITE);
+        }
+    }
+}
+
+// 记录一个连接的结果
+void report(RaceState::ptr state, size_t idx, int fd, int error) {
+    Mutex::Lock lock(state->mutex);
+    if(state->done) {
+        if(fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    if(error == 0) {
+        state->done = true;
+        state->winner = fd;
+        state->winnerAddr = state->addrs[idx];
+        cancel_all(state);
+    } else {
+        if(fd != -1) {
+            close(fd);
+        }
+        ++state->failed;
+        state->error = error;
+    }
+    wake_caller(state);
+}
+
+// 连接协程: 发起一次非阻塞连接并等待可写
+void attempt(RaceState::ptr state, size_t idx) {
+    Address::ptr addr = state->addrs[idx];
+    // hook后的socket会注册FdCtx并设置O_NONBLOCK
+    int fd = socket(addr->getFamily(), state->type, 0);
+    if(fd == -1) {
+        report(state, idx, -1, errno);
+        return;
+    }
+
+    int rt = connect_f(fd, addr->getAddr(), addr->getAddrLen());
+    if(rt == 0) {
+        report(state, idx, fd, 0);
+        return;
+    } else if(errno != EINPROGRESS) {
+        report(state, idx, fd, errno);
+        return;
+    }
+
+    {
+        // 在锁内注册事件, 保证发起协程的cancel_all要么看到该句柄, 要么本协程先看到done
+        Mutex::Lock lock(state->mutex);
+        if(state->done) {
+            lock.unlock();
+            close(fd);
+            return;
+        }
+        if(state->iom->addEvent(fd, IOManager::WRITE)) {
+            lock.unlock();
+            report(state, idx, fd, errno ? errno : EIO);
+            return;
+        }
+        state->fds[idx] = fd;
+    }
+    Fiber::YieldToHold();
+    {
+        Mutex::Lock lock(state->mutex);
+        state->fds[idx] = -1;
+    }
+
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len)) {
+        error = errno;
+    }
+    // 被取消时连接可能仍在进行中
+    if(error == 0) {
+        sockaddr_storage peer;
+        socklen_t plen = sizeof(peer);
+        if(getpeername(fd, (sockaddr*)&peer, &plen)) {
+            error = ECANCELED;
+        }
+    }
+    report(state, idx, fd, error);
+}
+
+// 串行连接, 没有IOManager时使用
+int connect_serial(const std::vector<Address::ptr>& addrs, int type
+        ,uint64_t timeout_ms, Address::ptr* connected) {
+    int error = ECONNREFUSED;
+    for(auto& addr : addrs) {
+        int fd = socket(addr->getFamily(), type, 0);
+        if(fd == -1) {
+            error = errno;
+            continue;
+        }
+        if(connect_with_timeout(fd, addr->getAddr(), addr->getAddrLen(), timeout_ms) == 0) {
+            if(connected) {
+                *connected = addr;
+            }
+            return fd;
+        }
+        error = errno;
+        close(fd);
+    }
+    errno = error;
+    return -1;
+}
+
+} // namespace
+
+// 按协议族交替排列
+std::vector<Address::ptr> Connector::Interleave(const std::vector<Address::ptr>& addrs) {
+    std::vector<Address::ptr> first;
+    std::vector<Address::ptr> second;
+    for(auto& addr : addrs) {
+        if(first.empty() || addr->getFamily() == first[0]->getFamily()) {
+            first.push_back(addr);
+        } else {
+            second.push_back(addr);
+        }
+    }
+
+    std::vector<Address::ptr> result;
+    result.reserve(addrs.size());
+    for(size_t i = 0; i < first.size() || i < second.size(); ++i) {
+        if(i < first.size()) {
+            result.push_back(first[i]);
+        }
+        if(i < second.size()) {
+            result.push_back(second[i]);
+        }
+    }
+    return result;
+}
+
+// 并发连接一组地址
+int Connector::Connect(const std::vector<Address::ptr>& addrs, int type
+        ,uint64_t timeout_ms, uint64_t stagger_ms, Address::ptr* connected) {
+    if(addrs.empty()) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(timeout_ms == (uint64_t)-1) {
+        timeout_ms = get_connect_timeout();
+    }
+    if(stagger_ms == (uint64_t)-1) {
+        stagger_ms = g_tcp_connect_stagger->getValue();
+    }
+
+    IOManager* iom = IOManager::GetThis();
+    if(!iom || !is_hook_enable()) {
+        return connect_serial(Interleave(addrs), type, timeout_ms, connected);
+    }
+
+    RaceState::ptr state(new RaceState);
+    state->iom = iom;
+    state->type = type;
+    state->addrs = Interleave(addrs);
+    state->fds.resize(state->addrs.size(), -1);
+
+    uint64_t expire = std::min(Fiber::GetDeadline(), GetCurrentMS() + timeout_ms);
+    size_t next = 0;
+    while(true) {
+        {
+            Mutex::Lock lock(state->mutex);
+            if(state->done) {
+                break;
+            }
+            if(state->failed == state->addrs.size()) {
+                state->done = true;
+                break;
+            }
+        }
+
+        uint64_t now = GetCurrentMS();
+        if(now >= expire) {
+            Mutex::Lock lock(state->mutex);
+            if(!state->done) {
+                state->done = true;
+                state->error = ETIMEDOUT;
+                cancel_all(state);
+            }
+            break;
+        }
+
+        if(next < state->addrs.size()) {
+            size_t idx = next++;
+            iom->schedule(std::bind(attempt, state, idx));
+        }
+
+        // 等待: 有连接结束, 到达下一次尝试的时间, 或整体超时
+        uint64_t wait = expire - now;
+        if(next < state->addrs.size()) {
+            wait = std::min(wait, stagger_ms);
+        }
+        {
+            Mutex::Lock lock(state->mutex);
+            if(state->pendingWake) {
+                state->pendingWake = false;
+                continue;
+            }
+            state->waiting = true;
+            state->caller = Fiber::GetThis();
+        }
+        Timer::ptr timer = iom->addTimer(wait, [state]() {
+            Mutex::Lock lock(state->mutex);
+            wake_caller(state);
+        });
+        Fiber::YieldToHold();
+        timer->cancel();
+    }
+
+    Mutex::Lock lock(state->mutex);
+    if(state->winner == -1) {
+        APOLLO_LOG_DEBUG(g_logger) << "Connector::Connect failed addrs=" << state->addrs.size()
+            << " errno=" << state->error << " " << strerror(state->error);
+        errno = state->error;
+        return -1;
+    }
+    if(connected) {
+        *connected = state->winnerAddr;
+    }
+    return state->winner;
+}
+
+// 解析host并并发连接
+int Connector::Connect(const std::string& host, int type
+        ,uint64_t timeout_ms, uint64_t stagger_ms, Address::ptr* connected) {
+    std::vector<Address::ptr> addrs;
+    if(!Address::Lookup(addrs, host, AF_UNSPEC, type)) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    return Connect(addrs, type, timeout_ms, stagger_ms, connected);
+}
+
+} // namespace apollo
@@ -0,0 +1,57 @@
+#ifndef __APOLLO_CONNECTOR_H__
+#define __APOLLO_CONNECTOR_H__
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "address.h"
+
+namespace apollo
+{
+/**
+ * @brief 多地址并发连接(Happy Eyeballs, RFC 8305)
+ * @details 按IPv6/IPv4交替排列候选地址, 每隔stagger_ms在新协程中发起下一个连接,
+ *          前一个连接失败时立即发起下一个; 第一个连接成功后通过IOManager::cancelEvent
+ *          取消其余仍在等待的连接并关闭其句柄
+ *          需要在IOManager的协程中调用, 否则退化为逐个串行连接
+ */
+class Connector {
+public:
+    /**
+     * @brief 并发连接一组地址
+     * @param[in] addrs 候选地址(一般为Address::Lookup的结果)
+     * @param[in] type socket类型
+     * @param[in] timeout_ms 整体超时时间, (uint64_t)-1表示使用tcp.connect.timeout
+     * @param[in] stagger_ms 相邻两次尝试的间隔, (uint64_t)-1表示使用tcp.connect.stagger
+     * @param[out] connected 成功连接的地址, 可为nullptr
+     * @return 成功返回已连接的socket句柄, 失败返回-1并设置errno
+     */
+    static int Connect(const std::vector<Address::ptr>& addrs, int type = SOCK_STREAM
+            ,uint64_t timeout_ms = (uint64_t)-1, uint64_t stagger_ms = (uint64_t)-1
+            ,Address::ptr* connected = nullptr);
+
+    /**
+     * @brief 解析host并并发连接其所有地址
+     * @param[in] host 域名,服务器名等.举例: www.sylar.top:80
+     * @param[in] type socket类型
+     * @param[in] timeout_ms 整体超时时间, (uint64_t)-1表示使用tcp.connect.timeout
+     * @param[in] stagger_ms 相邻两次尝试的间隔, (uint64_t)-1表示使用tcp.connect.stagger
+     * @param[out] connected 成功连接的地址, 可为nullptr
+     * @return 成功返回已连接的socket句柄, 失败返回-1并设置errno
+     */
+    static int Connect(const std::string& host, int type = SOCK_STREAM
+            ,uint64_t timeout_ms = (uint64_t)-1, uint64_t stagger_ms = (uint64_t)-1
+            ,Address::ptr* connected = nullptr);
+
+    /**
+     * @brief 按RFC 8305将地址按协议族交替排列, 第一个地址的协议族优先
+     */
+    static std::vector<Address::ptr> Interleave(const std::vector<Address::ptr>& addrs);
+};
+
+} // namespace apollo
+
+#endif
@@ -0,0 +1,208 @@
+#include "corkwriter.h"
+#include "fiber.h"
+#include "hook.h"
+#include "log.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/uio.h>
+
+namespace apollo
+{
+static apollo::Logger::ptr g_logger = APOLLO_LOG_NAME("system");
+
+CorkWriter::CorkWriter(int fd, size_t threshold)
+    : m_fd(fd)
+    , m_threshold(threshold) {
+}
+
+CorkWriter::~CorkWriter() {
+    flush();
+}
+
+// 追加数据(拷贝)
+ssize_t CorkWriter::append(const void* buf, size_t len) {
+    if(takeError()) {
+        return -1;
+    }
+    if(len == 0) {
+        return 0;
+    }
+    size_t offset = m_buffer.size();
+    m_buffer.append((const char*)buf, len);
+    // 与上一个拷贝片段在缓冲中相邻则合并为一个片段
+    if(!m_pieces.empty() && !m_pieces.back().ptr
+            && m_pieces.back().offset + m_pieces.back().len == offset) {
+        m_pieces.back().len += len;
+    } else {
+        m_pieces.push_back(Piece{nullptr, offset, len});
+    }
+    m_pending += len;
+    link();
+
+    if(m_pending >= m_threshold && flush() < 0) {
+        return -1;
+    }
+    return len;
+}
+
+// 追加数据(不拷贝)
+ssize_t CorkWriter::appendRef(const void* buf, size_t len) {
+    if(takeError()) {
+        return -1;
+    }
+    if(len == 0) {
+        return 0;
+    }
+    m_pieces.push_back(Piece{(const char*)buf, 0, len});
+    m_pending += len;
+    link();
+
+    if(m_pending >= m_threshold && flush() < 0) {
+        return -1;
+    }
+    return len;
+}
+
+// 写出暂存数据
+ssize_t CorkWriter::flush() {
+    unlink();
+    if(takeError()) {
+        // 之前的数据已经丢失, 之后暂存的数据也不再写出
+        m_pieces.clear();
+        m_buffer.clear();
+        m_pending = 0;
+        return -1;
+    }
+    return doFlush();
+}
+
+bool CorkWriter::takeError() {
+    if(!m_error) {
+        return false;
+    }
+    errno = m_error;
+    m_error = 0;
+    return true;
+}
+
+ssize_t CorkWriter::doFlush() {
+    if(m_pieces.empty()) {
+        return 0;
+    }
+
+    std::vector<iovec> iovs(m_pieces.size());
+    for(size_t i = 0; i < m_pieces.size(); ++i) {
+        const Piece& p = m_pieces[i];
+        iovs[i].iov_base = (void*)(p.ptr ? p.ptr : &m_buffer[p.offset]);
+        iovs[i].iov_len = p.len;
+    }
+
+    ssize_t total = 0;
+    size_t idx = 0;
+    while(idx < iovs.size()) {
+        int cnt = std::min(iovs.size() - idx, (size_t)IOV_MAX);
+        // hook后的writev, 发送缓冲区满时挂起协程
+        ssize_t n = writev(m_fd, &iovs[idx], cnt);
+        ++m_syscalls;
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            int err = errno;
+            APOLLO_LOG_DEBUG(g_logger) << "CorkWriter::flush fd=" << m_fd
+                << " writev errno=" << err << " " << strerror(err);
+            total = -1;
+            errno = err;
+            break;
+        }
+        total += n;
+        // 跳过已写出的部分, 处理部分写
+        while(n > 0 && idx < iovs.size()) {
+            if((size_t)n >= iovs[idx].iov_len) {
+                n -= iovs[idx].iov_len;
+                ++idx;
+            } else {
+                iovs[idx].iov_base = (char*)iovs[idx].iov_base + n;
+                iovs[idx].iov_len -= n;
+                n = 0;
+            }
+        }
+    }
+
+    m_pieces.clear();
+    m_buffer.clear();
+    m_pending = 0;
+    return total;
+}
+
+// 挂到当前协程的待写出链表上
+void CorkWriter::link() {
+    if(m_owner) {
+        return;
+    }
+    Fiber::ptr cur = Fiber::GetThis();
+    m_owner = cur.get();
+    m_next = m_owner->getCorked();
+    m_owner->setCorked(this);
+}
+
+// 从所属协程的待写出链表上摘除
+void CorkWriter::unlink() {
+    if(!m_owner) {
+        return;
+    }
+    CorkWriter* prev = nullptr;
+    CorkWriter* it = m_owner->getCorked();
+    while(it && it != this) {
+        prev = it;
+        it = it->m_next;
+    }
+    if(it) {
+        if(prev) {
+            prev->m_next = m_next;
+        } else {
+            m_owner->setCorked(m_next);
+        }
+    }
+    m_owner = nullptr;
+    m_next = nullptr;
+}
+
+// 写出当前协程上所有有暂存数据的CorkWriter
+bool CorkWriter::FlushCurrent() {
+    Fiber::ptr cur = Fiber::GetThis();
+    CorkWriter* it = cur->getCorked();
+    if(!it) {
+        return false;
+    }
+    // 先整体摘下链表, 写出过程中挂起时重入的FlushCurrent看到的是空链表
+    cur->setCorked(nullptr);
+    cur.reset();
+    while(it) {
+        CorkWriter* next = it->m_next;
+        it->m_owner = nullptr;
+        it->m_next = nullptr;
+        if(it->doFlush() < 0) {
+            it->m_error = errno;
+        }
+        it = next;
+    }
+    return true;
+}
+
+// 将协程上所有CorkWriter摘下
+void CorkWriter::Detach(Fiber* fiber) {
+    CorkWriter* it = fiber->getCorked();
+    fiber->setCorked(nullptr);
+    while(it) {
+        CorkWriter* next = it->m_next;
+        it->m_owner = nullptr;
+        it->m_next = nullptr;
+        it = next;
+    }
+}
+
+} // namespace apollo
@@ -0,0 +1,137 @@
+#ifndef __APOLLO_CORKWRITER_H__
+#define __APOLLO_CORKWRITER_H__
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "noncopyable.h"
+
+namespace apollo
+{
+class Fiber;
+
+/**
+ * @brief 写合并器
+ * @details 暂存一个响应的多个小片段, 在以下时机合并为一次writev/多段写出:
+ *          1. 暂存的数据量达到阈值
+ *          2. 显式调用flush或析构
+ *          3. 所属协程在hook函数中即将挂起(do_io等待/sleep)之前
+ *          一个CorkWriter只能由创建它的协程使用
+ */
+class CorkWriter : Noncopyable {
+public:
+    typedef std::shared_ptr<CorkWriter> ptr;
+
+    /**
+     * @brief 构造函数
+     * @param[in] fd 写出的文件句柄
+     * @param[in] threshold 暂存数据达到该大小时立即写出
+     */
+    CorkWriter(int fd, size_t threshold = 64 * 1024);
+
+    /**
+     * @brief 析构函数, 写出剩余数据
+     */
+    ~CorkWriter();
+
+    /**
+     * @brief 追加数据, 数据会被拷贝到内部缓冲
+     * @return 成功返回len, 触发阈值写出且失败或有未报告的写出错误时返回-1
+     */
+    ssize_t append(const void* buf, size_t len);
+
+    /**
+     * @brief 追加数据, 不拷贝, buf在写出之前必须有效
+     * @return 成功返回len, 触发阈值写出且失败或有未报告的写出错误时返回-1
+     */
+    ssize_t appendRef(const void* buf, size_t len);
+
+    /**
+     * @brief 将暂存的数据合并写出
+     * @return 写出的字节数, 失败返回-1(暂存数据被丢弃)
+     *         挂起前自动写出(FlushCurrent)失败时错误被记下, 由下一次flush/append返回
+     */
+    ssize_t flush();
+
+    /**
+     * @brief 暂存的数据量
+     */
+    size_t pending() const { return m_pending;}
+
+    /**
+     * @brief 写出数据所用的系统调用次数
+     */
+    uint64_t getSyscalls() const { return m_syscalls;}
+
+    /**
+     * @brief 文件句柄
+     */
+    int getFd() const { return m_fd;}
+
+    /**
+     * @brief 写出当前协程上所有有暂存数据的CorkWriter
+     * @return 是否写出了数据
+     */
+    static bool FlushCurrent();
+
+    /**
+     * @brief 将协程上所有CorkWriter摘下, 暂存数据留在各自的CorkWriter中
+     * @details 协程结束或重置时调用, 避免CorkWriter持有悬空的协程指针
+     */
+    static void Detach(Fiber* fiber);
+
+private:
+    /**
+     * @brief 挂到当前协程的待写出链表上
+     */
+    void link();
+
+    /**
+     * @brief 从所属协程的待写出链表上摘除
+     */
+    void unlink();
+
+    /**
+     * @brief 写出暂存数据(不处理链表)
+     */
+    ssize_t doFlush();
+
+    /**
+     * @brief 取出记下的写出错误(设置errno), 没有则返回false
+     */
+    bool takeError();
+
+private:
+    // 数据片段, ptr为空时表示数据位于m_buffer的offset处
+    struct Piece {
+        const char* ptr;
+        size_t offset;
+        size_t len;
+    };
+
+    // 文件句柄
+    int m_fd;
+    // 写出阈值
+    size_t m_threshold;
+    // 暂存的数据量
+    size_t m_pending = 0;
+    // 写出所用的系统调用次数
+    uint64_t m_syscalls = 0;
+    // 自动写出时发生且尚未报告的错误(errno)
+    int m_error = 0;
+    // 拷贝数据的缓冲
+    std::string m_buffer;
+    // 数据片段
+    std::vector<Piece> m_pieces;
+    // 所属协程(已挂到链表上时有效)
+    Fiber* m_owner = nullptr;
+    // 链表中的下一个
+    CorkWriter* m_next = nullptr;
+};
+
+} // namespace apollo
+
+#endif
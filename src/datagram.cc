@@ -0,0 +1,166 @@
+#include "datagram.h"
+#include "hook.h"
+#include "log.h"
+
+#include <string.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+namespace apollo
+{
+static apollo::Logger::ptr g_logger = APOLLO_LOG_NAME("system");
+
+// 每个数据报辅助数据的大小, GRO/GSO分段大小均只需要一个int
+static const size_t s_control_size = CMSG_SPACE(sizeof(int));
+
+DatagramBatch::DatagramBatch(size_t capacity, size_t buffer_size)
+    : m_capacity(capacity)
+    , m_bufferSize(buffer_size) {
+    m_buffers.resize(m_capacity * m_bufferSize);
+    m_recvIovs.resize(m_capacity);
+    m_addrs.resize(m_capacity);
+    m_recvControls.resize(m_capacity * s_control_size);
+    m_segments.resize(m_capacity);
+    m_recvMsgs.resize(m_capacity);
+    m_sendIovs.resize(m_capacity);
+    m_sendControls.resize(m_capacity * s_control_size);
+    m_sendMsgs.resize(m_capacity);
+}
+
+DatagramBatch::~DatagramBatch() {
+}
+
+// 批量接收数据报
+int DatagramBatch::recv(int fd, int flags) {
+    for(size_t i = 0; i < m_capacity; ++i) {
+        m_recvIovs[i].iov_base = &m_buffers[i * m_bufferSize];
+        m_recvIovs[i].iov_len = m_bufferSize;
+
+        msghdr& hdr = m_recvMsgs[i].msg_hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = &m_addrs[i];
+        hdr.msg_namelen = sizeof(sockaddr_storage);
+        hdr.msg_iov = &m_recvIovs[i];
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = &m_recvControls[i * s_control_size];
+        hdr.msg_controllen = s_control_size;
+        m_recvMsgs[i].msg_len = 0;
+    }
+
+    // MSG_WAITFORONE: 收到第一个数据报后不再等待, 即使socket为阻塞模式也只取走已就绪的数据报
+    int n = recvmmsg(fd, &m_recvMsgs[0], m_capacity, flags | MSG_WAITFORONE, nullptr);
+    if(n < 0) {
+        m_received = 0;
+        return -1;
+    }
+
+    for(int i = 0; i < n; ++i) {
+        m_segments[i] = 0;
+        msghdr& hdr = m_recvMsgs[i].msg_hdr;
+        for(cmsghdr* cm = CMSG_FIRSTHDR(&hdr); cm; cm = CMSG_NXTHDR(&hdr, cm)) {
+            if(cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                int gso_size = 0;
+                memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+                m_segments[i] = gso_size;
+            }
+        }
+    }
+    m_received = n;
+    return n;
+}
+
+// 添加一个待发送的数据报
+bool DatagramBatch::add(const void* data, size_t len, const sockaddr* to
+        ,socklen_t tolen, uint16_t gso_size) {
+    if(m_pending >= m_capacity) {
+        return false;
+    }
+
+    size_t i = m_pending++;
+    m_sendIovs[i].iov_base = (void*)data;
+    m_sendIovs[i].iov_len = len;
+
+    msghdr& hdr = m_sendMsgs[i].msg_hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_name = (void*)to;
+    hdr.msg_namelen = to ? tolen : 0;
+    hdr.msg_iov = &m_sendIovs[i];
+    hdr.msg_iovlen = 1;
+    m_sendMsgs[i].msg_len = 0;
+
+    if(gso_size && len > gso_size) {
+        char* control = &m_sendControls[i * s_control_size];
+        memset(control, 0, s_control_size);
+        hdr.msg_control = control;
+        hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+        cmsghdr* cm = CMSG_FIRSTHDR(&hdr);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+    }
+    return true;
+}
+
+// 发送所有待发送的数据报
+int DatagramBatch::send(int fd, int flags) {
+    if(m_pending == 0) {
+        return 0;
+    }
+    size_t sent = 0;
+    while(sent < m_pending) {
+        int n = sendmmsg(fd, &m_sendMsgs[sent], m_pending - sent, flags);
+        if(n < 0) {
+            int err = errno;
+            APOLLO_LOG_DEBUG(g_logger) << "DatagramBatch::send fd=" << fd
+                << " sent=" << sent << " pending=" << m_pending
+                << " errno=" << err << " " << strerror(err);
+            errno = err;
+            break;
+        }
+        sent += n;
+    }
+    if(sent < m_pending) {
+        // 未发出的数据报留在队列中, 调用方可以重试
+        int err = errno;
+        compact(sent);
+        errno = err;
+        return sent == 0 ? -1 : (int)sent;
+    }
+    m_pending = 0;
+    return sent;
+}
+
+// 丢弃前n个已发送的数据报, 剩余的前移
+void DatagramBatch::compact(size_t n) {
+    if(n == 0) {
+        return;
+    }
+    size_t rest = m_pending - n;
+    for(size_t i = 0; i < rest; ++i) {
+        m_sendIovs[i] = m_sendIovs[n + i];
+        m_sendMsgs[i] = m_sendMsgs[n + i];
+        msghdr& hdr = m_sendMsgs[i].msg_hdr;
+        hdr.msg_iov = &m_sendIovs[i];
+        if(hdr.msg_control) {
+            memcpy(&m_sendControls[i * s_control_size]
+                    ,&m_sendControls[(n + i) * s_control_size], s_control_size);
+            hdr.msg_control = &m_sendControls[i * s_control_size];
+        }
+    }
+    m_pending = rest;
+}
+
+// 开启UDP GRO
+bool DatagramBatch::EnableGro(int fd) {
+    int on = 1;
+    if(setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on))) {
+        APOLLO_LOG_INFO(g_logger) << "DatagramBatch::EnableGro fd=" << fd
+            << " errno=" << errno << " " << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+} // namespace apollo
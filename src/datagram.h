@@ -0,0 +1,155 @@
+#ifndef __APOLLO_DATAGRAM_H__
+#define __APOLLO_DATAGRAM_H__
+
+#include <memory>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "noncopyable.h"
+
+namespace apollo
+{
+/**
+ * @brief UDP数据报批量收发类
+ * @details 预先分配N个接收缓冲区及mmsghdr数组, 通过hook后的recvmmsg/sendmmsg
+ *          每次唤醒最多收发N个数据报, 避免每个数据报一次系统调用/一次epoll重新注册
+ *          内核支持时可使用UDP GSO(发送时由内核分段)与UDP GRO(接收时由内核合并)
+ */
+class DatagramBatch : Noncopyable {
+public:
+    typedef std::shared_ptr<DatagramBatch> ptr;
+
+    /**
+     * @brief 构造函数
+     * @param[in] capacity 单次最多收发的数据报数量
+     * @param[in] buffer_size 每个接收缓冲区大小(开启GRO时建议为65535)
+     */
+    DatagramBatch(size_t capacity = 64, size_t buffer_size = 2048);
+
+    /**
+     * @brief 析构函数
+     */
+    ~DatagramBatch();
+
+    /**
+     * @brief 批量接收数据报
+     * @details 没有数据时挂起当前协程, 有数据后一次取走已就绪的所有数据报(最多capacity个)
+     * @param[in] fd UDP socket句柄
+     * @param[in] flags recvmmsg标志
+     * @return 接收到的数据报数量, 失败返回-1
+     */
+    int recv(int fd, int flags = 0);
+
+    /**
+     * @brief 接收到的数据报数量
+     */
+    size_t received() const { return m_received;}
+
+    /**
+     * @brief 第i个数据报的内容
+     */
+    const void* data(size_t i) const { return &m_buffers[i * m_bufferSize];}
+
+    /**
+     * @brief 第i个数据报的长度
+     */
+    size_t size(size_t i) const { return m_recvMsgs[i].msg_len;}
+
+    /**
+     * @brief 第i个数据报的来源地址
+     */
+    const sockaddr* addr(size_t i) const { return (const sockaddr*)&m_addrs[i];}
+
+    /**
+     * @brief 第i个数据报来源地址的长度
+     */
+    socklen_t addrLen(size_t i) const { return m_recvMsgs[i].msg_hdr.msg_namelen;}
+
+    /**
+     * @brief 第i个数据报的GRO分段大小, 0表示未被合并
+     * @details 被合并的数据报由若干个该大小的分段(最后一个可能更短)首尾相接组成
+     */
+    uint16_t segmentSize(size_t i) const { return m_segments[i];}
+
+    /**
+     * @brief 添加一个待发送的数据报(不拷贝数据, data在send返回之前必须有效)
+     * @param[in] data 数据
+     * @param[in] len 数据长度
+     * @param[in] to 目标地址, 已connect的socket可为nullptr
+     * @param[in] tolen 目标地址长度
+     * @param[in] gso_size 大于0时由内核按该大小分段发送(UDP GSO)
+     * @return 发送队列已满返回false
+     */
+    bool add(const void* data, size_t len, const sockaddr* to = nullptr
+            ,socklen_t tolen = 0, uint16_t gso_size = 0);
+
+    /**
+     * @brief 待发送的数据报数量
+     */
+    size_t pending() const { return m_pending;}
+
+    /**
+     * @brief 发送所有待发送的数据报, 发送缓冲区满时挂起当前协程
+     * @param[in] fd UDP socket句柄
+     * @param[in] flags sendmmsg标志
+     * @return 发送成功的数据报数量, 一个都未发出时返回-1, 队列为空时返回0
+     * @details 出错时未发出的数据报保留在队列中(pending()>0), errno为出错原因, 可再次调用send重试
+     */
+    int send(int fd, int flags = 0);
+
+    /**
+     * @brief 清空发送队列
+     */
+    void clear() { m_pending = 0;}
+
+    /**
+     * @brief 单次最多收发的数据报数量
+     */
+    size_t capacity() const { return m_capacity;}
+
+    /**
+     * @brief 开启UDP GRO
+     * @return 内核不支持时返回false
+     */
+    static bool EnableGro(int fd);
+
+private:
+    /**
+     * @brief 丢弃前n个已发送的数据报, 剩余的移到队首
+     */
+    void compact(size_t n);
+
+private:
+    // 单次最多收发的数据报数量
+    size_t m_capacity;
+    // 每个接收缓冲区大小
+    size_t m_bufferSize;
+    // 接收到的数据报数量
+    size_t m_received = 0;
+    // 待发送的数据报数量
+    size_t m_pending = 0;
+    // 接收缓冲区(capacity * buffer_size)
+    std::vector<char> m_buffers;
+    // 接收缓冲区iovec
+    std::vector<iovec> m_recvIovs;
+    // 来源地址
+    std::vector<sockaddr_storage> m_addrs;
+    // 接收辅助数据(GRO分段大小)
+    std::vector<char> m_recvControls;
+    // GRO分段大小
+    std::vector<uint16_t> m_segments;
+    // 接收mmsghdr
+    std::vector<mmsghdr> m_recvMsgs;
+    // 发送iovec
+    std::vector<iovec> m_sendIovs;
+    // 发送辅助数据(GSO分段大小)
+    std::vector<char> m_sendControls;
+    // 发送mmsghdr
+    std::vector<mmsghdr> m_sendMsgs;
+};
+
+} // namespace apollo
+
+#endif
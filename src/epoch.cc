@@ -0,0 +1,108 @@
+#include "epoch.h"
+
+namespace apollo
+{
+// 线程退出时归还线程记录, 未回收的对象留给复用该记录的线程
+struct EpochRecordHolder {
+    EpochManager::Record* record = nullptr;
+
+    ~EpochRecordHolder() {
+        if(record) {
+            record->state.store(0);
+            record->used.store(false);
+        }
+    }
+};
+
+static thread_local EpochRecordHolder t_holder;
+
+EpochManager::EpochManager() {
+}
+
+// 获取当前线程的记录
+EpochManager::Record* EpochManager::getRecord() {
+    if(t_holder.record) {
+        return t_holder.record;
+    }
+    // 优先复用已退出线程的记录
+    for(Record* rec = m_records.load(); rec; rec = rec->next) {
+        bool expected = false;
+        if(!rec->used.load() && rec->used.compare_exchange_strong(expected, true)) {
+            t_holder.record = rec;
+            return rec;
+        }
+    }
+    Record* rec = new Record;
+    rec->used.store(true);
+    Record* head = m_records.load();
+    do {
+        rec->next = head;
+    } while(!m_records.compare_exchange_weak(head, rec));
+    t_holder.record = rec;
+    return rec;
+}
+
+// 进入读临界区
+void EpochManager::enter() {
+    Record* rec = getRecord();
+    if(rec->nest++ == 0) {
+        // seq_cst写入, 保证之后对共享指针的读取不会被重排到声明进入之前
+        rec->state.store((m_epoch.load() << 1) | 1);
+    }
+}
+
+// 离开读临界区
+void EpochManager::leave() {
+    Record* rec = t_holder.record;
+    if(--rec->nest == 0) {
+        // 离开只需保证之前的读取不会被重排到其后
+        rec->state.store(0, std::memory_order_release);
+    }
+}
+
+// 延迟回收
+void EpochManager::retire(void* ptr, Deleter deleter) {
+    Record* rec = getRecord();
+    rec->limbo.push_back(Retired{ptr, deleter, m_epoch.load()});
+    collect();
+}
+
+// 尝试推进全局epoch并回收
+void EpochManager::collect() {
+    Record* rec = getRecord();
+    tryAdvance();
+    reclaim(rec);
+}
+
+// 推进全局epoch
+bool EpochManager::tryAdvance() {
+    uint64_t epoch = m_epoch.load();
+    for(Record* rec = m_records.load(); rec; rec = rec->next) {
+        uint64_t state = rec->state.load();
+        if((state & 1) && (state >> 1) != epoch) {
+            return false;
+        }
+    }
+    return m_epoch.compare_exchange_strong(epoch, epoch + 1);
+}
+
+// 回收对象
+void EpochManager::reclaim(Record* rec) {
+    // 在临界区内回收会回收到自己仍可能持有的对象
+    if(rec->nest) {
+        return;
+    }
+    uint64_t epoch = m_epoch.load();
+    size_t keep = 0;
+    for(size_t i = 0; i < rec->limbo.size(); ++i) {
+        Retired& r = rec->limbo[i];
+        if(r.epoch + 2 <= epoch) {
+            r.deleter(r.ptr);
+        } else {
+            rec->limbo[keep++] = r;
+        }
+    }
+    rec->limbo.resize(keep);
+}
+
+} // namespace apollo
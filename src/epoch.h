@@ -0,0 +1,122 @@
+#ifndef __APOLLO_EPOCH_H__
+#define __APOLLO_EPOCH_H__
+
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+
+#include "noncopyable.h"
+#include "singleton.h"
+
+namespace apollo
+{
+/**
+ * @brief 基于epoch的内存回收(EBR)
+ * @details 读者在EpochGuard作用域内无锁读取共享指针; 写者将对象从共享结构中摘除后调用retire,
+ *          对象在所有可能看到它的读者离开作用域(全局epoch前进两次)之后才被回收
+ *          EpochGuard作用域内不能挂起协程, 否则协程可能在其他线程恢复, 且会阻塞回收
+ */
+class EpochManager : Noncopyable {
+public:
+    /**
+     * @brief 回收函数
+     */
+    typedef void (*Deleter)(void*);
+
+    EpochManager();
+
+    /**
+     * @brief 当前线程进入读临界区, 可嵌套
+     */
+    void enter();
+
+    /**
+     * @brief 当前线程离开读临界区
+     */
+    void leave();
+
+    /**
+     * @brief 延迟回收一个已从共享结构中摘除的对象
+     * @param[in] ptr 对象指针
+     * @param[in] deleter 回收函数, 在安全时以ptr为参数调用
+     */
+    void retire(void* ptr, Deleter deleter);
+
+    /**
+     * @brief 延迟delete一个对象
+     */
+    template<class T>
+    void retire(T* ptr) {
+        retire(ptr, [](void* p) { delete (T*)p; });
+    }
+
+    /**
+     * @brief 尝试推进全局epoch, 并回收当前线程可以回收的对象
+     */
+    void collect();
+
+    /**
+     * @brief 全局epoch
+     */
+    uint64_t getEpoch() const { return m_epoch;}
+
+private:
+    // 待回收的对象
+    struct Retired {
+        void* ptr;
+        Deleter deleter;
+        uint64_t epoch;
+    };
+
+    // 每个线程的记录, 线程退出后可被新线程复用, 不释放
+    struct Record {
+        // 最低位表示是否在临界区内, 其余位为进入时的全局epoch
+        std::atomic<uint64_t> state {0};
+        // 是否被线程占用
+        std::atomic<bool> used {false};
+        // 嵌套层数
+        uint32_t nest = 0;
+        // 待回收的对象
+        std::vector<Retired> limbo;
+        // 链表中的下一个
+        Record* next = nullptr;
+    };
+
+    /**
+     * @brief 获取当前线程的记录
+     */
+    Record* getRecord();
+
+    /**
+     * @brief 所有在临界区内的线程都已看到当前epoch时推进全局epoch
+     */
+    bool tryAdvance();
+
+    /**
+     * @brief 回收rec中可以回收的对象
+     */
+    void reclaim(Record* rec);
+
+    friend struct EpochRecordHolder;
+private:
+    // 全局epoch
+    std::atomic<uint64_t> m_epoch {1};
+    // 线程记录链表
+    std::atomic<Record*> m_records {nullptr};
+};
+
+/// epoch管理器单例
+typedef Singleton<EpochManager> EpochMgr;
+
+/**
+ * @brief 读临界区作用域
+ */
+class EpochGuard : Noncopyable {
+public:
+    EpochGuard() { EpochMgr::GetInstance()->enter();}
+    ~EpochGuard() { EpochMgr::GetInstance()->leave();}
+};
+
+} // namespace apollo
+
+#endif
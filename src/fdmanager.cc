@@ -1,23 +1,46 @@
 #include "fdmanager.h"
+#include "epoch.h"
 #include "hook.h"
+#include "iomanager.h"
+#include "log.h"
+#include "macro.h"
 
+#include <algorithm>
+#include <atomic>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 namespace apollo
 {
+static apollo::Logger::ptr g_logger = APOLLO_LOG_NAME("system");
+
+// 全局的复用代数计数器: 对象池中的FdCtx可能被另一个句柄号重用,
+// 各对象单独计数时, 新句柄可能与旧句柄的(fd, generation)相同
+static std::atomic<uint32_t> s_generation {0};
+
+static uint32_t NextGeneration() {
+    uint32_t gen;
+    do {
+        gen = s_generation.fetch_add(1, std::memory_order_relaxed) + 1;
+        // 0保留给非FdCtx的epoll事件(如IOManager的tickle管道)
+    } while(gen == 0);
+    return gen;
+}
+
 // 通过文件句柄构造FdCtx
 FdCtx::FdCtx(int fd)
-    :m_isInit(false)
+    :m_fd(fd)
+    ,m_isInit(false)
     ,m_isSocket(false)
     ,m_sysNonblock(false)
     ,m_userNonblock(false)
     ,m_isClosed(false)
-    ,m_fd(fd)
     ,m_recvTimeout(-1)
     ,m_sendTimeout(-1) {
-    init();
+    if(m_fd != -1) {
+        init();
+    }
 }
 
 // 析构函数
@@ -56,6 +79,37 @@ bool FdCtx::init() {
     return m_isInit;
 }
 
+// 复用时重置为新的文件句柄
+void FdCtx::reset(int fd) {
+    m_isInit = false;
+    m_isSocket = false;
+    m_sysNonblock = false;
+    m_userNonblock = false;
+    m_isClosed.store(false, std::memory_order_relaxed);
+    m_recvTimeout = -1;
+    m_sendTimeout = -1;
+    m_fd = fd;
+    m_generation = NextGeneration();
+    m_events = 0;
+    m_iom = nullptr;
+    resetContext(m_read);
+    resetContext(m_write);
+    resetContext(m_errqueue);
+    m_zerocopy = 0;
+    m_zcSent = 0;
+    m_zcDone = 0;
+    m_zcCopied = 0;
+#ifdef APOLLO_FD_STATS
+    m_bytesIn = 0;
+    m_bytesOut = 0;
+    m_syscalls = 0;
+    m_parks = 0;
+    m_timeouts = 0;
+    m_parkedUs = 0;
+#endif
+    m_nextFree = nullptr;
+}
+
 // 设置超时时间
 void FdCtx::setTimeout(int type, uint64_t v) {
     if(type == SO_RCVTIMEO) {
@@ -74,45 +128,217 @@ uint64_t FdCtx::getTimeout(int type) {
     }
 }
 
+// 获取事件上下文
+FdCtx::EventContext& FdCtx::getContext(uint32_t event) {
+    switch(event) {
+        case IOManager::READ:
+            return m_read;
+        case IOManager::WRITE:
+            return m_write;
+        case IOManager::ERRQUEUE:
+            return m_errqueue;
+        default:
+            APOLLO_ASSERT2(false, "Get Context Failed");
+    }
+    throw std::invalid_argument("Get Invalid Context Event");
+}
+
+// 重置事件上下文
+void FdCtx::resetContext(EventContext& ctx) {
+    ctx.scheduler = nullptr;
+    ctx.fiber.reset();
+    ctx.cb = nullptr;
+}
+
+// 触发事件
+void FdCtx::triggerEvent(uint32_t event) {
+    APOLLO_LOG_INFO(g_logger) << "Call Trigger Event : " << event << "========";
+    APOLLO_ASSERT(m_events & event);
+    m_events &= ~event;
+    if(!m_events) {
+        m_iom = nullptr;
+    }
+    EventContext& ctx = getContext(event);
+    if(ctx.cb) {
+        ctx.scheduler->schedule(&ctx.cb);
+    } else {
+        ctx.scheduler->schedule(&ctx.fiber);
+    }
+    ctx.scheduler = nullptr;
+    return;
+}
+
+// 取排序字段的值
+uint64_t FdStats::get(SortBy by) const {
+    switch(by) {
+        case BYTES:
+            return bytesIn + bytesOut;
+        case SYSCALLS:
+            return syscalls;
+        case PARKS:
+            return parks;
+        case TIMEOUTS:
+            return timeouts;
+        case PARKED_TIME:
+            return parkedUs;
+    }
+    return 0;
+}
+
+// 获取I/O统计
+FdStats FdCtx::getStats() const {
+    FdStats st;
+    st.fd = m_fd;
+#ifdef APOLLO_FD_STATS
+    st.bytesIn = m_bytesIn.load(std::memory_order_relaxed);
+    st.bytesOut = m_bytesOut.load(std::memory_order_relaxed);
+    st.syscalls = m_syscalls.load(std::memory_order_relaxed);
+    st.parks = m_parks.load(std::memory_order_relaxed);
+    st.timeouts = m_timeouts.load(std::memory_order_relaxed);
+    st.parkedUs = m_parkedUs.load(std::memory_order_relaxed);
+#endif
+    return st;
+}
+
+// 记录零拷贝发送完成区间
+void FdCtx::onZerocopyDone(uint32_t lo, uint32_t hi, bool copied) {
+    // 序号为32位回绕计数, 区间长度按无符号差值计算
+    uint64_t n = (uint32_t)(hi - lo) + 1;
+    m_zcDone += n;
+    if(copied) {
+        m_zcCopied += n;
+    }
+}
+
+FdManager::Chunk::Chunk() {
+    for(int i = 0; i < s_chunk_size; ++i) {
+        slots[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
 // 句柄管理器 构造函数
 FdManager::FdManager() {
-    m_datas.resize(64);
+    for(int i = 0; i < s_dir_size; ++i) {
+        m_chunks[i].store(nullptr, std::memory_order_relaxed);
+    }
 }
 
 // 获取/创建文件句柄上下文类
-FdCtx::ptr FdManager::get(int fd, bool auto_create) {
-    if(fd == -1) {
+FdCtx* FdManager::get(int fd, bool auto_create, bool init) {
+    if(fd < 0 || fd >= s_dir_size * s_chunk_size) {
         return nullptr;
     }
-    RWMutexType::ReadLock lock(m_mutex);
-    if((int)m_datas.size() <= fd) {
-        if(auto_create == false) {
-            return nullptr;
-        }
-    } else {
-        if(m_datas[fd] || !auto_create) {
-            return m_datas[fd];
+    std::atomic<Chunk*>& dir = m_chunks[fd >> s_chunk_bits];
+    Chunk* chunk = dir.load(std::memory_order_acquire);
+    if(chunk) {
+        FdCtx* ctx = chunk->slots[fd & (s_chunk_size - 1)].load(std::memory_order_acquire);
+        if(!auto_create || (ctx && (!init || ctx->isInit()))) {
+            return ctx;
         }
+    } else if(!auto_create) {
+        return nullptr;
     }
-    lock.unlock();
 
-    RWMutexType::WriteLock lock2(m_mutex);
-    FdCtx::ptr ctx(new FdCtx(fd));
-    if(fd >= (int)m_datas.size()) {
-        m_datas.resize(fd * 1.5);
+    MutexType::Lock lock(m_mutex);
+    chunk = dir.load(std::memory_order_relaxed);
+    if(!chunk) {
+        chunk = new Chunk;
+        dir.store(chunk, std::memory_order_release);
+    }
+    std::atomic<FdCtx*>& slot = chunk->slots[fd & (s_chunk_size - 1)];
+    FdCtx* ctx = slot.load(std::memory_order_relaxed);
+    if(ctx) {
+        // 之前由IOManager::addEvent创建, 尚未接管
+        if(init) {
+            ctx->init();
+        }
+        return ctx;
+    }
+    ctx = alloc();
+    ctx->reset(fd);
+    if(init) {
+        ctx->init();
     }
-    m_datas[fd] = ctx;
+    slot.store(ctx, std::memory_order_release);
     return ctx;
 }
 
 // 删除文件句柄
 void FdManager::del(int fd) {
-    RWMutexType::WriteLock lock(m_mutex);
-    if((int)m_datas.size() <= fd) {
+    if(fd < 0 || fd >= s_dir_size * s_chunk_size) {
         return;
     }
-    m_datas[fd].reset();
+    FdCtx* ctx = nullptr;
+    {
+        MutexType::Lock lock(m_mutex);
+        Chunk* chunk = m_chunks[fd >> s_chunk_bits].load(std::memory_order_relaxed);
+        if(!chunk) {
+            return;
+        }
+        ctx = chunk->slots[fd & (s_chunk_size - 1)].exchange(nullptr, std::memory_order_acq_rel);
+        if(!ctx) {
+            return;
+        }
+        // 仍持有该指针的读者会看到已关闭
+        ctx->m_isClosed.store(true, std::memory_order_release);
+    }
+    EpochMgr::GetInstance()->retire(ctx, &FdManager::Recycle);
 }
 
-} // namespace apollo
+// 取I/O统计排名前n的句柄
+void FdManager::topStats(std::vector<FdStats>& result, size_t n, FdStats::SortBy by) {
+    result.clear();
+    if(n == 0) {
+        return;
+    }
+    {
+        EpochGuard guard;
+        for(int i = 0; i < s_dir_size; ++i) {
+            Chunk* chunk = m_chunks[i].load(std::memory_order_acquire);
+            if(!chunk) {
+                continue;
+            }
+            for(int j = 0; j < s_chunk_size; ++j) {
+                FdCtx* ctx = chunk->slots[j].load(std::memory_order_acquire);
+                if(ctx) {
+                    result.push_back(ctx->getStats());
+                }
+            }
+        }
+    }
+    auto cmp = [by](const FdStats& a, const FdStats& b) {
+        return a.get(by) > b.get(by);
+    };
+    if(result.size() > n) {
+        std::partial_sort(result.begin(), result.begin() + n, result.end(), cmp);
+        result.resize(n);
+    } else {
+        std::sort(result.begin(), result.end(), cmp);
+    }
+}
+
+// 从slab分配
+FdCtx* FdManager::alloc() {
+    if(!m_free) {
+        FdCtx* slab = new FdCtx[s_slab_size];
+        m_slabs.push_back(slab);
+        for(int i = s_slab_size - 1; i >= 0; --i) {
+            slab[i].m_nextFree = m_free;
+            m_free = &slab[i];
+        }
+    }
+    FdCtx* ctx = m_free;
+    m_free = ctx->m_nextFree;
+    return ctx;
+}
 
+// 放回slab
+void FdManager::Recycle(void* ptr) {
+    FdManager* mgr = FdMgr::GetInstance();
+    FdCtx* ctx = (FdCtx*)ptr;
+    MutexType::Lock lock(mgr->m_mutex);
+    ctx->m_nextFree = mgr->m_free;
+    mgr->m_free = ctx;
+}
+
+} // namespace apollo
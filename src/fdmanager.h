@@ -3,31 +3,104 @@
 
 #include <memory>
 #include <vector>
+#include <atomic>
+#include <functional>
 
-#include "thread.h"
+#include "fiber.h"
+#include "mutex.h"
 #include "singleton.h"
 
 namespace apollo
 {
+class Scheduler;
+class IOManager;
+
+/**
+ * @brief 句柄I/O统计快照
+ * @details 编译时定义APOLLO_FD_STATS(cmake -DAPOLLO_FD_STATS=ON)才会统计, 否则全为0
+ */
+struct FdStats {
+    /**
+     * @brief 排序字段
+     */
+    enum SortBy {
+        // 读写字节数之和
+        BYTES,
+        // 系统调用次数
+        SYSCALLS,
+        // 因EAGAIN挂起的次数
+        PARKS,
+        // 超时次数
+        TIMEOUTS,
+        // 挂起的总时间
+        PARKED_TIME
+    };
+
+    // 文件句柄
+    int fd = -1;
+    // 读入字节数
+    uint64_t bytesIn = 0;
+    // 写出字节数
+    uint64_t bytesOut = 0;
+    // 系统调用次数
+    uint64_t syscalls = 0;
+    // 因EAGAIN挂起的次数
+    uint64_t parks = 0;
+    // 超时次数
+    uint64_t timeouts = 0;
+    // 挂起的总时间(微秒)
+    uint64_t parkedUs = 0;
+
+    /**
+     * @brief 取排序字段的值
+     */
+    uint64_t get(SortBy by) const;
+};
+
 /**
  * @brief 文件句柄上下文类
- * @details 管理文件句柄类型(判断句柄是否为socket)
- *          是否阻塞,是否关闭,读/写超时时间
+ * @details 每个句柄唯一的状态记录: 句柄类型(判断句柄是否为socket),
+ *          是否阻塞,是否关闭,读/写超时时间, 以及IOManager注册的事件与等待者
+ *          由FdManager从slab中分配并复用, 只能在EpochGuard作用域内访问
  */
-class FdCtx : public std::enable_shared_from_this<FdCtx> {
+class FdCtx {
+friend class FdManager;
+friend class IOManager;
 public:
-    typedef std::shared_ptr<FdCtx> ptr;
-    
+    typedef Mutex MutexType;
+
+    /**
+     * @brief 事件上下文
+     */
+    struct EventContext {
+        // 事件执行的scheduler
+        Scheduler* scheduler = nullptr;
+        // 事件的协程
+        Fiber::ptr fiber;
+        // 事件的执行函数
+        std::function<void()> cb;
+    };
+
     /**
      * @brief 通过文件句柄构造FdCtx
      */
-    FdCtx(int fd);
+    FdCtx(int fd = -1);
     
     /**
      * @brief 析构函数
      */
     ~FdCtx();
 
+    /**
+     * @brief 文件句柄
+     */
+    int getFd() const { return m_fd;}
+
+    /**
+     * @brief 复用代数, 每次分配给新句柄时从全局计数器取值, 与fd一起识别过期的epoll事件
+     */
+    uint32_t getGeneration() const { return m_generation;}
+
     /**
      * @brief 是否初始化完成
      */
@@ -41,7 +114,7 @@ public:
     /**
      * @brief 是否已关闭
      */
-    bool isClose() const { return m_isClosed;}
+    bool isClose() const { return m_isClosed.load(std::memory_order_acquire);}
 
     /**
      * @brief 设置用户主动设置非阻塞
@@ -79,12 +152,93 @@ public:
      */
     uint64_t getTimeout(int type);
 
+    /**
+     * @brief 零拷贝发送状态 0 未尝试, 1 已开启SO_ZEROCOPY, -1 不支持
+     */
+    int getZerocopy() const { return m_zerocopy;}
+
+    /**
+     * @brief 设置零拷贝发送状态
+     */
+    void setZerocopy(int v) { m_zerocopy = v;}
+
+    /**
+     * @brief 记录一次成功的MSG_ZEROCOPY发送(内核为每次发送分配一个递增序号)
+     */
+    void onZerocopySent() { ++m_zcSent;}
+
+    /**
+     * @brief 记录内核通知的完成区间[lo, hi]
+     * @param[in] copied 内核是否退化为拷贝发送
+     */
+    void onZerocopyDone(uint32_t lo, uint32_t hi, bool copied);
+
+    /**
+     * @brief 是否还有未完成的零拷贝发送
+     */
+    bool hasZerocopyPending() const { return m_zcDone < m_zcSent;}
+
+    /**
+     * @brief 退化为拷贝发送的次数
+     */
+    uint64_t getZerocopyCopied() const { return m_zcCopied;}
+
+    /**
+     * @brief 累加一次hook调用的I/O统计, 未开启APOLLO_FD_STATS时为空操作
+     */
+    void addStats(const FdStats& v) {
+#ifdef APOLLO_FD_STATS
+        m_bytesIn.fetch_add(v.bytesIn, std::memory_order_relaxed);
+        m_bytesOut.fetch_add(v.bytesOut, std::memory_order_relaxed);
+        m_syscalls.fetch_add(v.syscalls, std::memory_order_relaxed);
+        m_parks.fetch_add(v.parks, std::memory_order_relaxed);
+        m_timeouts.fetch_add(v.timeouts, std::memory_order_relaxed);
+        m_parkedUs.fetch_add(v.parkedUs, std::memory_order_relaxed);
+#endif
+    }
+
+    /**
+     * @brief 获取I/O统计
+     */
+    FdStats getStats() const;
+
 private:
     /**
      * @brief 初始化
      */
     bool init();
+
+    /**
+     * @brief 复用时重置为新的文件句柄, 不初始化
+     */
+    void reset(int fd);
+
+    /**
+     * @brief 获取事件上下文
+     * @param[in] event IOManager::READ, IOManager::WRITE 或 IOManager::ERRQUEUE
+     */
+    EventContext& getContext(uint32_t event);
+
+    /**
+     * @brief 重置事件上下文
+     */
+    void resetContext(EventContext& ctx);
+
+    /**
+     * @brief 触发事件, 调用时需持有m_mutex
+     */
+    void triggerEvent(uint32_t event);
 private:
+    // 热路径字段在前, hook与事件处理只访问对象开头的一段
+    // 文件句柄
+    int m_fd;
+    // 复用代数(全局唯一, 回绕前不重复)
+    uint32_t m_generation = 0;
+    // 已注册的事件(IOManager::Event)
+    uint32_t m_events = 0;
+    // 注册事件的IOManager, 句柄只在它的epoll上, m_events非0时有效
+    // 该IOManager有未完成的事件, stop不会返回, 因此指针在此期间有效
+    IOManager* m_iom = nullptr;
     // 是否初始化
     bool m_isInit: 1;
     // 是否socket
@@ -93,22 +247,55 @@ private:
     bool m_sysNonblock: 1;
     // 是否用户主动设置非阻塞
     bool m_userNonblock: 1;
-    // 是否关闭
-    bool m_isClosed: 1;
-    // 文件句柄
-    int m_fd;
+    // 是否关闭, del时由其他线程设置
+    std::atomic<bool> m_isClosed;
     // 读超时时间毫秒
     uint64_t m_recvTimeout;
     // 写超时时间毫秒
     uint64_t m_sendTimeout;
+    // 事件锁
+    MutexType m_mutex;
+    // 读事件
+    EventContext m_read;
+    // 写事件
+    EventContext m_write;
+    // 错误队列事件
+    EventContext m_errqueue;
+    // 零拷贝发送状态
+    int m_zerocopy = 0;
+    // 已发出的零拷贝发送数
+    std::atomic<uint64_t> m_zcSent {0};
+    // 已完成的零拷贝发送数
+    std::atomic<uint64_t> m_zcDone {0};
+    // 退化为拷贝发送的次数
+    std::atomic<uint64_t> m_zcCopied {0};
+#ifdef APOLLO_FD_STATS
+    // 读入字节数
+    std::atomic<uint64_t> m_bytesIn {0};
+    // 写出字节数
+    std::atomic<uint64_t> m_bytesOut {0};
+    // 系统调用次数
+    std::atomic<uint64_t> m_syscalls {0};
+    // 因EAGAIN挂起的次数
+    std::atomic<uint64_t> m_parks {0};
+    // 超时次数
+    std::atomic<uint64_t> m_timeouts {0};
+    // 挂起的总时间(微秒)
+    std::atomic<uint64_t> m_parkedUs {0};
+#endif
+    // slab空闲链表中的下一个
+    FdCtx* m_nextFree = nullptr;
 };
 
 /**
  * @brief 文件句柄管理类
+ * @details 句柄表为两级数组(目录 -> 1024个槽位的块), 块只增不减, 读取无锁
+ *          FdCtx从slab中分配, del后经epoch回收放回slab复用, 内存不归还
+ *          get返回的指针只在调用方持有的EpochGuard作用域内有效
  */
 class FdManager {
 public:
-    typedef RWMutex RWMutexType;
+    typedef Mutex MutexType;
     /**
      * @brief 无参构造函数
      */
@@ -118,20 +305,62 @@ public:
      * @brief 获取/创建文件句柄类FdCtx
      * @param[in] fd 文件句柄
      * @param[in] auto_create 是否自动创建
-     * @return 返回对应文件句柄类FdCtx::ptr
+     * @param[in] init 创建时是否初始化, 即由hook接管: 检测句柄类型, 将socket设为系统非阻塞;
+     *                 为false时只用于记录事件状态, 不改变句柄的属性, 之后以true获取时再初始化
+     * @return 返回对应文件句柄类FdCtx, 不存在返回nullptr
+     * @pre 调用方持有EpochGuard
      */
-    FdCtx::ptr get(int fd, bool auto_create = false);
+    FdCtx* get(int fd, bool auto_create = false, bool init = true);
 
     /**
      * @brief 删除文件句柄类
      * @param[in] fd 文件句柄
+     * @pre 调用方未持有EpochGuard
      */
     void del(int fd);
+
+    /**
+     * @brief 取I/O统计排名前n的句柄
+     * @param[out] result 按by从大到小排列的统计快照
+     * @param[in] n 最多返回的数量
+     * @param[in] by 排序字段
+     */
+    void topStats(std::vector<FdStats>& result, size_t n
+            ,FdStats::SortBy by = FdStats::BYTES);
 private:
-    // 读写锁
-    RWMutexType m_mutex;
-    // 文件句柄集合
-    std::vector<FdCtx::ptr> m_datas;
+    /**
+     * @brief 从slab分配一个FdCtx, 调用时需持有m_mutex
+     */
+    FdCtx* alloc();
+
+    /**
+     * @brief epoch回收回调, 将FdCtx放回slab
+     */
+    static void Recycle(void* ptr);
+private:
+    // 每块槽位数的位数
+    static const int s_chunk_bits = 10;
+    // 每块槽位数
+    static const int s_chunk_size = 1 << s_chunk_bits;
+    // 目录大小, 最大支持 s_dir_size * s_chunk_size 个句柄
+    static const int s_dir_size = 4096;
+    // slab每次分配的FdCtx数
+    static const int s_slab_size = 64;
+
+    // 句柄块
+    struct Chunk {
+        std::atomic<FdCtx*> slots[s_chunk_size];
+        Chunk();
+    };
+
+    // 创建/删除时的互斥锁
+    MutexType m_mutex;
+    // 句柄表目录
+    std::atomic<Chunk*> m_chunks[s_dir_size];
+    // slab内存块, 与单例同生命周期, 不释放(进程退出时仍可能有hook的close访问句柄表)
+    std::vector<FdCtx*> m_slabs;
+    // slab空闲链表
+    FdCtx* m_free = nullptr;
 };
 
 /// 文件句柄单例
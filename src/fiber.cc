@@ -1,10 +1,13 @@
+#include <algorithm>
 #include <atomic>
 
 #include "macro.h"
 #include "fiber.h"
+#include "corkwriter.h"
 #include "log.h"
 #include "config.h"
 #include "scheduler.h"
+#include "util.h"
 
 namespace apollo
 {
@@ -18,6 +21,9 @@ static std::atomic<uint64_t> s_fiber_count {0};             // 总fiber数量
 
 static thread_local Fiber* t_fiber = nullptr;               // 当前fiber
 static thread_local Fiber::ptr t_mainFiber = nullptr;       // 主fiber
+// 没有fiber时的空上下文
+// 不用带析构的thread_local, 以免改变线程退出时各thread_local的析构顺序(主协程析构时还会写日志)
+static const FiberContext::ptr s_null_context;
 
 // 动态分配内存
 class MallocStackAllocator {
@@ -51,7 +57,8 @@ Fiber::Fiber() {
 Fiber::Fiber(std::function<void()> cb, size_t stackSize, bool use_caller)
     : m_id(++s_fiber_id)
     , m_cb(cb)
-    , m_caller(use_caller) {
+    , m_caller(use_caller)
+    , m_context(GetContext()) {
     ++s_fiber_count;
 
     m_stackSize = m_stackSize ? m_stackSize : g_fiber_stack_size->getValue();
@@ -75,6 +82,7 @@ Fiber::Fiber(std::function<void()> cb, size_t stackSize, bool use_caller)
 
 Fiber::~Fiber() {
     --s_fiber_count;
+    CorkWriter::Detach(this);
 
     if(m_stack) {   // 主协程不会有栈空间，因此当有栈空间默认为子协程
         APOLLO_ASSERT(m_state == TERM
@@ -103,6 +111,9 @@ void Fiber::reset(std::function<void()> cb) {
                 || m_state == INIT);
     
     m_cb = cb;
+    CorkWriter::Detach(this);
+    m_deadline = (uint64_t)-1;
+    m_context = nullptr;
     if(getcontext(&m_ctx)) {
         APOLLO_ASSERT2(false, "GETCONTEXT FAILED: ")
     }
@@ -205,6 +216,8 @@ void Fiber::MainFunc() {
     try {
         cur->m_cb();
         cur->m_cb = nullptr;
+        // 协程结束前写出仍暂存的数据(写出时可能挂起, 因此在置为TERM之前)
+        CorkWriter::FlushCurrent();
         cur->m_state = TERM;
     } catch(const std::exception& e) {
         cur->m_state = EXCEPT;
@@ -218,6 +231,9 @@ void Fiber::MainFunc() {
             << apollo::BacktraceToString();
     }
     
+    // 异常退出时暂存数据留给CorkWriter自己写出, 只解除与本协程的关联
+    CorkWriter::Detach(cur.get());
+
     auto raw_ptr = cur.get();
     cur.reset();                    // 将智能指针cur的引用数清零（否则cur将永远不会释放）
     
@@ -240,4 +256,81 @@ uint64_t Fiber::GetFiberId() {
     return 0;
 }
 
+// 返回当前协程的截止时间
+uint64_t Fiber::GetDeadline() {
+    if(t_fiber) {
+        return t_fiber->m_deadline;
+    }
+    return (uint64_t)-1;
+}
+
+// 返回当前协程的上下文
+const FiberContext::ptr& Fiber::GetContext() {
+    if(t_fiber) {
+        return t_fiber->m_context;
+    }
+    return s_null_context;
+}
+
+// 设置当前协程的上下文
+void Fiber::SetContext(FiberContext::ptr ctx) {
+    if(!t_fiber) {
+        // 普通线程上先创建主协程
+        GetThis();
+    }
+    t_fiber->m_context = std::move(ctx);
+}
+
+FiberContext::ptr FiberContext::With(const ptr& base, const std::string& key, const std::string& value) {
+    std::shared_ptr<FiberContext> ctx(new FiberContext);
+    if(base) {
+        ctx->m_items = base->m_items;
+    }
+    for(auto& i : ctx->m_items) {
+        if(i.first == key) {
+            i.second = value;
+            return ctx;
+        }
+    }
+    ctx->m_items.push_back(std::make_pair(key, value));
+    return ctx;
+}
+
+const std::string* FiberContext::get(const std::string& key) const {
+    for(auto& i : m_items) {
+        if(i.first == key) {
+            return &i.second;
+        }
+    }
+    return nullptr;
+}
+
+FiberContextScope::FiberContextScope(const std::string& key, const std::string& value)
+    : m_previous(Fiber::GetContext()) {
+    Fiber::SetContext(FiberContext::With(m_previous, key, value));
+}
+
+FiberContextScope::~FiberContextScope() {
+    Fiber::SetContext(std::move(m_previous));
+}
+
+FiberDeadline::FiberDeadline(uint64_t timeout_ms)
+    : m_fiber(Fiber::GetThis()) {
+    m_previous = m_fiber->getDeadline();
+    m_deadline = m_previous;
+    if(timeout_ms != (uint64_t)-1) {
+        m_deadline = std::min(m_previous, GetCurrentMS() + timeout_ms);
+    }
+    m_fiber->setDeadline(m_deadline);
+}
+
+FiberDeadline::~FiberDeadline() {
+    m_fiber->setDeadline(m_previous);
+}
+
+// 是否已超过截止时间
+bool FiberDeadline::expired() const {
+    return m_deadline != (uint64_t)-1 && GetCurrentMS() >= m_deadline;
+}
+
 } // namespace apollo
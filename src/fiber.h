@@ -4,11 +4,36 @@
 #include <memory>
 #include <ucontext.h>
 #include <functional>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "noncopyable.h"
 
 namespace apollo
 {
 
 class Scheduler;
+class CorkWriter;
+
+// 协程上下文(如trace_id, request_id), 创建后不再修改, 修改时复制一份
+// 协程创建及回调被调度时继承当前上下文, 只复制指针; 未使用时指针为空, 没有额外开销
+class FiberContext {
+public:
+    typedef std::shared_ptr<const FiberContext> ptr;
+    typedef std::vector<std::pair<std::string, std::string> > Items;
+
+    // 在base的基础上设置key, 返回新的上下文
+    static ptr With(const ptr& base, const std::string& key, const std::string& value);
+
+    // 获取key的值, 不存在时返回nullptr
+    const std::string* get(const std::string& key) const;
+
+    // 获取全部键值, 按设置的先后排列
+    const Items& getItems() const {return m_items;}
+private:
+    Items m_items;
+};
 
 // 协程类-轻量级线程
 class Fiber : public std::enable_shared_from_this<Fiber>
@@ -66,6 +91,24 @@ public:
     // 获取协程状态
     State getState() const {return m_state;};
 
+    // 获取协程上待合并写出的CorkWriter链表
+    CorkWriter* getCorked() const {return m_corked;}
+
+    // 设置协程上待合并写出的CorkWriter链表
+    void setCorked(CorkWriter* v) {m_corked = v;}
+
+    // 获取协程截止时间(绝对时间, 毫秒), (uint64_t)-1表示不限
+    uint64_t getDeadline() const {return m_deadline;}
+
+    // 设置协程截止时间, 之后该协程内所有hook的阻塞调用共享这一时间预算
+    void setDeadline(uint64_t v) {m_deadline = v;}
+
+    // 获取协程上下文
+    const FiberContext::ptr& getContext() const {return m_context;}
+
+    // 设置协程上下文
+    void setContext(FiberContext::ptr v) {m_context = std::move(v);}
+
 public:
     // 设置当前的运行协程
     static void SetThis(Fiber* f);
@@ -88,6 +131,15 @@ public:
     // 返回协程id
     static uint64_t GetFiberId();
 
+    // 返回当前协程的截止时间, 没有协程时返回(uint64_t)-1
+    static uint64_t GetDeadline();
+
+    // 返回当前协程的上下文, 没有协程时返回空
+    static const FiberContext::ptr& GetContext();
+
+    // 设置当前协程的上下文, 没有协程时先创建主协程
+    static void SetContext(FiberContext::ptr ctx);
+
 private:
     // 协程id
     uint64_t m_id = 0;
@@ -103,6 +155,45 @@ private:
     std::function<void()> m_cb;
     // 是否使用当前运行线程
     bool m_caller = false;
+    // 有待写出数据的CorkWriter链表，只由本协程访问
+    CorkWriter* m_corked = nullptr;
+    // 截止时间(绝对时间, 毫秒)
+    uint64_t m_deadline = (uint64_t)-1;
+    // 上下文
+    FiberContext::ptr m_context;
+};
+
+// 协程上下文作用域
+// 构造时为当前协程增加一项上下文, 析构时恢复原上下文; 其间创建或调度的协程/回调都会继承
+class FiberContextScope : Noncopyable {
+public:
+    FiberContextScope(const std::string& key, const std::string& value);
+    ~FiberContextScope();
+private:
+    // 原上下文
+    FiberContext::ptr m_previous;
+};
+
+// 协程截止时间作用域
+// 构造时将当前协程的截止时间收紧为 min(原截止时间, 当前时间 + timeout_ms)，析构时恢复原值
+// 可嵌套使用，内层只能缩短不能延长外层的时间预算
+class FiberDeadline : Noncopyable {
+public:
+    FiberDeadline(uint64_t timeout_ms);
+    ~FiberDeadline();
+
+    // 截止时间
+    uint64_t getDeadline() const {return m_deadline;}
+
+    // 是否已超过截止时间
+    bool expired() const;
+private:
+    // 所属协程
+    Fiber::ptr m_fiber;
+    // 原截止时间
+    uint64_t m_previous;
+    // 截止时间
+    uint64_t m_deadline;
 };
 
 } // namespace apollo
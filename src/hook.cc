@@ -4,9 +4,17 @@
 #include "fiber.h"
 #include "iomanager.h"
 #include "fdmanager.h"
+#include "epoch.h"
 #include "macro.h"
+#include "corkwriter.h"
+#include "util.h"
 
+#include <algorithm>
 #include <dlfcn.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
 
 static apollo::Logger::ptr g_logger = APOLLO_LOG_NAME("system");
 
@@ -30,11 +38,15 @@ static thread_local bool t_hook_enable = false;     // 设置hook局部变量
     XX(recv) \
     XX(recvfrom) \
     XX(recvmsg) \
+    XX(recvmmsg) \
     XX(write) \
     XX(writev) \
     XX(send) \
     XX(sendto) \
     XX(sendmsg) \
+    XX(sendmmsg) \
+    XX(sendfile) \
+    XX(splice) \
     XX(close) \
     XX(fcntl) \
     XX(ioctl) \
@@ -84,6 +96,11 @@ void set_hook_enable(bool flag) {
     t_hook_enable = flag;
 }
 
+// 配置项tcp.connect.timeout的当前值
+uint64_t get_connect_timeout() {
+    return g_tcp_connect_timeout->getValue();
+}
+
 } // namespace apollo
 
 // 超时器信息
@@ -91,6 +108,86 @@ struct timer_info {
     int cancelled = 0;
 };
 
+// 计算一次调用的绝对截止时间: 超时时间与当前协程截止时间取较早者
+static uint64_t get_expire(uint64_t timeout_ms) {
+    uint64_t deadline = apollo::Fiber::GetDeadline();
+    if(timeout_ms == (uint64_t)-1) {
+        return deadline;
+    }
+    return std::min(deadline, apollo::GetCurrentMS() + timeout_ms);
+}
+
+/**
+ * @brief 一次hook调用的I/O统计, 在调用结束时一次性提交到FdCtx
+ * @details 未定义APOLLO_FD_STATS时所有成员函数为空, 编译后不产生任何代码
+ */
+class io_stats {
+public:
+#ifdef APOLLO_FD_STATS
+    /**
+     * @param[in] ctx 调用开始时的句柄上下文, 与generation一起识别句柄是否被关闭后复用
+     */
+    io_stats(int fd, const apollo::FdCtx* ctx, uint32_t generation
+            ,uint32_t event, const char* hook_fun_name)
+        :m_ctx(ctx)
+        ,m_generation(generation)
+        ,m_event(event) {
+        m_stats.fd = fd;
+        // accept返回句柄, recvmmsg/sendmmsg返回消息数, 不计入字节数
+        m_bytes = strcmp(hook_fun_name, "accept")
+                && strcmp(hook_fun_name, "recvmmsg")
+                && strcmp(hook_fun_name, "sendmmsg");
+    }
+
+    ~io_stats() {
+        apollo::EpochGuard guard;
+        apollo::FdCtx* ctx = apollo::FdMgr::GetInstance()->get(m_stats.fd);
+        // 挂起期间句柄被关闭并复用时, 统计属于旧句柄, 丢弃
+        if(ctx && ctx == m_ctx && ctx->getGeneration() == m_generation) {
+            ctx->addStats(m_stats);
+        }
+    }
+
+    void onSyscall(ssize_t n) {
+        ++m_stats.syscalls;
+        if(n > 0 && m_bytes) {
+            if(m_event == apollo::IOManager::READ) {
+                m_stats.bytesIn += n;
+            } else {
+                m_stats.bytesOut += n;
+            }
+        }
+    }
+
+    void onPark() {
+        ++m_stats.parks;
+        m_parkStart = apollo::GetCurrentUS();
+    }
+
+    void onWake() {
+        m_stats.parkedUs += apollo::GetCurrentUS() - m_parkStart;
+    }
+
+    void onTimeout() {
+        ++m_stats.timeouts;
+    }
+private:
+    apollo::FdStats m_stats;
+    const apollo::FdCtx* m_ctx;
+    uint32_t m_generation;
+    uint32_t m_event;
+    bool m_bytes;
+    uint64_t m_parkStart = 0;
+#else
+    io_stats(int fd, const apollo::FdCtx* ctx, uint32_t generation
+            ,uint32_t event, const char* hook_fun_name) {}
+    void onSyscall(ssize_t n) {}
+    void onPark() {}
+    void onWake() {}
+    void onTimeout() {}
+#endif
+};
+
 template<typename OriginFun, typename... Args>
 static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
         uint32_t event, int timeout_so, Args&&... args) {
@@ -100,25 +197,43 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
 
     APOLLO_LOG_INFO(g_logger) << "do_io: " << hook_fun_name;
 
-    apollo::FdCtx::ptr ctx = apollo::FdMgr::GetInstance()->get(fd);
-    // 如果句柄上下文不存在，执行原函数
-    if(!ctx) {
+    // 句柄上下文只在EpochGuard内访问, 之后可能挂起协程, 先取出需要的状态
+    bool origin = false;
+    uint64_t to = (uint64_t)-1;
+    const apollo::FdCtx* stats_ctx = nullptr;
+    uint32_t generation = 0;
+    {
+        apollo::EpochGuard guard;
+        apollo::FdCtx* ctx = apollo::FdMgr::GetInstance()->get(fd);
+        if(!ctx) {
+            // 如果句柄上下文不存在，执行原函数
+            origin = true;
+        } else if(ctx->isClose()) {
+            // 如果句柄已经关闭
+            errno = EBADF;
+            return -1;
+        } else if(!ctx->isSocket() || ctx->getUserNonblock()) {
+            // 如果句柄上下文不是上下文或者用户设置了非阻塞，执行原函数
+            origin = true;
+        } else {
+            to = ctx->getTimeout(timeout_so);
+            stats_ctx = ctx;
+            generation = ctx->getGeneration();
+        }
+    }
+    if(origin) {
         return fun(fd, std::forward<Args>(args)...);
     }
 
-    // // 如果句柄已经关闭，执行原函数
-    if(ctx->isClose()) {
-        errno = EBADF;
+    io_stats stats(fd, stats_ctx, generation, event, hook_fun_name);
+    // 取出超时时间, 与协程截止时间合并为整个调用的截止时间, 重试等待不再重新计时
+    uint64_t expire = get_expire(to);
+    // 时间预算已经用完, 直接失败
+    if(expire != (uint64_t)-1 && apollo::GetCurrentMS() >= expire) {
+        stats.onTimeout();
+        errno = ETIMEDOUT;
         return -1;
     }
-
-    // // 如果句柄上下文不是上下文或者用户设置了非阻塞，执行原函数
-    if(!ctx->isSocket() || ctx->getUserNonblock()) {
-        return fun(fd, std::forward<Args>(args)...);
-    }
-
-    // 取出超时时间
-    uint64_t to = ctx->getTimeout(timeout_so);
     // 设置超时条件
     std::shared_ptr<timer_info> tinfo(new timer_info);
 
@@ -127,18 +242,30 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
 // 得思考这里用while(1) 为什么不行？
 retry:
     ssize_t n = fun(fd, std::forward<Args>(args)...);
+    stats.onSyscall(n);
     while(n == -1 && errno == EINTR) {      // 如果读取不成功且是被系统中断的，读了很多次还没读到操作会换错误为EAGAIN
         n = fun(fd, std::forward<Args>(args)...);
+        stats.onSyscall(n);
     }
     if(n == -1 && errno == EAGAIN) {        // 如果读取不成功且需要再次读的
+        // 挂起前先写出本协程暂存的合并数据, 写出后对端可能已有响应, 直接重试
+        if(apollo::CorkWriter::FlushCurrent()) {
+            goto retry;
+        }
         apollo::IOManager* iom = apollo::IOManager::GetThis();
         apollo::Timer::ptr timer;
         // 这里为什么要设置为weak_point？
         // —————因为在timer中addConditionTimer的条件参数是weak_ptr
         std::weak_ptr<timer_info> winfo(tinfo);
 
-        if(to != (uint64_t)-1) {    // 超时时间不等于-1
-            timer = iom->addConditionTimer(to, [winfo, fd, iom, event]() {      // 添加条件超时定时器
+        if(expire != (uint64_t)-1) {    // 有截止时间, 只按剩余时间设置一个定时器
+            uint64_t now = apollo::GetCurrentMS();
+            if(now >= expire) {
+                stats.onTimeout();
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            timer = iom->addConditionTimer(expire - now, [winfo, fd, iom, event]() {      // 添加条件超时定时器
                 auto t = winfo.lock();      // 拿出条件并唤醒
                 if(!t || t->cancelled) {    // 定时器已经失效或者超时，直接返回
                     return;
@@ -158,11 +285,16 @@ retry:
             }
             return -1;
         } else {
+            stats.onPark();
             apollo::Fiber::YieldToHold();
+            stats.onWake();
             if(timer) {
                 timer->cancel();
             }
             if(tinfo->cancelled) {
+                if(tinfo->cancelled == ETIMEDOUT) {
+                    stats.onTimeout();
+                }
                 errno = tinfo->cancelled;
                 return -1;
             }
@@ -184,6 +316,7 @@ unsigned int sleep(unsigned int seconds) {
     if(!apollo::t_hook_enable) {
         return sleep_f(seconds);
     }
+    apollo::CorkWriter::FlushCurrent();
 
     // APOLLO_LOG_DEBUG(g_logger) << " --- use the customized sleep func ---";
 
@@ -204,6 +337,7 @@ int usleep(useconds_t usec) {
     if(!apollo::t_hook_enable) {
         return usleep_f(usec);
     }
+    apollo::CorkWriter::FlushCurrent();
     apollo::Fiber::ptr fiber = apollo::Fiber::GetThis();
     apollo::IOManager* iom = apollo::IOManager::GetThis();
     iom->addTimer(usec / 1000, std::bind((void(apollo::Scheduler::*)
@@ -217,6 +351,7 @@ int nanosleep(const struct timespec *req, struct timespec *rem) {
     if(!apollo::t_hook_enable) {
         return nanosleep_f(req, rem);
     }
+    apollo::CorkWriter::FlushCurrent();
 
     int timeout_ms = req->tv_sec * 1000 + req->tv_nsec / 1000 /1000;
     apollo::Fiber::ptr fiber = apollo::Fiber::GetThis();
@@ -246,18 +381,23 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
     if(!apollo::t_hook_enable) {
         return connect_f(fd, addr, addrlen);
     }
-    apollo::FdCtx::ptr ctx = apollo::FdMgr::GetInstance()->get(fd);
-    if(!ctx || ctx->isClose()) {
-        errno = EBADF;
-        return -1;
-    }
+    {
+        apollo::EpochGuard guard;
+        apollo::FdCtx* ctx = apollo::FdMgr::GetInstance()->get(fd);
+        if(!ctx || ctx->isClose()) {
+            errno = EBADF;
+            return -1;
+        }
 
-    if(!ctx->isSocket()) {
-        return connect_f(fd, addr, addrlen);
+        if(!ctx->isSocket() || ctx->getUserNonblock()) {
+            return connect_f(fd, addr, addrlen);
+        }
     }
 
-    if(ctx->getUserNonblock()) {
-        return connect_f(fd, addr, addrlen);
+    uint64_t expire = get_expire(timeout_ms);
+    if(expire != (uint64_t)-1 && apollo::GetCurrentMS() >= expire) {
+        errno = ETIMEDOUT;
+        return -1;
     }
 
     int n = connect_f(fd, addr, addrlen);
@@ -272,8 +412,9 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
     std::shared_ptr<timer_info> tinfo(new timer_info);
     std::weak_ptr<timer_info> winfo(tinfo);
 
-    if(timeout_ms != (uint64_t)-1) {
-        timer = iom->addConditionTimer(timeout_ms, [winfo, fd, iom]() {
+    if(expire != (uint64_t)-1) {
+        uint64_t now = apollo::GetCurrentMS();
+        timer = iom->addConditionTimer(expire > now ? expire - now : 0, [winfo, fd, iom]() {
                 auto t = winfo.lock();
                 if(!t || t->cancelled) {
                     return;
@@ -283,6 +424,7 @@ int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen,
         }, winfo);
     }
 
+    apollo::CorkWriter::FlushCurrent();
     int rt = iom->addEvent(fd, apollo::IOManager::WRITE);
     if(rt == 0) {
         apollo::Fiber::YieldToHold();
@@ -345,6 +487,10 @@ ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
     return do_io(sockfd, recvmsg_f, "recvmsg", apollo::IOManager::READ, SO_RCVTIMEO, msg, flags);
 }
 
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout) {
+    return do_io(sockfd, recvmmsg_f, "recvmmsg", apollo::IOManager::READ, SO_RCVTIMEO, msgvec, vlen, flags, timeout);
+}
+
 ssize_t write(int fd, const void *buf, size_t count) {
     return do_io(fd, write_f, "write", apollo::IOManager::WRITE, SO_SNDTIMEO, buf, count);
 }
@@ -365,13 +511,191 @@ ssize_t sendmsg(int s, const struct msghdr *msg, int flags) {
     return do_io(s, sendmsg_f, "sendmsg", apollo::IOManager::WRITE, SO_SNDTIMEO, msg, flags);
 }
 
+int sendmmsg(int s, struct mmsghdr *msgvec, unsigned int vlen, int flags) {
+    return do_io(s, sendmmsg_f, "sendmmsg", apollo::IOManager::WRITE, SO_SNDTIMEO, msgvec, vlen, flags);
+}
+
+// sendfile在内核中直接由文件页缓存发往socket, 省去用户态拷贝
+ssize_t sendfile(int out_fd, int in_fd, off_t* offset, size_t count) {
+    return do_io(out_fd, sendfile_f, "sendfile", apollo::IOManager::WRITE, SO_SNDTIMEO, in_fd, offset, count);
+}
+
+// splice的一端必须是pipe, 当输出端为socket时等待可写, 否则等待输入端可读
+ssize_t splice(int fd_in, loff_t* off_in, int fd_out, loff_t* off_out, size_t len, unsigned int flags) {
+    bool out_socket = false;
+    {
+        apollo::EpochGuard guard;
+        apollo::FdCtx* out_ctx = apollo::FdMgr::GetInstance()->get(fd_out);
+        out_socket = out_ctx && out_ctx->isSocket();
+    }
+    if(out_socket) {
+        return do_io(fd_out, [fd_in, off_in, off_out, len, flags](int fd) {
+            return splice_f(fd_in, off_in, fd, off_out, len, flags);
+        }, "splice", apollo::IOManager::WRITE, SO_SNDTIMEO);
+    }
+    return do_io(fd_in, [off_in, fd_out, off_out, len, flags](int fd) {
+        return splice_f(fd, off_in, fd_out, off_out, len, flags);
+    }, "splice", apollo::IOManager::READ, SO_RCVTIMEO);
+}
+
+ssize_t send_zerocopy(int fd, const void* buf, size_t len, int flags) {
+    int zerocopy = -1;
+    {
+        apollo::EpochGuard guard;
+        apollo::FdCtx* ctx = apollo::FdMgr::GetInstance()->get(fd);
+        if(ctx && !ctx->isClose() && ctx->isSocket()) {
+            // 首次使用时开启SO_ZEROCOPY, 失败(如unix socket或内核版本过低)则退化为普通send
+            if(ctx->getZerocopy() == 0) {
+                int on = 1;
+                if(setsockopt_f(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on))) {
+                    APOLLO_LOG_INFO(g_logger) << "send_zerocopy fd=" << fd
+                        << " SO_ZEROCOPY unsupported errno=" << errno << " " << strerror(errno);
+                    ctx->setZerocopy(-1);
+                } else {
+                    ctx->setZerocopy(1);
+                }
+            }
+            zerocopy = ctx->getZerocopy();
+        }
+    }
+    if(zerocopy < 0) {
+        return send(fd, buf, len, flags);
+    }
+
+    // send可能挂起协程, 发送完成后重新取句柄上下文计数
+    ssize_t n = send(fd, buf, len, flags | MSG_ZEROCOPY);
+    if(n >= 0) {
+        apollo::EpochGuard guard;
+        apollo::FdCtx* ctx = apollo::FdMgr::GetInstance()->get(fd);
+        if(ctx) {
+            ctx->onZerocopySent();
+        }
+    }
+    return n;
+}
+
+int send_zerocopy_wait(int fd) {
+    // 整个等待共用一个截止时间
+    uint64_t expire = 0;
+    bool first = true;
+    // 等待过程中会挂起协程, 每轮重新取句柄上下文
+    while(true) {
+        uint64_t to = (uint64_t)-1;
+        {
+            apollo::EpochGuard guard;
+            apollo::FdCtx* ctx = apollo::FdMgr::GetInstance()->get(fd);
+            if(!ctx || ctx->isClose()) {
+                errno = EBADF;
+                return -1;
+            }
+            if(!ctx->hasZerocopyPending()) {
+                break;
+            }
+            to = ctx->getTimeout(SO_RCVTIMEO);
+        }
+        if(first) {
+            expire = get_expire(to);
+            first = false;
+        }
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        // 完成通知投递在socket错误队列上, 只产生EPOLLERR
+        ssize_t rt = recvmsg_f(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+        if(rt == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno != EAGAIN) {
+                return -1;
+            }
+            uint64_t now = apollo::GetCurrentMS();
+            if(expire != (uint64_t)-1 && now >= expire) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            apollo::IOManager* iom = apollo::IOManager::GetThis();
+            if(apollo::t_hook_enable && iom) {
+                // 注册ERRQUEUE事件(EPOLLERR)而不是READ: 同一socket上可能已有读协程挂起(全双工)
+                // 注册时内核会检查错误队列, 检查与注册之间到达的通知不会丢失
+                std::shared_ptr<timer_info> tinfo(new timer_info);
+                std::weak_ptr<timer_info> winfo(tinfo);
+                apollo::Timer::ptr timer;
+                if(expire != (uint64_t)-1) {
+                    timer = iom->addConditionTimer(expire - now, [winfo, fd, iom]() {
+                        auto t = winfo.lock();
+                        if(!t || t->cancelled) {
+                            return;
+                        }
+                        t->cancelled = ETIMEDOUT;
+                        iom->cancelEvent(fd, apollo::IOManager::ERRQUEUE);
+                    }, winfo);
+                }
+                if(iom->addEvent(fd, apollo::IOManager::ERRQUEUE)) {
+                    if(timer) {
+                        timer->cancel();
+                    }
+                    return -1;
+                }
+                apollo::Fiber::YieldToHold();
+                if(timer) {
+                    timer->cancel();
+                }
+                if(tinfo->cancelled) {
+                    errno = tinfo->cancelled;
+                    return -1;
+                }
+                continue;
+            }
+            // 未开启hook时直接阻塞在poll上
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = 0;
+            pfd.revents = 0;
+            int prt = poll(&pfd, 1, expire == (uint64_t)-1 ? -1 : (int)(expire - now));
+            if(prt == 0) {
+                errno = ETIMEDOUT;
+                return -1;
+            } else if(prt < 0 && errno != EINTR) {
+                return -1;
+            }
+            continue;
+        }
+
+        for(struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if(!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                    || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            struct sock_extended_err* serr = (struct sock_extended_err*)CMSG_DATA(cm);
+            if(serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            apollo::EpochGuard guard;
+            apollo::FdCtx* ctx = apollo::FdMgr::GetInstance()->get(fd);
+            if(ctx) {
+                ctx->onZerocopyDone(serr->ee_info, serr->ee_data
+                        , serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+            }
+        }
+    }
+    return 0;
+}
+
 int close(int fd) {
     if(!apollo::t_hook_enable) {
         return close_f(fd);
     }
 
-    apollo::FdCtx::ptr ctx = apollo::FdMgr::GetInstance()->get(fd);
-    if(ctx) {
+    bool exist = false;
+    {
+        apollo::EpochGuard guard;
+        exist = apollo::FdMgr::GetInstance()->get(fd) != nullptr;
+    }
+    if(exist) {
         auto iom = apollo::IOManager::GetThis();
         if(iom) {
             iom->cancelAll(fd);
@@ -389,7 +713,8 @@ int fcntl(int fd, int cmd, ... /* arg */ ) {
             {
                 int arg = va_arg(va, int);
                 va_end(va);
-                apollo::FdCtx::ptr ctx = apollo::FdMgr::GetInstance()->get(fd);
+                apollo::EpochGuard guard;
+                apollo::FdCtx* ctx = apollo::FdMgr::GetInstance()->get(fd);
                 if(!ctx || ctx->isClose() || !ctx->isSocket()) {
                     return fcntl_f(fd, cmd, arg);
                 }
@@ -406,7 +731,8 @@ int fcntl(int fd, int cmd, ... /* arg */ ) {
             {
                 va_end(va);
                 int arg = fcntl_f(fd, cmd);
-                apollo::FdCtx::ptr ctx = apollo::FdMgr::GetInstance()->get(fd);
+                apollo::EpochGuard guard;
+                apollo::FdCtx* ctx = apollo::FdMgr::GetInstance()->get(fd);
                 if(!ctx || ctx->isClose() || !ctx->isSocket()) {
                     return arg;
                 }
@@ -476,7 +802,8 @@ int ioctl(int d, unsigned long int request, ...) {
 
     if(FIONBIO == request) {
         bool user_nonblock = !!*(int*)arg;
-        apollo::FdCtx::ptr ctx = apollo::FdMgr::GetInstance()->get(d);
+        apollo::EpochGuard guard;
+        apollo::FdCtx* ctx = apollo::FdMgr::GetInstance()->get(d);
         if(!ctx || ctx->isClose() || !ctx->isSocket()) {
             return ioctl_f(d, request, arg);
         }
@@ -495,7 +822,8 @@ int setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t
     }
     if(level == SOL_SOCKET) {
         if(optname == SO_RCVTIMEO || optname == SO_SNDTIMEO) {
-            apollo::FdCtx::ptr ctx = apollo::FdMgr::GetInstance()->get(sockfd);
+            apollo::EpochGuard guard;
+            apollo::FdCtx* ctx = apollo::FdMgr::GetInstance()->get(sockfd);
             if(ctx) {
                 const timeval* v = (const timeval*)optval;
                 ctx->setTimeout(optname, v->tv_sec * 1000 + v->tv_usec / 1000);
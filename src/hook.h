@@ -5,6 +5,7 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <stdint.h>
 #include <time.h>
 #include <unistd.h>
@@ -18,6 +19,9 @@ namespace apollo
     // 将当前线程设置hook状态
     void set_hook_enable(bool flag);
 
+    // 配置项tcp.connect.timeout的当前值(毫秒)
+    uint64_t get_connect_timeout();
+
 } // namespace apollo
 
 // 会指示编译器这部分代码按C语言的进行编译
@@ -61,6 +65,9 @@ extern recvfrom_fun recvfrom_f;
 typedef ssize_t (*recvmsg_fun)(int sockfd, struct msghdr *msg, int flags);
 extern recvmsg_fun recvmsg_f;
 
+typedef int (*recvmmsg_fun)(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout);
+extern recvmmsg_fun recvmmsg_f;
+
 //write
 typedef ssize_t (*write_fun)(int fd, const void *buf, size_t count);
 extern write_fun write_f;
@@ -77,6 +84,16 @@ extern sendto_fun sendto_f;
 typedef ssize_t (*sendmsg_fun)(int s, const struct msghdr *msg, int flags);
 extern sendmsg_fun sendmsg_f;
 
+typedef int (*sendmmsg_fun)(int s, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+extern sendmmsg_fun sendmmsg_f;
+
+//zero copy
+typedef ssize_t (*sendfile_fun)(int out_fd, int in_fd, off_t* offset, size_t count);
+extern sendfile_fun sendfile_f;
+
+typedef ssize_t (*splice_fun)(int fd_in, loff_t* off_in, int fd_out, loff_t* off_out, size_t len, unsigned int flags);
+extern splice_fun splice_f;
+
 typedef int (*close_fun)(int fd);
 extern close_fun close_f;
 
@@ -95,6 +112,15 @@ extern setsockopt_fun setsockopt_f;
 
 extern int connect_with_timeout(int fd, const struct sockaddr* addr, socklen_t addrlen, uint64_t timeout_ms);
 
+// 以MSG_ZEROCOPY发送数据(内核不支持时退化为普通send)
+// 发送成功后, buf在send_zerocopy_wait返回之前不可修改或释放
+extern ssize_t send_zerocopy(int fd, const void* buf, size_t len, int flags);
+
+// 等待fd上所有已发出的零拷贝发送完成, 超时时间取SO_RCVTIMEO, 成功返回0, 失败返回-1
+// 挂起在fd的ERRQUEUE事件上, 不占用READ事件, 可以与挂起在同一socket上的读协程同时进行
+// 同一fd同一时间只能有一个协程等待
+extern int send_zerocopy_wait(int fd);
+
 }
 
 #endif
\ No newline at end of file
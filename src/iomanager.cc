@@ -1,4 +1,6 @@
 #include "iomanager.h"
+#include "epoch.h"
+#include "fdmanager.h"
 #include "macro.h"
 #include "log.h"
 
@@ -16,6 +18,11 @@ static apollo::Logger::ptr g_logger = APOLLO_LOG_NAME("system");
 enum EpollCtlOp {
 };
 
+// epoll事件数据: 低32位为句柄, 高32位为FdCtx的复用代数
+static uint64_t make_epoll_data(FdCtx* fd_ctx) {
+    return ((uint64_t)fd_ctx->getGeneration() << 32) | (uint32_t)fd_ctx->getFd();
+}
+
 // 获取当前IOManager
 IOManager* IOManager::GetThis() {
     return dynamic_cast<IOManager*>(Scheduler::GetThis());
@@ -36,7 +43,7 @@ IOManager::IOManager(size_t threads, bool use_caller, const std::string& name)
     memset(&event, 0, sizeof(epoll_event));
     
     event.events = EPOLLIN | EPOLLET;
-    event.data.fd = m_tickleFds[0];
+    event.data.u64 = (uint32_t)m_tickleFds[0];
 
     // fcntl()  performs  one of the operations described 
     // below on the open file descriptor fd.  The operation is de‐
@@ -54,55 +61,49 @@ IOManager::IOManager(size_t threads, bool use_caller, const std::string& name)
     rt  = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
     APOLLO_ASSERT(!rt);
 
-    resizeContext(32);
-
     start();    // 启动调度器
 }
 
 IOManager::~IOManager() {
+    // stop在全部事件完成或取消后才返回, 之后不再有FdCtx指向本IOManager
     stop();
     close(m_epfd);
     close(m_tickleFds[0]);
     close(m_tickleFds[1]);
-
-    // 释放申请的空间
-    for(size_t i = 0; i < m_fdContexts.size(); i++) {
-        if(m_fdContexts[i]) {
-            delete m_fdContexts[i];
-        }
-    }
 }
 
 // 添加事件，成功返回0，失败返回-1
 int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
-    FdContext* fd_ctx = nullptr;
-    RWMutexType::ReadLock lock(m_mutex);
-    
-    if((int)m_fdContexts.size() > fd) {
-        fd_ctx = m_fdContexts[fd];
-        lock.unlock();
-    } 
-    // 如果要添加的事件句柄不在事件上下文容器中，则扩容，并添加
-    else {
-        lock.unlock();
-        // 加入写锁
-        RWMutexType::WriteLock lock2(m_mutex);
-        resizeContext(fd * 1.5);          // 扩容
-        fd_ctx = m_fdContexts[fd];
+    // 事件状态与hook状态共用FdManager中的同一个FdCtx, 不存在时创建
+    // 只注册事件不接管句柄, 不改变句柄的阻塞属性
+    EpochGuard guard;
+    FdCtx* fd_ctx = FdMgr::GetInstance()->get(fd, true, false);
+    if(APOLLO_UNLIKELY(!fd_ctx)) {
+        errno = EBADF;
+        return -1;
     }
-    
-    FdContext::MutexType::Lock lock3(fd_ctx->mutex);
-    if(APOLLO_UNLIKELY(fd_ctx->events & event)) {
+
+    FdCtx::MutexType::Lock lock(fd_ctx->m_mutex);
+    // 句柄已在其他IOManager的epoll上, 本epoll上没有该句柄, 不能MOD
+    if(APOLLO_UNLIKELY(fd_ctx->m_events && fd_ctx->m_iom != this)) {
+        APOLLO_LOG_ERROR(g_logger) << "addEvent fd=" << fd
+                    << " event=" << (EPOLL_EVENTS)event
+                    << " already registered on IOManager " << fd_ctx->m_iom->getName()
+                    << " fd_ctx.event=" << (EPOLL_EVENTS)fd_ctx->m_events;
+        errno = EEXIST;
+        return -1;
+    }
+    if(APOLLO_UNLIKELY(fd_ctx->m_events & event)) {
         APOLLO_LOG_ERROR(g_logger) << "addEvent assert fd=" << fd
                     << " event=" << (EPOLL_EVENTS)event
-                    << " fd_ctx.event=" << (EPOLL_EVENTS)fd_ctx->events;
-        APOLLO_ASSERT(!(fd_ctx->events & event));
+                    << " fd_ctx.event=" << (EPOLL_EVENTS)fd_ctx->m_events;
+        APOLLO_ASSERT(!(fd_ctx->m_events & event));
     }
 
-    int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    int op = fd_ctx->m_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
     epoll_event epevent;
-    epevent.events = EPOLLET | fd_ctx->events | event;
-    epevent.data.ptr = fd_ctx;
+    epevent.events = EPOLLET | fd_ctx->m_events | event;
+    epevent.data.u64 = make_epoll_data(fd_ctx);
 
     // 事件注册
     int rt = epoll_ctl(m_epfd, op, fd, &epevent);
@@ -110,13 +111,14 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
         APOLLO_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
             << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
             << rt << " (" << errno << ") (" << strerror(errno) << ") fd_ctx->events="
-            << (EPOLL_EVENTS)fd_ctx->events;
+            << (EPOLL_EVENTS)fd_ctx->m_events;
         return -1;
     }
 
     ++m_pendingEventCount;
-    fd_ctx->events = (Event)(fd_ctx->events | event);
-    FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
+    fd_ctx->m_events |= event;
+    fd_ctx->m_iom = this;
+    FdCtx::EventContext& event_ctx = fd_ctx->getContext(event);
     APOLLO_ASSERT(!event_ctx.scheduler
                 && !event_ctx.fiber
                 && !event_ctx.cb);
@@ -134,109 +136,119 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
 
 // 删除事件
 bool IOManager::delEvent(int fd, Event event) {
-    RWMutexType::ReadLock lock(m_mutex);
-    if((int)m_fdContexts.size() <= fd) {
+    EpochGuard guard;
+    FdCtx* fd_ctx = FdMgr::GetInstance()->get(fd);
+    if(!fd_ctx) {
         return false;
     }
-    FdContext* fd_ctx = m_fdContexts[fd];
-    lock.unlock();
 
-    FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if(APOLLO_UNLIKELY(!(fd_ctx->events & event))) {
+    FdCtx::MutexType::Lock lock(fd_ctx->m_mutex);
+    if(APOLLO_UNLIKELY(!(fd_ctx->m_events & event))) {
         return false;
     }
 
-    Event new_events = (Event)(fd_ctx->events & ~event);
+    // 在注册事件的IOManager的epoll上修改
+    IOManager* owner = fd_ctx->m_iom;
+    Event new_events = (Event)(fd_ctx->m_events & ~event);
     int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
     epoll_event epevent;
     epevent.events = EPOLLET | new_events;
-    epevent.data.ptr = fd_ctx;
+    epevent.data.u64 = make_epoll_data(fd_ctx);
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    int rt = epoll_ctl(owner->m_epfd, op, fd, &epevent);
     if(rt) {
-        APOLLO_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+        APOLLO_LOG_ERROR(g_logger) << "epoll_ctl(" << owner->m_epfd << ", "
             << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
             << rt << " (" << errno << ") (" << strerror(errno) << ")";
         return false;
     }
 
-    --m_pendingEventCount;
-    fd_ctx->events = new_events;
-    FdContext::EventContext& event_ctx = fd_ctx->getContext(event);
+    --owner->m_pendingEventCount;
+    fd_ctx->m_events = new_events;
+    if(!new_events) {
+        fd_ctx->m_iom = nullptr;
+    }
+    FdCtx::EventContext& event_ctx = fd_ctx->getContext(event);
     fd_ctx->resetContext(event_ctx);
     return true;
 }
 
 // 取消事件
 bool IOManager::cancelEvent(int fd, Event event) {
-    RWMutexType::ReadLock lock(m_mutex);
-    if((int)m_fdContexts.size() <= fd) {
+    EpochGuard guard;
+    FdCtx* fd_ctx = FdMgr::GetInstance()->get(fd);
+    if(!fd_ctx) {
         return false;
     }
-    FdContext* fd_ctx = m_fdContexts[fd];
-    lock.unlock();
 
-    FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if(APOLLO_UNLIKELY(!(fd_ctx->events & event))) {
+    FdCtx::MutexType::Lock lock(fd_ctx->m_mutex);
+    if(APOLLO_UNLIKELY(!(fd_ctx->m_events & event))) {
         return false;
     }
 
-    Event new_events = (Event)(fd_ctx->events & ~event);
+    // 在注册事件的IOManager的epoll上修改
+    IOManager* owner = fd_ctx->m_iom;
+    Event new_events = (Event)(fd_ctx->m_events & ~event);
     int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
     epoll_event epevent;
     epevent.events = EPOLLET | new_events;
-    epevent.data.ptr = fd_ctx;
+    epevent.data.u64 = make_epoll_data(fd_ctx);
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    int rt = epoll_ctl(owner->m_epfd, op, fd, &epevent);
     if(rt) {
-        APOLLO_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+        APOLLO_LOG_ERROR(g_logger) << "epoll_ctl(" << owner->m_epfd << ", "
             << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
             << rt << " (" << errno << ") (" << strerror(errno) << ")";
         return false;
     }
 
     fd_ctx->triggerEvent(event);
-    --m_pendingEventCount;
+    --owner->m_pendingEventCount;
     return true;
 }
 
 // 取消所有事件
 bool IOManager::cancelAll(int fd) {
-    RWMutexType::ReadLock lock(m_mutex);
-    if((int)m_fdContexts.size() <= fd) {
+    EpochGuard guard;
+    FdCtx* fd_ctx = FdMgr::GetInstance()->get(fd);
+    if(!fd_ctx) {
         return false;
     }
-    FdContext* fd_ctx = m_fdContexts[fd];
-    lock.unlock();
 
-    FdContext::MutexType::Lock lock2(fd_ctx->mutex);
-    if(!fd_ctx->events) {
+    FdCtx::MutexType::Lock lock(fd_ctx->m_mutex);
+    if(!fd_ctx->m_events) {
         return false;
     }
 
+    // 在注册事件的IOManager的epoll上删除
+    IOManager* owner = fd_ctx->m_iom;
     int op = EPOLL_CTL_DEL;
     epoll_event epevent;
     epevent.events = 0;
-    epevent.data.ptr = fd_ctx;
+    epevent.data.u64 = make_epoll_data(fd_ctx);
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
+    int rt = epoll_ctl(owner->m_epfd, op, fd, &epevent);
     if(rt) {
-        APOLLO_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
+        APOLLO_LOG_ERROR(g_logger) << "epoll_ctl(" << owner->m_epfd << ", "
             << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)epevent.events << "):"
             << rt << " (" << errno << ") (" << strerror(errno) << ")";
         return false;
     }
 
-    if(fd_ctx->events & READ) {
+    if(fd_ctx->m_events & READ) {
         fd_ctx->triggerEvent(READ);
-        --m_pendingEventCount;
+        --owner->m_pendingEventCount;
     }
-    if(fd_ctx->events & WRITE) {
+    if(fd_ctx->m_events & WRITE) {
         fd_ctx->triggerEvent(WRITE);
-        --m_pendingEventCount;
+        --owner->m_pendingEventCount;
+    }
+    if(fd_ctx->m_events & ERRQUEUE) {
+        fd_ctx->triggerEvent(ERRQUEUE);
+        --owner->m_pendingEventCount;
     }
 
-    APOLLO_ASSERT(fd_ctx->events == 0);
+    APOLLO_ASSERT(fd_ctx->m_events == 0);
     return true;
 }
 
@@ -313,7 +325,9 @@ void IOManager::idle() {
 
         for(int i = 0; i < rt; ++i) {
             epoll_event& event = events[i];
-            if(event.data.fd == m_tickleFds[0]) {
+            int fd = (int)(uint32_t)event.data.u64;
+            uint32_t generation = event.data.u64 >> 32;
+            if(generation == 0 && fd == m_tickleFds[0]) {
                 // ticklefd[0]用于通知协程调度，这时只需要把管道里的内容读完即可，本轮idle结束Scheduler::run会重新执行协程调度
                 uint8_t dummy[256];
                 while(read(m_tickleFds[0], dummy, sizeof(dummy)) > 0)
@@ -321,10 +335,15 @@ void IOManager::idle() {
                 continue;
             }
 
-            FdContext* fd_ctx = (FdContext*)event.data.ptr;
-            FdContext::MutexType::Lock lock(fd_ctx->mutex);
+            // 事件产生后句柄可能已被关闭并复用, 通过复用代数识别过期事件
+            EpochGuard guard;
+            FdCtx* fd_ctx = FdMgr::GetInstance()->get(fd);
+            if(!fd_ctx || fd_ctx->getGeneration() != generation) {
+                continue;
+            }
+            FdCtx::MutexType::Lock lock(fd_ctx->m_mutex);
             if(event.events & (EPOLLERR | EPOLLHUP)) {
-                event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->events;
+                event.events |= (EPOLLIN | EPOLLOUT) & fd_ctx->m_events;
             }
 
             int real_events = NONE;
@@ -337,18 +356,24 @@ void IOManager::idle() {
                 real_events |= WRITE;
             }
 
-            if((fd_ctx->events & real_events) == NONE) {
+            // EPOLLERR总会上报, 只有注册了ERRQUEUE时才作为该事件
+            if((event.events & EPOLLERR) && (fd_ctx->m_events & ERRQUEUE)) {
+                real_events |= ERRQUEUE;
+            }
+
+            // 事件已被取消, 或之后注册到了其他IOManager
+            if(fd_ctx->m_iom != this || (fd_ctx->m_events & real_events) == NONE) {
                 continue;
             }
 
-            int left_events = (fd_ctx->events & ~real_events);
+            int left_events = (fd_ctx->m_events & ~real_events);
             int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
             event.events = EPOLLET | left_events;
 
-            int rt2 = epoll_ctl(m_epfd, op, fd_ctx->fd, &event);
+            int rt2 = epoll_ctl(m_epfd, op, fd, &event);
             if(rt2) {
                 APOLLO_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                    << (EpollCtlOp)op << ", " << fd_ctx->fd << ", " << (EPOLL_EVENTS)event.events << "):"
+                    << (EpollCtlOp)op << ", " << fd << ", " << (EPOLL_EVENTS)event.events << "):"
                     << rt2 << " (" << errno << ") (" << strerror(errno) << ")";
                 continue;
             }
@@ -361,6 +386,10 @@ void IOManager::idle() {
                 fd_ctx->triggerEvent(WRITE);
                 --m_pendingEventCount;
             }
+            if(real_events & ERRQUEUE) {
+                fd_ctx->triggerEvent(ERRQUEUE);
+                --m_pendingEventCount;
+            }
         }
 
         Fiber::ptr cur = Fiber::GetThis();
@@ -371,53 +400,6 @@ void IOManager::idle() {
     }
 }
 
-// 重置socket句柄上下文的容器大小
-void IOManager::resizeContext(size_t size) {
-    m_fdContexts.resize(size);
-
-    for(size_t i = 0; i < m_fdContexts.size(); i++) {
-        if(!m_fdContexts[i]) {
-            m_fdContexts[i] = new FdContext;
-            m_fdContexts[i]->fd = i;
-        }
-    }
-}
-
-// 获取事件上下文
-IOManager::FdContext::EventContext& IOManager::FdContext::getContext(IOManager::Event event) {
-    switch(event) {
-        case IOManager::READ:
-            return read;
-        case IOManager::WRITE:
-            return write;
-        default:
-            APOLLO_ASSERT2(false, "Get Context Failed");
-    }
-    throw std::invalid_argument("Get Invalid Context Event");
-}
-
-// 重置事件上下文
-void IOManager::FdContext::resetContext(EventContext& ctx) {
-    ctx.scheduler = nullptr;
-    ctx.fiber.reset();
-    ctx.cb = nullptr;
-}
-
-// 触发事件
-void IOManager::FdContext::triggerEvent(Event event) {
-    APOLLO_LOG_INFO(g_logger) << "Call Trigger Event : " << event << "========";
-    APOLLO_ASSERT(events & event);
-    events = (Event)(events & ~event);
-    EventContext& ctx = getContext(event);
-    if(ctx.cb) {
-        ctx.scheduler->schedule(&ctx.cb);
-    } else {
-        ctx.scheduler->schedule(&ctx.fiber);
-    }
-    ctx.scheduler = nullptr;
-    return;
-}
-
 // 当有新的定时器插入到了列表首部，需要通知调度器
 void IOManager::onTimerInsertAtFront() {
     tickle();
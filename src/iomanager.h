@@ -16,39 +16,7 @@ public:
         NONE = 0x0,
         READ = 0x1,        // = EPOLLIN
         WRITE = 0x4,       // = EPOLLOUT
-    };
-
-private:
-    // 事件上下文
-    struct FdContext {
-        typedef Mutex MutexType;
-        struct EventContext {
-            // 事件执行的scheduler
-            Scheduler* scheduler = nullptr;
-            // 事件的协程
-            Fiber::ptr fiber;
-            // 事件的执行函数
-            std::function<void()> cb;
-        };
-        
-        // 获取事件上下文
-        EventContext& getContext(IOManager::Event event);
-
-        // 重置事件上下文
-        void resetContext(EventContext& ctx);
-
-        // 触发事件
-        void triggerEvent(IOManager::Event event);
-
-        // 读事件
-        EventContext read;
-        // 写事件
-        EventContext write;
-        // 事件关联的句柄
-        int fd;
-        // 已注册的事件
-        Event events = NONE;
-        MutexType mutex;
+        ERRQUEUE = 0x8,    // = EPOLLERR, socket错误队列有数据(如零拷贝发送的完成通知)
     };
 
 public:
@@ -58,9 +26,11 @@ public:
     ~IOManager();
 
     // 添加事件， 0 - success， -1 - error
+    // 同一句柄的事件只能注册在一个IOManager上, 已注册在其他IOManager时返回-1(errno = EEXIST)
     int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
     
     // 删除事件
+    // 删除/取消事件在注册事件的IOManager上进行, 可以通过任意IOManager调用
     bool delEvent(int fd, Event event);
 
     // 取消事件
@@ -88,16 +58,10 @@ protected:
     // 协程无任务可调度时切换回ide协程
     void idle() override;
 
-    // 重置socket句柄上下文的容器大小
-    void resizeContext(size_t size);
-
     // 当有新的定时器插入到了列表首部，需要通知调度器
     void onTimerInsertAtFront() override;
 
 private:
-    // IOMaager 读写锁
-    RWMutex m_mutex;
-    
     // epoll 文件句柄
     int m_epfd = 0;
     
@@ -106,9 +70,6 @@ private:
 
     // 当前等待执行的事件数量
     std::atomic<size_t> m_pendingEventCount = {0};
-    
-    // socket事件上下文的容器
-    std::vector<FdContext*> m_fdContexts;
 };
 
 } // namespace apollo
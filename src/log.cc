@@ -1,13 +1,23 @@
 #include <map>
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <functional>
 #include <time.h>
 #include <string.h>
 #include <yaml-cpp/yaml.h>
 #include <ctype.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <zlib.h>
+#include <set>
 
 #include "log.h"
 #include "config.h"
+#include "epoch.h"
 
 namespace apollo
 {
@@ -23,135 +33,365 @@ LogEventWrap::~LogEventWrap() {
     m_event->getLogger()->log(m_event->getLevel(), m_event);
 }
 
-std::stringstream& LogEventWrap::getSS() {
+std::ostream& LogEventWrap::getSS() {
     return m_event->getSS();
 }
 
-// -------------------------------------------------------
-// Loggerformatter overide
-// 日志内容
-class MessageFormatItem : public LogFormatter::FormatItem {
-public:
-    MessageFormatItem(const std::string& str = "") {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << event->getContent();
-    }
-};
+// --------------------------------------------------------
+// LogBuffer implementation
+LogBuffer::LogBuffer() {
+    setp(m_inline, m_inline + s_inline_size);
+}
 
-class LevelFormatItem : public LogFormatter::FormatItem {
-public:
-    LevelFormatItem(const std::string& str = "") {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << LogLevel::ToString(level);
-    }
-};
+void LogBuffer::clear() {
+    setp(m_inline, m_inline + s_inline_size);
+}
 
-class ElapseFormatItem : public LogFormatter::FormatItem {
-public:
-    ElapseFormatItem(const std::string& str = "") {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << event->getElapse();
+void LogBuffer::reserve(size_t n) {
+    size_t used = size();
+    if((size_t)(epptr() - pptr()) >= n) {
+        return;
     }
-};
-
-class NameFormatItem : public LogFormatter::FormatItem {
-public:
-    NameFormatItem(const std::string& str = "") {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << event->getLogger()->getName();
+    size_t cap = std::max(s_inline_size * 2, (used + n) * 2);
+    if(pbase() == m_inline) {
+        // 转存到m_spill, 其容量在复用时保留
+        m_spill.resize(std::max(cap, m_spill.capacity()));
+        memcpy(&m_spill[0], m_inline, used);
+    } else {
+        m_spill.resize(std::max(cap, m_spill.size()));
     }
-};
+    setp(&m_spill[0], &m_spill[0] + m_spill.size());
+    pbump(used);
+}
 
-class ThreadIdFormatItem : public LogFormatter::FormatItem {
-public:
-    ThreadIdFormatItem(const std::string& str = "") {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << event->getThreadId();
+LogBuffer::int_type LogBuffer::overflow(int_type ch) {
+    if(traits_type::eq_int_type(ch, traits_type::eof())) {
+        return traits_type::not_eof(ch);
     }
-};
+    reserve(1);
+    *pptr() = traits_type::to_char_type(ch);
+    pbump(1);
+    return ch;
+}
 
-class FiberIdFormatItem : public LogFormatter::FormatItem {
-public:
-    FiberIdFormatItem(const std::string& str = "") {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << event->getFiberId();
-    }
-};
+std::streamsize LogBuffer::xsputn(const char* s, std::streamsize n) {
+    reserve(n);
+    memcpy(pptr(), s, n);
+    pbump(n);
+    return n;
+}
 
-class ThreadNameFormatItem : public LogFormatter::FormatItem {
-public:
-    ThreadNameFormatItem(const std::string& str = "") {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << event->getThreadName();
+void LogBuffer::appendf(const char* fmt, va_list al) {
+    va_list cp;
+    va_copy(cp, al);
+    size_t left = epptr() - pptr();
+    int len = vsnprintf(pptr(), left, fmt, cp);
+    va_end(cp);
+    if(len < 0) {
+        return;
     }
+    if((size_t)len >= left) {
+        // vsnprintf需要多写一个0
+        reserve(len + 1);
+        vsnprintf(pptr(), len + 1, fmt, al);
+    }
+    pbump(len);
+}
+
+void LogBuffer::appendFormat(const char* fmt, ...) {
+    va_list al;
+    va_start(al, fmt);
+    appendf(fmt, al);
+    va_end(al);
+}
+
+// --------------------------------------------------------
+// printf参数编码
+// 每个参数为1字节类型加数据: 'i' int64, 'u' uint64, 'f' double, 'p' 指针(uint64),
+// 's' uint32长度加内容加0; '*'宽度/精度按'i'编码在其参数之前
+
+// printf格式说明符
+struct FormatSpec {
+    // '%'
+    const char* begin;
+    // 转换字符之后
+    const char* end;
+    // '*'的个数
+    int stars;
+    // 长度修饰: 'H'(hh) 'h' 'l' 'q'(ll) 'L' 'j' 'z' 't', 无为0
+    char length;
+    // 转换字符
+    char conv;
 };
 
-class DateTimeFormatItem : public LogFormatter::FormatItem {
-public:
-    DateTimeFormatItem(const std::string& format = "%Y-%m-%d %H:%M:%S")
-        :m_format(format) {
-        if(m_format.empty()) {
-            m_format = "%Y-%m-%d %H:%M:%S";
+// 解析begin('%')处的说明符, 不支持的说明符(位置参数,%n,%m,宽字符等)返回false
+static bool parse_spec(const char* begin, FormatSpec& spec) {
+    const char* p = begin + 1;
+    spec.begin = begin;
+    spec.stars = 0;
+    spec.length = 0;
+    while(*p && strchr("-+ #0'", *p)) {
+        ++p;
+    }
+    if(*p == '*') {
+        ++spec.stars;
+        ++p;
+    } else {
+        while(isdigit(*p)) {
+            ++p;
         }
     }
-
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        struct tm tm;
-        time_t time = event->getTime();
-        localtime_r(&time, &tm);
-        char buf[64];
-        strftime(buf, sizeof(buf), m_format.c_str(), &tm);
-        os << buf;
+    if(*p == '.') {
+        ++p;
+        if(*p == '*') {
+            ++spec.stars;
+            ++p;
+        } else {
+            while(isdigit(*p)) {
+                ++p;
+            }
+        }
     }
-private:
-    std::string m_format;
-};
-
-class FilenameFormatItem : public LogFormatter::FormatItem {
-public:
-    FilenameFormatItem(const std::string& str = "") {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << event->getFile();
+    switch(*p) {
+        case 'h':
+        case 'l':
+            if(p[1] == *p) {
+                spec.length = *p == 'h' ? 'H' : 'q';
+                p += 2;
+            } else {
+                spec.length = *p++;
+            }
+            break;
+        case 'q':
+        case 'L':
+        case 'j':
+        case 'z':
+        case 't':
+            spec.length = *p++;
+            break;
     }
-};
-
-class LineFormatItem : public LogFormatter::FormatItem {
-public:
-    LineFormatItem(const std::string& str = "") {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << event->getLine();
+    if(!*p || !strchr("diouxXcsfFeEgGaAp", *p)) {
+        return false;
     }
-};
-
-class NewLineFormatItem : public LogFormatter::FormatItem {
-public:
-    NewLineFormatItem(const std::string& str = "") {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << std::endl;
+    if((*p == 's' || *p == 'c') && spec.length) {
+        return false;
     }
-};
+    spec.conv = *p;
+    spec.end = p + 1;
+    return true;
+}
 
-class StringFormatItem : public LogFormatter::FormatItem {
-public:
-    StringFormatItem(const std::string& str)
-        :m_string(str) {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << m_string;
+template<class T>
+static void put_raw(std::string& out, char tag, T v) {
+    out.push_back(tag);
+    out.append((const char*)&v, sizeof(v));
+}
+
+template<class T>
+static bool get_raw(const char*& p, const char* end, char tag, T& v) {
+    if(end - p < (ptrdiff_t)(1 + sizeof(T)) || *p != tag) {
+        return false;
     }
-private:
-    std::string m_string;
-};
+    memcpy(&v, p + 1, sizeof(T));
+    p += 1 + sizeof(T);
+    return true;
+}
 
-class TabFormatItem : public LogFormatter::FormatItem {
-public:
-    TabFormatItem(const std::string& str = "") {}
-    void format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << "\t";
+// 按说明符从al中取出参数并编码到out
+static bool encode_args(std::string& out, const char* fmt, va_list* al) {
+    for(const char* p = fmt; *p; ++p) {
+        if(*p != '%') {
+            continue;
+        }
+        if(p[1] == '%') {
+            ++p;
+            continue;
+        }
+        FormatSpec spec;
+        if(!parse_spec(p, spec)) {
+            return false;
+        }
+        for(int i = 0; i < spec.stars; ++i) {
+            put_raw<int64_t>(out, 'i', va_arg(*al, int));
+        }
+        switch(spec.conv) {
+            case 'd':
+            case 'i':
+                switch(spec.length) {
+                    case 'l': put_raw<int64_t>(out, 'i', va_arg(*al, long)); break;
+                    case 'q':
+                    case 'L': put_raw<int64_t>(out, 'i', va_arg(*al, long long)); break;
+                    case 'j': put_raw<int64_t>(out, 'i', va_arg(*al, intmax_t)); break;
+                    case 'z': put_raw<int64_t>(out, 'i', va_arg(*al, ssize_t)); break;
+                    case 't': put_raw<int64_t>(out, 'i', va_arg(*al, ptrdiff_t)); break;
+                    default: put_raw<int64_t>(out, 'i', va_arg(*al, int)); break;
+                }
+                break;
+            case 'o':
+            case 'u':
+            case 'x':
+            case 'X':
+                switch(spec.length) {
+                    case 'l': put_raw<uint64_t>(out, 'u', va_arg(*al, unsigned long)); break;
+                    case 'q':
+                    case 'L': put_raw<uint64_t>(out, 'u', va_arg(*al, unsigned long long)); break;
+                    case 'j': put_raw<uint64_t>(out, 'u', va_arg(*al, uintmax_t)); break;
+                    case 'z': put_raw<uint64_t>(out, 'u', va_arg(*al, size_t)); break;
+                    case 't': put_raw<uint64_t>(out, 'u', va_arg(*al, ptrdiff_t)); break;
+                    default: put_raw<uint64_t>(out, 'u', va_arg(*al, unsigned int)); break;
+                }
+                break;
+            case 'c':
+                put_raw<int64_t>(out, 'i', va_arg(*al, int));
+                break;
+            case 'p':
+                put_raw<uint64_t>(out, 'p', (uintptr_t)va_arg(*al, void*));
+                break;
+            case 's': {
+                const char* s = va_arg(*al, const char*);
+                if(!s) {
+                    s = "(null)";
+                }
+                uint32_t len = strlen(s);
+                put_raw<uint32_t>(out, 's', len);
+                out.append(s, len + 1);
+                break;
+            }
+            default:
+                // 浮点, long double按double保存
+                if(spec.length == 'L') {
+                    put_raw<double>(out, 'f', (double)va_arg(*al, long double));
+                } else {
+                    put_raw<double>(out, 'f', va_arg(*al, double));
+                }
+                break;
+        }
+        p = spec.end - 1;
     }
-private:
-    std::string m_string;
-};
+    return true;
+}
 
+// 按fmt把编码后的参数渲染到buf
+static bool render_args(LogBuffer& buf, const char* fmt, const char* args, size_t len) {
+    const char* a = args;
+    const char* end = args + len;
+    const char* p = fmt;
+    while(*p) {
+        const char* q = strchr(p, '%');
+        if(!q) {
+            buf.sputn(p, strlen(p));
+            break;
+        }
+        buf.sputn(p, q - p);
+        if(q[1] == '%') {
+            buf.sputc('%');
+            p = q + 2;
+            continue;
+        }
+        FormatSpec spec;
+        if(!parse_spec(q, spec)) {
+            return false;
+        }
+        // 重新拼出说明符: 展开'*', 去掉长度修饰, 整数统一按ll输出
+        char tmp[96];
+        size_t n = 0;
+        for(const char* s = spec.begin; s < spec.end - 1 && n < sizeof(tmp) - 32; ++s) {
+            if(*s == '*') {
+                int64_t v;
+                if(!get_raw(a, end, 'i', v)) {
+                    return false;
+                }
+                n += snprintf(tmp + n, sizeof(tmp) - n, "%d", (int)v);
+            } else if(!strchr("hlqLjzt", *s)) {
+                tmp[n++] = *s;
+            }
+        }
+        switch(spec.conv) {
+            case 'd':
+            case 'i':
+            case 'c': {
+                int64_t v;
+                if(!get_raw(a, end, 'i', v)) {
+                    return false;
+                }
+                if(spec.length == 'H') {
+                    v = (signed char)v;
+                } else if(spec.length == 'h') {
+                    v = (short)v;
+                } else if(spec.length == 0) {
+                    v = (int)v;
+                }
+                if(spec.conv != 'c') {
+                    tmp[n++] = 'l';
+                    tmp[n++] = 'l';
+                }
+                tmp[n++] = spec.conv;
+                tmp[n] = '\0';
+                if(spec.conv == 'c') {
+                    buf.appendFormat(tmp, (int)v);
+                } else {
+                    buf.appendFormat(tmp, (long long)v);
+                }
+                break;
+            }
+            case 'o':
+            case 'u':
+            case 'x':
+            case 'X': {
+                uint64_t v;
+                if(!get_raw(a, end, 'u', v)) {
+                    return false;
+                }
+                if(spec.length == 'H') {
+                    v = (unsigned char)v;
+                } else if(spec.length == 'h') {
+                    v = (unsigned short)v;
+                } else if(spec.length == 0) {
+                    v = (unsigned int)v;
+                }
+                tmp[n++] = 'l';
+                tmp[n++] = 'l';
+                tmp[n++] = spec.conv;
+                tmp[n] = '\0';
+                buf.appendFormat(tmp, (unsigned long long)v);
+                break;
+            }
+            case 'p': {
+                uint64_t v;
+                if(!get_raw(a, end, 'p', v)) {
+                    return false;
+                }
+                tmp[n++] = 'p';
+                tmp[n] = '\0';
+                buf.appendFormat(tmp, (void*)(uintptr_t)v);
+                break;
+            }
+            case 's': {
+                uint32_t v;
+                if(!get_raw(a, end, 's', v) || (size_t)(end - a) < (size_t)v + 1) {
+                    return false;
+                }
+                tmp[n++] = 's';
+                tmp[n] = '\0';
+                buf.appendFormat(tmp, a);
+                a += v + 1;
+                break;
+            }
+            default: {
+                double v;
+                if(!get_raw(a, end, 'f', v)) {
+                    return false;
+                }
+                tmp[n++] = spec.conv;
+                tmp[n] = '\0';
+                buf.appendFormat(tmp, v);
+                break;
+            }
+        }
+        p = spec.end;
+    }
+    return true;
+}
 
 // --------------------------------------------------------
 // LogEvent implementation
@@ -166,8 +406,140 @@ LogEvent::LogEvent(std::shared_ptr<Logger> logger, LogLevel::Level level
         , m_fiberId(fiber_id)
         , m_time(time)
         , m_threadName(thread_name)
+        , m_context(Fiber::GetContext())
+        , m_ss(&m_buf)
         , m_logger(logger)
         , m_level(level) {
+    m_buf.setOwner(this);
+}
+
+void LogEvent::reset(std::shared_ptr<Logger> logger, LogLevel::Level level
+            ,const char* file, int32_t line, uint32_t elapse
+            ,uint32_t thread_id, uint32_t fiber_id, uint64_t time
+            ,const std::string& thread_name) {
+    m_file = file;
+    m_line = line;
+    m_elapse = elapse;
+    m_threadId = thread_id;
+    m_fiberId = fiber_id;
+    m_time = time;
+    // 容量保留, 稳定后不再分配
+    m_threadName.assign(thread_name);
+    // 未使用上下文时只是复制空指针
+    m_context = Fiber::GetContext();
+    m_buf.clear();
+    m_fmt = nullptr;
+    m_args.clear();
+    m_fields.clear();
+    m_rendered.store(RENDERED, std::memory_order_relaxed);
+    // 上一条日志可能修改过流的格式(如std::hex)
+    m_ss.clear();
+    m_ss.flags(std::ios_base::dec | std::ios_base::skipws);
+    m_ss.precision(6);
+    m_ss.width(0);
+    m_ss.fill(' ');
+    m_logger = logger;
+    m_level = level;
+}
+
+void LogEvent::putField(char type, const char* key, const void* data, size_t len) {
+    size_t klen = std::min(strlen(key), (size_t)255);
+    m_fields.push_back(type);
+    m_fields.push_back((char)klen);
+    m_fields.append(key, klen);
+    m_fields.append((const char*)data, len);
+}
+
+void LogEvent::addField(const char* key, bool v) {
+    char b = v;
+    putField(LogField::BOOL, key, &b, 1);
+}
+
+void LogEvent::addField(const char* key, double v) {
+    putField(LogField::DOUBLE, key, &v, sizeof(v));
+}
+
+void LogEvent::addField(const char* key, const char* v) {
+    uint32_t len = strlen(v);
+    putField(LogField::STRING, key, &len, sizeof(len));
+    m_fields.append(v, len);
+}
+
+void LogEvent::addField(const char* key, const std::string& v) {
+    uint32_t len = v.size();
+    putField(LogField::STRING, key, &len, sizeof(len));
+    m_fields.append(v);
+}
+
+bool LogEvent::nextField(size_t& pos, LogField& field) const {
+    if(pos + 2 > m_fields.size()) {
+        return false;
+    }
+    const char* p = m_fields.data() + pos;
+    field.type = (LogField::Type)p[0];
+    field.keyLen = (uint8_t)p[1];
+    field.key = p + 2;
+    p += 2 + field.keyLen;
+    field.str = nullptr;
+    field.strLen = 0;
+    switch(field.type) {
+        case LogField::INT:
+            memcpy(&field.i, p, sizeof(field.i));
+            p += sizeof(field.i);
+            break;
+        case LogField::UINT:
+            memcpy(&field.u, p, sizeof(field.u));
+            p += sizeof(field.u);
+            break;
+        case LogField::DOUBLE:
+            memcpy(&field.f, p, sizeof(field.f));
+            p += sizeof(field.f);
+            break;
+        case LogField::BOOL:
+            field.b = *p++;
+            break;
+        case LogField::STRING: {
+            uint32_t len = 0;
+            memcpy(&len, p, sizeof(len));
+            field.str = p + sizeof(len);
+            field.strLen = len;
+            p += sizeof(len) + len;
+            break;
+        }
+        default:
+            return false;
+    }
+    pos = p - m_fields.data();
+    return true;
+}
+
+LogEvent* LogEvent::FromStream(std::ostream& os) {
+    LogBuffer* buf = dynamic_cast<LogBuffer*>(os.rdbuf());
+    return buf ? buf->getOwner() : nullptr;
+}
+
+// 每个线程事件池的上限, 超出后(如异步Appender积压时)新建的事件用完即释放
+static const size_t s_event_pool_size = 64;
+
+LogEvent::ptr LogEvent::Create(std::shared_ptr<Logger> logger, LogLevel::Level level
+            ,const char* file, int32_t line, uint32_t elapse
+            ,uint32_t thread_id, uint32_t fiber_id, uint64_t time
+            ,const std::string& thread_name) {
+    static thread_local std::vector<LogEvent::ptr> t_pool;
+    for(auto& i : t_pool) {
+        if(i.use_count() == 1) {
+            // 与其他线程(异步Appender)释放引用时的release配对, 之后才能改写事件
+            std::atomic_thread_fence(std::memory_order_acquire);
+            i->reset(logger, level, file, line, elapse, thread_id, fiber_id, time, thread_name);
+            return i;
+        }
+    }
+    LogEvent::ptr event(new LogEvent(logger, level, file, line, elapse
+                        ,thread_id, fiber_id, time, thread_name));
+    if(t_pool.size() < s_event_pool_size) {
+        t_pool.push_back(event);
+    }
+    return event;
 }
 
 /**
@@ -184,12 +556,59 @@ void LogEvent::format(const char* fmt, ...) {
  *  格式化写入日志内容
  */
 void LogEvent::format(const char* fmt, va_list al) {
-    char* buf = nullptr;
-    int len = vasprintf(&buf, fmt, al);
-    if(len != -1) {
-        m_ss << std::string(buf, len);  // 写入内容
-        free(buf);
+    materialize();
+    m_buf.appendf(fmt, al);
+}
+
+/**
+ *  延迟格式化写入日志内容, fmt为字符串字面量
+ */
+void LogEvent::formatLiteral(const char* fmt, ...) {
+    va_list al;
+    va_start(al, fmt);
+    if(!m_fmt && m_buf.size() == 0) {
+        // 只记录格式串与原始参数, 文本在第一次读取时生成
+        va_list cp;
+        va_copy(cp, al);
+        bool ok = encode_args(m_args, fmt, &cp);
+        va_end(cp);
+        if(ok) {
+            m_fmt = fmt;
+            m_rendered.store(PENDING, std::memory_order_relaxed);
+            va_end(al);
+            return;
+        }
+        m_args.clear();
+    }
+    format(fmt, al);
+    va_end(al);
+}
+
+void LogEvent::setFormat(const char* fmt, const std::string& args) {
+    m_buf.clear();
+    m_fmt = fmt;
+    m_args = args;
+    m_rendered.store(PENDING, std::memory_order_relaxed);
+}
+
+void LogEvent::doRender() const {
+    int expected = PENDING;
+    if(m_rendered.compare_exchange_strong(expected, RENDERING, std::memory_order_acquire)) {
+        if(!render_args(m_buf, m_fmt, m_args.data(), m_args.size())) {
+            m_buf.sputn("<<bad log args>>", 16);
+        }
+        m_rendered.store(RENDERED, std::memory_order_release);
+        return;
     }
+    while(m_rendered.load(std::memory_order_acquire) != RENDERED) {
+        sched_yield();
+    }
+}
+
+void LogEvent::materialize() {
+    render();
+    m_fmt = nullptr;
+    m_args.clear();
 }
 
 // --------------------------------------------------------
@@ -202,47 +621,92 @@ Logger::Logger(const std::string& name)
     m_formatter.reset(new LogFormatter("%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n"));
 }
 
+Logger::~Logger() {
+    delete m_appenders.load();
+}
+
+// 回收已被替换的快照, 不能在持有锁时调用(回收时可能析构Appender)
+template<class T>
+static void retire_snapshot(T* ptr) {
+    if(ptr) {
+        EpochMgr::GetInstance()->retire(ptr);
+    }
+}
+
 void Logger::clearAppenders() {
-    MutexType::Lock lock(m_mutex);
-    m_appenders.clear();
+    AppenderListPtr* old = nullptr;
+    {
+        MutexType::Lock lock(m_mutex);
+        old = m_appenders.exchange(nullptr);
+    }
+    retire_snapshot(old);
 }
 
 void Logger::addAppender(LogAppender::ptr appender)
 {
-    MutexType::Lock lock(m_mutex);
-
-    if(!appender->getFormatter()) {
-        MutexType::Lock ll(appender->m_mutex);
-        appender->m_formatter = m_formatter;
+    AppenderListPtr* old = nullptr;
+    {
+        MutexType::Lock lock(m_mutex);
+        {
+            MutexType::Lock ll(appender->m_mutex);
+            if(!appender->formatter()) {
+                appender->swapFormatter(m_formatter);
+            }
+        }
+        old = m_appenders.load(std::memory_order_relaxed);
+        AppenderList* list = old ? new AppenderList(**old) : new AppenderList;
+        list->push_back(appender);
+        m_appenders.store(new AppenderListPtr(list), std::memory_order_release);
     }
-    m_appenders.push_back(appender);
+    retire_snapshot(old);
 }
 
 void Logger::delAppender(LogAppender::ptr appender)
 {
-    MutexType::Lock lock(m_mutex);
-    for (auto it = m_appenders.begin(); // auto (after c++ 11)
-        it != m_appenders.end(); ++it)
+    AppenderListPtr* old = nullptr;
     {
-        if (*it == appender)
-        {
-            m_appenders.erase(it);
-            break;
+        MutexType::Lock lock(m_mutex);
+        AppenderListPtr* cur = m_appenders.load(std::memory_order_relaxed);
+        if(!cur) {
+            return;
+        }
+        const AppenderList& cur_list = **cur;
+        auto it = std::find(cur_list.begin(), cur_list.end(), appender);
+        if(it == cur_list.end()) {
+            return;
         }
+        AppenderListPtr* list = nullptr;
+        if(cur_list.size() > 1) {
+            AppenderList* new_list = new AppenderList(cur_list);
+            new_list->erase(new_list->begin() + (it - cur_list.begin()));
+            list = new AppenderListPtr(new_list);
+        }
+        m_appenders.store(list, std::memory_order_release);
+        old = cur;
     }
+    retire_snapshot(old);
 }
 
 void Logger::setFormatter(LogFormatter::ptr val) {
-    MutexType::Lock lock(m_mutex);
+    std::vector<LogFormatter::ptr*> olds;
+    {
+        MutexType::Lock lock(m_mutex);
 
-    m_formatter = val;
+        m_formatter = val;
 
-    for(auto& i : m_appenders) {
-        MutexType::Lock ll(i->m_mutex);
-        if(!i->m_hasFormatter) {
-            i->m_formatter = m_formatter;
+        AppenderListPtr* list = m_appenders.load(std::memory_order_relaxed);
+        if(list) {
+            for(auto& i : **list) {
+                MutexType::Lock ll(i->m_mutex);
+                if(!i->m_hasFormatter) {
+                    olds.push_back(i->swapFormatter(m_formatter));
+                }
+            }
         }
     }
+    for(auto i : olds) {
+        retire_snapshot(i);
+    }
 }
 
 void Logger::setFormatter(const std::string& val) {
@@ -270,10 +734,19 @@ void Logger::log(LogLevel::Level level, LogEvent::ptr event)
 
         /*  
             当没有为当前logger添加appender的时候，自动调用"root"日志器打印日志
+            读取列表快照不加锁, 只在EpochGuard内取得列表的引用;
+            Appender可能挂起协程(hook的write)或等待队列, 不能在guard内调用
         */
-        MutexType::Lock lock(m_mutex);
-        if(!m_appenders.empty()) {
-            for(auto& i : m_appenders) {
+        AppenderListPtr list;
+        {
+            EpochGuard guard;
+            AppenderListPtr* cur = m_appenders.load(std::memory_order_acquire);
+            if(cur) {
+                list = *cur;
+            }
+        }
+        if(list) {
+            for(auto& i : *list) {
                 i->log(self, level, event);
             }
         } 
@@ -283,164 +756,1386 @@ void Logger::log(LogLevel::Level level, LogEvent::ptr event)
     }
 }
 
-void Logger::debug(LogEvent::ptr event)
-{
-    log(LogLevel::DEBUG, event);
+void Logger::debug(LogEvent::ptr event)
+{
+    log(LogLevel::DEBUG, event);
+}
+
+void Logger::info(LogEvent::ptr event)
+{
+    log(LogLevel::INFO, event);
+}
+
+void Logger::warn(LogEvent::ptr event)
+{
+    log(LogLevel::WARN, event);
+}
+
+void Logger::error(LogEvent::ptr event)
+{
+    log(LogLevel::ERROR, event);
+}
+
+void Logger::fatal(LogEvent::ptr event)
+{
+    log(LogLevel::FATAL, event);
+}
+
+// --------------------------------------------------------
+// LogLevel implementation
+const char *LogLevel::ToString(LogLevel::Level level)
+{
+    switch (level)
+    {
+#define XX(name)         \
+case LogLevel::name: \
+    return #name;   \
+    break;
+
+        XX(DEBUG);
+        XX(INFO);
+        XX(WARN)
+        XX(ERROR);
+        XX(FATAL);
+
+#undef XX
+    default:
+        return "UNKNOWN";
+    }
+
+    return "UNKNOWN";
+}
+
+LogLevel::Level LogLevel::FromString(const std::string& str) {
+#define XX(level, v) \
+    if(str == #v) { \
+        return LogLevel::level; \
+    }
+    // 处理为小写的情况
+    XX(DEBUG, debug);
+    XX(INFO, info);
+    XX(ERROR, error);
+    XX(WARN, warn);
+    XX(FATAL, fatal);
+    
+    XX(DEBUG, DEBUG);
+    XX(INFO, INFO);
+    XX(ERROR, ERROR);
+    XX(WARN, WARN);
+    XX(FATAL, FATAL);
+    return LogLevel::UNKNOWN;
+#undef XX
+}
+
+// --------------------------------------------------------
+// Logappender implementation
+LogAppender::~LogAppender() {
+    delete m_formatter.load();
+}
+
+LogFormatter::ptr LogAppender::getFormatter() {
+    EpochGuard guard;
+    LogFormatter::ptr* fmt = m_formatter.load(std::memory_order_acquire);
+    return fmt ? *fmt : nullptr;
+}
+
+void LogAppender::setFormatter(LogFormatter::ptr val) {
+    LogFormatter::ptr* old = nullptr;
+    {
+        MutexType::Lock lock(m_mutex);
+
+        old = swapFormatter(val);
+        if(val) {
+            m_hasFormatter = true;
+        } 
+        else {
+            m_hasFormatter = false;
+        }
+    }
+    retire_snapshot(old);
+}
+
+LogFormatter::ptr* LogAppender::swapFormatter(const LogFormatter::ptr& val) {
+    return m_formatter.exchange(val ? new LogFormatter::ptr(val) : nullptr
+                                ,std::memory_order_acq_rel);
+}
+
+// 当前线程的格式化缓冲区, 容量保留
+static std::string& get_format_buffer() {
+    static thread_local std::string t_buf;
+    t_buf.clear();
+    return t_buf;
+}
+
+// 后台线程的检查间隔(毫秒)
+static const uint64_t s_file_worker_tick = 100;
+
+// 用gzip压缩path为path.gz, 成功后删除path
+static bool gzip_file(const std::string& path) {
+    FILE* in = fopen(path.c_str(), "rb");
+    if(!in) {
+        return false;
+    }
+    std::string out_path = path + ".gz";
+    gzFile out = gzopen(out_path.c_str(), "wb6");
+    if(!out) {
+        fclose(in);
+        return false;
+    }
+    bool ok = true;
+    char buf[64 * 1024];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if(gzwrite(out, buf, n) != (int)n) {
+            ok = false;
+            break;
+        }
+    }
+    fclose(in);
+    if(gzclose(out) != Z_OK) {
+        ok = false;
+    }
+    if(ok) {
+        unlink(path.c_str());
+    } else {
+        unlink(out_path.c_str());
+    }
+    return ok;
+}
+
+/**
+ *  文件日志的后台线程: 写出长时间没有新日志的缓冲区, 压缩滚动出的文件
+ *  进程退出时不等待, 未压缩的文件保持原样
+ */
+class LogFileWorker {
+public:
+    static LogFileWorker* Get() {
+        // 不析构, 避免与静态对象中的FileLogAppender析构顺序冲突
+        static LogFileWorker* s_worker = new LogFileWorker;
+        return s_worker;
+    }
+
+    void add(FileLogAppender* appender) {
+        Mutex::Lock lock(m_mutex);
+        m_appenders.insert(appender);
+    }
+
+    void del(FileLogAppender* appender) {
+        Mutex::Lock lock(m_mutex);
+        m_appenders.erase(appender);
+    }
+
+    void compress(const std::string& path) {
+        // 调用方持有FileLogAppender的锁, 不能用m_mutex(run中持有m_mutex时会获取FileLogAppender的锁)
+        Mutex::Lock lock(m_jobMutex);
+        m_jobs.push_back(path);
+    }
+private:
+    LogFileWorker() {
+        m_thread.reset(new Thread(std::bind(&LogFileWorker::run, this), "log_file"));
+    }
+
+    void run() {
+        while(true) {
+            usleep(s_file_worker_tick * 1000);
+            std::vector<std::string> jobs;
+            {
+                Mutex::Lock lock(m_mutex);
+                uint64_t now = GetCurrentMS();
+                for(auto i : m_appenders) {
+                    i->onTimer(now);
+                }
+            }
+            {
+                Mutex::Lock lock(m_jobMutex);
+                jobs.swap(m_jobs);
+            }
+            for(auto& i : jobs) {
+                if(!gzip_file(i)) {
+                    std::cout << "LOG COMPRESS " << i << " FAILED" << std::endl;
+                }
+            }
+        }
+    }
+private:
+    // 保护m_appenders
+    Mutex m_mutex;
+    std::set<FileLogAppender*> m_appenders;
+    // 保护m_jobs
+    Mutex m_jobMutex;
+    // 待压缩的文件
+    std::vector<std::string> m_jobs;
+    Thread::ptr m_thread;
+};
+
+const char* FileLogAppender::RotateToString(Rotate v) {
+    switch(v) {
+        case HOURLY:
+            return "hourly";
+        case DAILY:
+            return "daily";
+        default:
+            return "none";
+    }
+}
+
+FileLogAppender::Rotate FileLogAppender::RotateFromString(const std::string& str) {
+    if(str == "hourly" || str == "HOURLY") {
+        return HOURLY;
+    }
+    if(str == "daily" || str == "DAILY") {
+        return DAILY;
+    }
+    return NONE;
+}
+
+FileLogAppender::FileLogAppender(const std::string& filename)
+    : m_filename(filename){
+    reopen();
+    LogFileWorker::Get()->add(this);
+}
+
+FileLogAppender::~FileLogAppender() {
+    LogFileWorker::Get()->del(this);
+    MutexType::Lock lock(m_mutex);
+    flushLocked();
+}
+
+void FileLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event)
+{
+    if(level >= m_level) {
+        // 在锁外格式化, 锁内只追加到缓冲区
+        std::string& buf = get_format_buffer();
+        {
+            EpochGuard guard;
+            formatter()->format(buf, logger, level, event);
+        }
+        time_t now = event->getTime();
+        MutexType::Lock lock(m_mutex);
+        if(m_rotate != NONE && now >= m_periodEnd) {
+            rotateLocked(m_periodBegin, now);
+        } else if(m_maxSize && m_fileSize + buf.size() > m_maxSize && m_fileSize) {
+            rotateLocked(now, now);
+        }
+        m_buf.append(buf);
+        m_fileSize += buf.size();
+        if(m_buf.size() >= m_bufferSize || level >= LogLevel::ERROR
+                || GetCurrentMS() >= m_lastFlush + m_flushInterval) {
+            flushLocked();
+        }
+    }
+}
+
+bool FileLogAppender::reopen()
+{
+    MutexType::Lock lock(m_mutex);
+    flushLocked();
+    return reopenLocked(time(0));
+}
+
+void FileLogAppender::flush() {
+    MutexType::Lock lock(m_mutex);
+    flushLocked();
+}
+
+void FileLogAppender::flushLocked() {
+    m_lastFlush = GetCurrentMS();
+    if(m_buf.empty()) {
+        return;
+    }
+    if(!m_filestream.write(m_buf.data(), m_buf.size()).flush()) {
+        std::cout << "error" << std::endl;
+    }
+    m_buf.clear();
+}
+
+bool FileLogAppender::reopenLocked(time_t now) {
+    if (m_filestream.is_open())
+    {
+        m_filestream.close();
+    }
+    m_filestream.clear();
+    m_filestream.open(m_filename, std::ios::app);
+
+    struct stat st;
+    m_fileSize = stat(m_filename.c_str(), &st) == 0 ? st.st_size : 0;
+
+    if(m_rotate != NONE) {
+        struct tm tm;
+        localtime_r(&now, &tm);
+        tm.tm_min = 0;
+        tm.tm_sec = 0;
+        if(m_rotate == DAILY) {
+            tm.tm_hour = 0;
+        }
+        m_periodBegin = mktime(&tm);
+        // mktime会规范化越界的字段
+        if(m_rotate == DAILY) {
+            ++tm.tm_mday;
+        } else {
+            ++tm.tm_hour;
+        }
+        tm.tm_isdst = -1;
+        m_periodEnd = mktime(&tm);
+    }
+    return !!m_filestream; //  将非零值转成1，0值不变
+}
+
+// 滚动出的文件名: <文件名>.<时间>[.序号], 不与已有文件(含压缩后的)重名
+static std::string rolled_file_name(const std::string& filename, time_t stamp) {
+    struct tm tm;
+    localtime_r(&stamp, &tm);
+    char buf[32];
+    strftime(buf, sizeof(buf), ".%Y%m%d-%H%M%S", &tm);
+    std::string target = filename + buf;
+    struct stat st;
+    for(int i = 1; stat(target.c_str(), &st) == 0
+            || stat((target + ".gz").c_str(), &st) == 0; ++i) {
+        target = filename + buf + "." + std::to_string(i);
+    }
+    return target;
+}
+
+void FileLogAppender::rotateLocked(time_t stamp, time_t now) {
+    flushLocked();
+    m_filestream.close();
+
+    std::string target = rolled_file_name(m_filename, stamp);
+    if(rename(m_filename.c_str(), target.c_str()) == 0) {
+        if(m_compress) {
+            LogFileWorker::Get()->compress(target);
+        }
+    } else {
+        std::cout << "LOG ROTATE " << m_filename << " TO " << target << " FAILED" << std::endl;
+    }
+    reopenLocked(now);
+}
+
+void FileLogAppender::onTimer(uint64_t now_ms) {
+    MutexType::Lock lock(m_mutex);
+    if(!m_buf.empty() && now_ms >= m_lastFlush + m_flushInterval) {
+        flushLocked();
+    }
+}
+
+void FileLogAppender::setBufferSize(size_t v) {
+    MutexType::Lock lock(m_mutex);
+    m_bufferSize = v;
+    if(m_buf.size() >= m_bufferSize) {
+        flushLocked();
+    }
+}
+
+void FileLogAppender::setFlushInterval(uint64_t v) {
+    MutexType::Lock lock(m_mutex);
+    m_flushInterval = v;
+}
+
+void FileLogAppender::setMaxSize(uint64_t v) {
+    MutexType::Lock lock(m_mutex);
+    m_maxSize = v;
+}
+
+void FileLogAppender::setRotate(Rotate v) {
+    MutexType::Lock lock(m_mutex);
+    m_rotate = v;
+    flushLocked();
+    reopenLocked(time(0));
+}
+
+void FileLogAppender::setCompress(bool v) {
+    MutexType::Lock lock(m_mutex);
+    m_compress = v;
+}
+
+void StdoutLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event)
+{
+    if (level >= LogAppender::getLevel())
+    {
+        std::string& buf = get_format_buffer();
+        {
+            EpochGuard guard;
+            formatter()->format(buf, logger, level, event);
+        }
+        MutexType::Lock lock(m_mutex);
+        std::cout.write(buf.data(), buf.size()).flush();
+    }
+}
+
+// --------------------------------------------------------
+// MmapLogAppender implementation
+MmapLogAppender::MmapLogAppender(const std::string& filename, size_t segment_size)
+    :m_filename(filename)
+    ,m_segmentSize(segment_size ? segment_size : 4096) {
+    Mutex::Lock lock(m_rollMutex);
+    recover();
+    if(openSegment(m_segments[0])) {
+        m_active = &m_segments[0];
+    }
+}
+
+MmapLogAppender::~MmapLogAppender() {
+    Mutex::Lock lock(m_rollMutex);
+    Segment* seg = m_active.exchange(nullptr);
+    if(seg) {
+        closeSegment(*seg);
+    }
+}
+
+void MmapLogAppender::recover() {
+    int fd = open(m_filename.c_str(), O_RDWR | O_CLOEXEC);
+    if(fd < 0) {
+        return;
+    }
+    struct stat st;
+    off_t size = fstat(fd, &st) == 0 ? st.st_size : 0;
+    // 从尾部向前找最后一个非0字节
+    char buf[64 * 1024];
+    while(size > 0) {
+        off_t begin = size > (off_t)sizeof(buf) ? size - sizeof(buf) : 0;
+        ssize_t n = pread(fd, buf, size - begin, begin);
+        if(n <= 0) {
+            break;
+        }
+        while(n > 0 && buf[n - 1] == '\0') {
+            --n;
+        }
+        if(n > 0) {
+            size = begin + n;
+            break;
+        }
+        size = begin;
+    }
+    if(ftruncate(fd, size)) {
+        std::cout << "LOG MMAP TRUNCATE " << m_filename << " FAILED" << std::endl;
+    }
+    close(fd);
+    if(size == 0) {
+        unlink(m_filename.c_str());
+    } else {
+        rename(m_filename.c_str(), rolled_file_name(m_filename, time(0)).c_str());
+    }
+}
+
+bool MmapLogAppender::openSegment(Segment& seg) {
+    seg.fd = open(m_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(seg.fd < 0) {
+        std::cout << "LOG MMAP OPEN " << m_filename << " FAILED errno=" << errno << std::endl;
+        return false;
+    }
+    void* base = MAP_FAILED;
+    if(ftruncate(seg.fd, m_segmentSize) == 0) {
+        base = mmap(nullptr, m_segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, seg.fd, 0);
+    }
+    if(base == MAP_FAILED) {
+        std::cout << "LOG MMAP MAP " << m_filename << " FAILED errno=" << errno << std::endl;
+        close(seg.fd);
+        seg.fd = -1;
+        return false;
+    }
+    seg.base = (char*)base;
+    seg.size = m_segmentSize;
+    seg.offset = 0;
+    seg.end = m_segmentSize;
+    return true;
+}
+
+void MmapLogAppender::closeSegment(Segment& seg) {
+    // 切换后已不会有新的写入者, 等正在拷贝的写入者离开
+    while(seg.writers.load() != 0) {
+        sched_yield();
+    }
+    size_t used = std::min(seg.offset.load(), seg.end.load());
+    munmap(seg.base, seg.size);
+    if(ftruncate(seg.fd, used)) {
+        std::cout << "LOG MMAP TRUNCATE " << m_filename << " FAILED" << std::endl;
+    }
+    close(seg.fd);
+    seg.fd = -1;
+    seg.base = nullptr;
+}
+
+void MmapLogAppender::roll(Segment* full) {
+    Mutex::Lock lock(m_rollMutex);
+    if(m_active.load() != full) {
+        // 已被其他线程切换
+        return;
+    }
+    Segment* next = full == &m_segments[0] ? &m_segments[1] : &m_segments[0];
+    // 先改名, 写入者仍可以通过映射写完旧段
+    rename(m_filename.c_str(), rolled_file_name(m_filename, time(0)).c_str());
+    m_active = openSegment(*next) ? next : nullptr;
+    closeSegment(*full);
+}
+
+void MmapLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) {
+    if(level < m_level) {
+        return;
+    }
+    std::string& buf = get_format_buffer();
+    {
+        EpochGuard guard;
+        formatter()->format(buf, logger, level, event);
+    }
+    size_t len = std::min(buf.size(), m_segmentSize);
+    while(true) {
+        Segment* seg = m_active.load();
+        if(!seg) {
+            return;
+        }
+        // 先登记再确认仍是当前段, 与closeSegment中先切换再等待写入者配对
+        seg->writers.fetch_add(1);
+        if(m_active.load() != seg) {
+            seg->writers.fetch_sub(1);
+            continue;
+        }
+        size_t off = seg->offset.fetch_add(len);
+        if(off + len <= seg->size) {
+            memcpy(seg->base + off, buf.data(), len);
+            seg->writers.fetch_sub(1);
+            return;
+        }
+        if(off < seg->size) {
+            // 唯一一次越过段尾的写入, 之前的数据到off为止
+            seg->end = off;
+        }
+        seg->writers.fetch_sub(1);
+        roll(seg);
+    }
+}
+
+std::string MmapLogAppender::toYamlString() {
+    MutexType::Lock lock(m_mutex);
+    YAML::Node node;
+    node["type"] = "MmapLogAppender";
+    if(m_level != LogLevel::UNKNOWN) {
+        node["level"] = LogLevel::ToString(m_level);
+    }
+    if(m_hasFormatter && formatter()) {
+        node["formatter"] = formatter()->getPattern();
+    }
+    node["file"] = m_filename;
+    node["segment_size"] = m_segmentSize;
+    std::stringstream ss;
+    ss << node;
+    return ss.str();
+}
+
+// --------------------------------------------------------
+// BinaryLogAppender implementation
+// 缓冲区超过该大小时写出
+static const size_t s_binary_flush_size = 64 * 1024;
+
+template<class T>
+static void append_pod(std::string& out, T v) {
+    out.append((const char*)&v, sizeof(v));
+}
+
+// 追加u16长度加内容
+static void append_str16(std::string& out, const char* s, size_t len) {
+    if(len > 0xffff) {
+        len = 0xffff;
+    }
+    append_pod<uint16_t>(out, len);
+    out.append(s, len);
+}
+
+BinaryLogAppender::BinaryLogAppender(const std::string& filename)
+    :m_filename(filename) {
+    reopen();
+}
+
+BinaryLogAppender::~BinaryLogAppender() {
+    MutexType::Lock lock(m_mutex);
+    flushLocked();
+}
+
+bool BinaryLogAppender::reopen() {
+    MutexType::Lock lock(m_mutex);
+    flushLocked();
+    if(m_filestream) {
+        m_filestream.close();
+    }
+    m_filestream.open(m_filename, std::ios::app | std::ios::binary);
+    // 新的文件头之后id重新编号
+    m_sites.clear();
+    m_names.clear();
+    m_buf.push_back('H');
+    m_buf.append("APLB", 4);
+    append_pod<uint32_t>(m_buf, s_version);
+    flushLocked();
+    return !!m_filestream;
+}
+
+void BinaryLogAppender::flush() {
+    MutexType::Lock lock(m_mutex);
+    flushLocked();
+}
+
+void BinaryLogAppender::flushLocked() {
+    if(m_buf.empty()) {
+        return;
+    }
+    m_filestream.write(m_buf.data(), m_buf.size());
+    m_filestream.flush();
+    m_buf.clear();
+}
+
+uint32_t BinaryLogAppender::getSiteId(const LogEvent::ptr& event) {
+    Site site = {event->getFile(), event->getLine(), event->getFormat()};
+    auto it = m_sites.find(site);
+    if(it != m_sites.end()) {
+        return it->second;
+    }
+    uint32_t id = m_sites.size() + 1;
+    m_sites[site] = id;
+    m_buf.push_back('S');
+    append_pod<uint32_t>(m_buf, id);
+    append_pod<int32_t>(m_buf, site.line);
+    append_str16(m_buf, site.file, strlen(site.file));
+    m_buf.push_back(site.fmt ? 1 : 0);
+    append_str16(m_buf, site.fmt ? site.fmt : "", site.fmt ? strlen(site.fmt) : 0);
+    return id;
+}
+
+uint32_t BinaryLogAppender::getNameId(const std::string& name) {
+    auto it = m_names.find(name);
+    if(it != m_names.end()) {
+        return it->second;
+    }
+    uint32_t id = m_names.size() + 1;
+    m_names[name] = id;
+    m_buf.push_back('N');
+    append_pod<uint32_t>(m_buf, id);
+    append_str16(m_buf, name.data(), name.size());
+    return id;
+}
+
+void BinaryLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) {
+    if(level < m_level) {
+        return;
+    }
+    MutexType::Lock lock(m_mutex);
+    uint32_t site = getSiteId(event);
+    uint32_t thread_name = getNameId(event->getThreadName());
+    uint32_t logger_name = getNameId(event->getLogger()->getName());
+    m_buf.push_back('L');
+    append_pod<uint32_t>(m_buf, site);
+    append_pod<uint8_t>(m_buf, level);
+    append_pod<uint64_t>(m_buf, event->getTime());
+    append_pod<uint32_t>(m_buf, event->getElapse());
+    append_pod<uint32_t>(m_buf, event->getThreadId());
+    append_pod<uint32_t>(m_buf, event->getFiberId());
+    append_pod<uint32_t>(m_buf, thread_name);
+    append_pod<uint32_t>(m_buf, logger_name);
+    if(event->getFormat()) {
+        const std::string& args = event->getArgs();
+        append_pod<uint32_t>(m_buf, args.size());
+        m_buf.append(args);
+    } else {
+        append_pod<uint32_t>(m_buf, event->getContentSize());
+        m_buf.append(event->getContentData(), event->getContentSize());
+    }
+    // 缓冲区满,错误日志,或跨秒时写出, 进程崩溃最多丢失约1秒的低级别日志
+    if(m_buf.size() >= s_binary_flush_size || level >= LogLevel::ERROR
+            || event->getTime() != m_lastFlush) {
+        flushLocked();
+        m_lastFlush = event->getTime();
+    }
+}
+
+std::string BinaryLogAppender::toYamlString() {
+    MutexType::Lock lock(m_mutex);
+    YAML::Node node;
+    node["type"] = "BinaryLogAppender";
+    if(m_level != LogLevel::UNKNOWN) {
+        node["level"] = LogLevel::ToString(m_level);
+    }
+    node["file"] = m_filename;
+    std::stringstream ss;
+    ss << node;
+    return ss.str();
+}
+
+// --------------------------------------------------------
+// BinaryLogReader implementation
+BinaryLogReader::BinaryLogReader(const std::string& filename)
+    :m_filestream(filename, std::ios::binary) {
+    char type = 0;
+    m_ok = m_filestream.get(type) && type == 'H' && readHeader();
+}
+
+bool BinaryLogReader::readHeader() {
+    char magic[4];
+    uint32_t version = 0;
+    if(!m_filestream.read(magic, 4) || memcmp(magic, "APLB", 4)
+            || !m_filestream.read((char*)&version, sizeof(version))
+            || version != BinaryLogAppender::s_version) {
+        return false;
+    }
+    m_sites.clear();
+    m_names.clear();
+    return true;
+}
+
+template<class T>
+static bool read_pod(std::istream& is, T& v) {
+    return !!is.read((char*)&v, sizeof(v));
+}
+
+static bool read_str16(std::istream& is, std::string& s) {
+    uint16_t len = 0;
+    if(!read_pod(is, len)) {
+        return false;
+    }
+    s.resize(len);
+    return len == 0 || !!is.read(&s[0], len);
+}
+
+LogEvent::ptr BinaryLogReader::next() {
+    if(!m_ok) {
+        return nullptr;
+    }
+    char type = 0;
+    while(m_filestream.get(type)) {
+        if(type == 'H') {
+            if(!readHeader()) {
+                break;
+            }
+        } else if(type == 'S') {
+            uint32_t id = 0;
+            uint8_t has_fmt = 0;
+            Site site;
+            if(!read_pod(m_filestream, id) || !read_pod(m_filestream, site.line)
+                    || !read_str16(m_filestream, site.file)
+                    || !read_pod(m_filestream, has_fmt)
+                    || !read_str16(m_filestream, site.fmt)) {
+                break;
+            }
+            site.hasFmt = has_fmt;
+            m_sites[id] = site;
+        } else if(type == 'N') {
+            uint32_t id = 0;
+            std::string name;
+            if(!read_pod(m_filestream, id) || !read_str16(m_filestream, name)) {
+                break;
+            }
+            m_names[id] = name;
+        } else if(type == 'L') {
+            uint32_t site_id = 0, elapse = 0, thread_id = 0, fiber_id = 0;
+            uint32_t thread_name = 0, logger_name = 0, len = 0;
+            uint8_t level = 0;
+            uint64_t time = 0;
+            if(!read_pod(m_filestream, site_id) || !read_pod(m_filestream, level)
+                    || !read_pod(m_filestream, time) || !read_pod(m_filestream, elapse)
+                    || !read_pod(m_filestream, thread_id) || !read_pod(m_filestream, fiber_id)
+                    || !read_pod(m_filestream, thread_name) || !read_pod(m_filestream, logger_name)
+                    || !read_pod(m_filestream, len)) {
+                break;
+            }
+            std::string payload(len, '\0');
+            if(len && !m_filestream.read(&payload[0], len)) {
+                break;
+            }
+            auto sit = m_sites.find(site_id);
+            if(sit == m_sites.end()) {
+                break;
+            }
+            const std::string& name = m_names[logger_name];
+            Logger::ptr& logger = m_loggers[name];
+            if(!logger) {
+                logger.reset(new Logger(name));
+            }
+            LogEvent::ptr event(new LogEvent(logger, (LogLevel::Level)level
+                        ,sit->second.file.c_str(), sit->second.line, elapse
+                        ,thread_id, fiber_id, time, m_names[thread_name]));
+            if(sit->second.hasFmt) {
+                event->setFormat(sit->second.fmt.c_str(), payload);
+            } else {
+                event->getSS().write(payload.data(), payload.size());
+            }
+            return event;
+        } else {
+            break;
+        }
+    }
+    return nullptr;
+}
+
+// --------------------------------------------------------
+// AsyncLogAppender implementation
+struct AsyncLogAppender::Ring {
+    struct Item {
+        Logger::ptr logger;
+        LogLevel::Level level;
+        LogEvent::ptr event;
+    };
+
+    Ring(size_t size)
+        :items(size)
+        ,mask(size - 1) {
+    }
+
+    std::vector<Item> items;
+    size_t mask;
+    // 生产者采样计数
+    uint64_t sampleSeq = 0;
+    // 所属Appender已析构, 线程下次查找时从登记表中删除
+    std::atomic<bool> dead {false};
+    // 读写位置分处不同缓存行, 避免生产者与后台线程互相失效
+    char pad0[64];
+    // 下一个待写出的位置, 只由后台线程推进(写出之后才推进)
+    std::atomic<uint64_t> head {0};
+    char pad1[64];
+    // 下一个写入位置, 只由生产者推进
+    std::atomic<uint64_t> tail {0};
+    char pad2[64];
+};
+
+static std::atomic<uint64_t> s_async_appender_id {0};
+
+const char* AsyncLogAppender::OverflowToString(Overflow v) {
+    switch(v) {
+        case DROP:
+            return "drop";
+        case SAMPLE:
+            return "sample";
+        default:
+            return "block";
+    }
+}
+
+AsyncLogAppender::Overflow AsyncLogAppender::OverflowFromString(const std::string& str) {
+    if(str == "drop" || str == "DROP") {
+        return DROP;
+    }
+    if(str == "sample" || str == "SAMPLE") {
+        return SAMPLE;
+    }
+    return BLOCK;
+}
+
+AsyncLogAppender::AsyncLogAppender(LogAppender::ptr target, size_t queue_size
+                                ,Overflow overflow, uint32_t sample_rate)
+    :m_target(target)
+    ,m_queueSize(2)
+    ,m_overflow(overflow)
+    ,m_sampleRate(sample_rate ? sample_rate : 1)
+    ,m_id(++s_async_appender_id) {
+    while(m_queueSize < queue_size) {
+        m_queueSize <<= 1;
+    }
+    m_level = target->getLevel();
+    m_thread.reset(new Thread(std::bind(&AsyncLogAppender::run, this), "log_async"));
+}
+
+AsyncLogAppender::~AsyncLogAppender() {
+    m_stop = true;
+    wake();
+    m_thread->join();
+    // 各线程的登记表中仍引用着队列: 先释放队列的空间, 队列本身由线程下次查找时删除
+    Mutex::Lock lock(m_ringMutex);
+    for(auto& i : m_rings) {
+        std::vector<Ring::Item>().swap(i->items);
+        i->dead.store(true, std::memory_order_release);
+    }
+    m_rings.clear();
+}
+
+AsyncLogAppender::Ring* AsyncLogAppender::getRing() {
+    // 线程已登记的队列, 按实例id查找; 线程退出后队列由后台线程回收
+    static thread_local std::vector<std::pair<uint64_t, std::shared_ptr<Ring> > > t_rings;
+    for(size_t i = 0; i < t_rings.size();) {
+        if(t_rings[i].second->dead.load(std::memory_order_acquire)) {
+            // 已析构的Appender(如配置重载时被替换)留下的队列
+            t_rings[i] = std::move(t_rings.back());
+            t_rings.pop_back();
+            continue;
+        }
+        if(t_rings[i].first == m_id) {
+            return t_rings[i].second.get();
+        }
+        ++i;
+    }
+    std::shared_ptr<Ring> ring(new Ring(m_queueSize));
+    {
+        Mutex::Lock lock(m_ringMutex);
+        m_rings.push_back(ring);
+    }
+    t_rings.push_back(std::make_pair(m_id, ring));
+    return ring.get();
+}
+
+void AsyncLogAppender::wake() {
+    // 与run中先置m_sleeping再检查队列配对, 二者都是seq_cst, 不会同时错过
+    if(m_sleeping.load() && m_sleeping.exchange(false)) {
+        m_sem.notify();
+    }
+}
+
+void AsyncLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) {
+    if(level < m_level) {
+        return;
+    }
+    Ring* ring = getRing();
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    uint64_t used = tail - ring->head.load(std::memory_order_acquire);
+    if(m_overflow == BLOCK) {
+        // 调用方可能持有Logger的锁, 不能让出协程, 只让出CPU
+        while(used >= m_queueSize && !m_stop) {
+            wake();
+            sched_yield();
+            used = tail - ring->head.load(std::memory_order_acquire);
+        }
+    } else if(m_overflow == SAMPLE && used >= m_queueSize / 4 * 3 && used < m_queueSize) {
+        if(level < LogLevel::ERROR && ring->sampleSeq++ % m_sampleRate) {
+            ++m_sampled;
+            return;
+        }
+    }
+    if(used >= m_queueSize) {
+        ++m_dropped;
+        return;
+    }
+    Ring::Item& item = ring->items[tail & ring->mask];
+    item.logger = logger;
+    item.level = level;
+    item.event = event;
+    ring->tail.store(tail + 1);
+    wake();
+}
+
+bool AsyncLogAppender::pending() {
+    Mutex::Lock lock(m_ringMutex);
+    for(auto& i : m_rings) {
+        if(i->head.load(std::memory_order_relaxed) != i->tail.load()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool AsyncLogAppender::drain() {
+    std::vector<std::shared_ptr<Ring> > rings;
+    {
+        Mutex::Lock lock(m_ringMutex);
+        rings = m_rings;
+    }
+
+    // 未单独设置格式器时使用Logger下发给本Appender的格式器
+    LogFormatter::ptr fmt = getFormatter();
+    LogFormatter::ptr* old = nullptr;
+    {
+        MutexType::Lock lock(m_target->m_mutex);
+        if(!m_target->m_hasFormatter && m_target->formatter() != fmt.get()) {
+            old = m_target->swapFormatter(fmt);
+        }
+    }
+    retire_snapshot(old);
+
+    bool written = false;
+    for(auto& ring : rings) {
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        uint64_t tail = ring->tail.load(std::memory_order_acquire);
+        if(head == tail) {
+            continue;
+        }
+        for(uint64_t i = head; i != tail; ++i) {
+            Ring::Item& item = ring->items[i & ring->mask];
+            m_target->log(item.logger, item.level, item.event);
+            item.logger.reset();
+            item.event.reset();
+        }
+        ring->head.store(tail, std::memory_order_release);
+        written = true;
+    }
+    return written;
+}
+
+void AsyncLogAppender::run() {
+    while(true) {
+        if(drain()) {
+            continue;
+        }
+        if(m_stop) {
+            break;
+        }
+        {
+            // 回收已退出线程留下的空队列
+            Mutex::Lock lock(m_ringMutex);
+            for(auto it = m_rings.begin(); it != m_rings.end();) {
+                if(it->use_count() == 1 && (*it)->head == (*it)->tail) {
+                    it = m_rings.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        m_sleeping = true;
+        if(pending() || m_stop) {
+            // 若已被生产者抢先置回false, 对方会notify, 需要消耗掉这次notify
+            if(!m_sleeping.exchange(false)) {
+                m_sem.wait();
+            }
+            continue;
+        }
+        m_sem.wait();
+    }
+}
+
+void AsyncLogAppender::flush() {
+    std::vector<std::pair<std::shared_ptr<Ring>, uint64_t> > marks;
+    {
+        Mutex::Lock lock(m_ringMutex);
+        for(auto& i : m_rings) {
+            marks.push_back(std::make_pair(i, i->tail.load()));
+        }
+    }
+    for(auto& i : marks) {
+        while(i.first->head.load(std::memory_order_acquire) < i.second) {
+            wake();
+            usleep(1000);
+        }
+    }
 }
 
-void Logger::info(LogEvent::ptr event)
-{
-    log(LogLevel::INFO, event);
-}
+// --------------------------------------------------------
+// Logformatter implementation
+static std::atomic<uint64_t> s_formatter_id {0};
 
-void Logger::warn(LogEvent::ptr event)
-{
-    log(LogLevel::WARN, event);
+LogFormatter::LogFormatter(const std::string &pattern)
+    : m_pattern(pattern)
+    , m_id(++s_formatter_id) {
+    init();
 }
 
-void Logger::error(LogEvent::ptr event)
-{
-    log(LogLevel::ERROR, event);
+std::string LogFormatter::format(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
+    std::string out;
+    format(out, logger, level, event);
+    return out;
 }
 
-void Logger::fatal(LogEvent::ptr event)
-{
-    log(LogLevel::FATAL, event);
+std::ostream& LogFormatter::format(std::ostream& ofs, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
+    static thread_local std::string t_out;
+    t_out.clear();
+    format(t_out, logger, level, event);
+    ofs.write(t_out.data(), t_out.size());
+    return ofs;
 }
 
-// --------------------------------------------------------
-// LogLevel implementation
-const char *LogLevel::ToString(LogLevel::Level level)
-{
-    switch (level)
-    {
-#define XX(name)         \
-case LogLevel::name: \
-    return #name;   \
-    break;
-
-        XX(DEBUG);
-        XX(INFO);
-        XX(WARN)
-        XX(ERROR);
-        XX(FATAL);
+// 追加无符号整数
+static void append_uint(std::string& out, uint64_t v) {
+    char buf[24];
+    char* p = buf + sizeof(buf);
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while(v);
+    out.append(p, buf + sizeof(buf) - p);
+}
 
-#undef XX
-    default:
-        return "UNKNOWN";
+// 追加有符号整数
+static void append_int(std::string& out, int64_t v) {
+    if(v < 0) {
+        out.push_back('-');
+        append_uint(out, -(uint64_t)v);
+    } else {
+        append_uint(out, v);
     }
+}
 
-    return "UNKNOWN";
+// 追加带引号的JSON字符串, 不需转义的连续字符整段追加
+static void append_json_string(std::string& out, const char* s, size_t n) {
+    static const char s_hex[] = "0123456789abcdef";
+    out.push_back('"');
+    const char* run = s;
+    for(size_t i = 0; i < n; ++i) {
+        unsigned char c = s[i];
+        if(c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        out.append(run, s + i - run);
+        run = s + i + 1;
+        switch(c) {
+            case '"':
+                out.append("\\\"");
+                break;
+            case '\\':
+                out.append("\\\\");
+                break;
+            case '\n':
+                out.append("\\n");
+                break;
+            case '\r':
+                out.append("\\r");
+                break;
+            case '\t':
+                out.append("\\t");
+                break;
+            default:
+                out.append("\\u00");
+                out.push_back(s_hex[c >> 4]);
+                out.push_back(s_hex[c & 0xf]);
+                break;
+        }
+    }
+    out.append(run, s + n - run);
+    out.push_back('"');
 }
 
-LogLevel::Level LogLevel::FromString(const std::string& str) {
-#define XX(level, v) \
-    if(str == #v) { \
-        return LogLevel::level; \
+// 追加logfmt值, 为空或含空白, 等号, 引号, 控制字符时按JSON字符串加引号转义
+static void append_logfmt_value(std::string& out, const char* s, size_t n) {
+    bool quote = n == 0;
+    for(size_t i = 0; i < n && !quote; ++i) {
+        unsigned char c = s[i];
+        quote = c <= ' ' || c == '=' || c == '"' || c == '\\';
+    }
+    if(quote) {
+        append_json_string(out, s, n);
+    } else {
+        out.append(s, n);
     }
-    // 处理为小写的情况
-    XX(DEBUG, debug);
-    XX(INFO, info);
-    XX(ERROR, error);
-    XX(WARN, warn);
-    XX(FATAL, fatal);
-    
-    XX(DEBUG, DEBUG);
-    XX(INFO, INFO);
-    XX(ERROR, ERROR);
-    XX(WARN, WARN);
-    XX(FATAL, FATAL);
-    return LogLevel::UNKNOWN;
-#undef XX
 }
 
-// --------------------------------------------------------
-// Logappender implementation
-LogFormatter::ptr LogAppender::getFormatter() {
-    MutexType::Lock lock(m_mutex);
 
-    return m_formatter;
+// 追加浮点数, 取能还原原值的最短精度; JSON中非有限值输出null
+static void append_double(std::string& out, double v, bool json) {
+    if(json && !std::isfinite(v)) {
+        out.append("null");
+        return;
+    }
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%.15g", v);
+    if(strtod(buf, nullptr) != v) {
+        n = snprintf(buf, sizeof(buf), "%.17g", v);
+    }
+    out.append(buf, n);
 }
 
-void LogAppender::setFormatter(LogFormatter::ptr val) {
-    MutexType::Lock lock(m_mutex);
+// 按秒缓存的时间文本, 每个线程一份, 按(格式器id, 指令下标)直接映射
+struct DateTimeCache {
+    uint64_t key = 0;
+    time_t time = -1;
+    size_t len = 0;
+    char buf[64];
+};
 
-    m_formatter = val;
-    if(m_formatter) {
-        m_hasFormatter = true;
-    } 
-    else {
-        m_hasFormatter = false;
+static const size_t s_datetime_cache_size = 8;
+
+void LogFormatter::appendDateTime(std::string& out, size_t index, time_t time) {
+    static thread_local DateTimeCache t_caches[s_datetime_cache_size];
+    uint64_t key = (m_id << 8) | (index & 0xff);
+    DateTimeCache& c = t_caches[(m_id + index) % s_datetime_cache_size];
+    if(c.key != key || c.time != time) {
+        struct tm tm;
+        localtime_r(&time, &tm);
+        c.len = strftime(c.buf, sizeof(c.buf), m_ops[index].str.c_str(), &tm);
+        c.key = key;
+        c.time = time;
     }
+    out.append(c.buf, c.len);
 }
 
-FileLogAppender::FileLogAppender(const std::string& filename)
-    : m_filename(filename){
-    reopen();
+void LogFormatter::format(std::string& out, const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event) {
+    for(size_t i = 0; i < m_ops.size(); ++i) {
+        const Op& op = m_ops[i];
+        switch(op.kind) {
+            case Op::STRING:
+                out.append(op.str);
+                break;
+            case Op::MESSAGE:
+                appendEscaped(out, event->getContentData(), event->getContentSize(), op.esc);
+                break;
+            case Op::LEVEL:
+                out.append(LogLevel::ToString(level));
+                break;
+            case Op::ELAPSE:
+                append_uint(out, event->getElapse());
+                break;
+            case Op::NAME: {
+                const std::string& name = event->getLogger()->getName();
+                appendEscaped(out, name.data(), name.size(), op.esc);
+                break;
+            }
+            case Op::THREAD_ID:
+                append_uint(out, event->getThreadId());
+                break;
+            case Op::DATETIME:
+                appendDateTime(out, i, event->getTime());
+                break;
+            case Op::FILENAME:
+                appendEscaped(out, event->getFile(), strlen(event->getFile()), op.esc);
+                break;
+            case Op::LINE:
+                append_int(out, event->getLine());
+                break;
+            case Op::FIBER_ID:
+                append_uint(out, event->getFiberId());
+                break;
+            case Op::THREAD_NAME:
+                appendEscaped(out, event->getThreadName().data()
+                               ,event->getThreadName().size(), op.esc);
+                break;
+            case Op::FIELDS:
+                appendFields(out, event, op.esc);
+                break;
+            case Op::CONTEXT:
+                appendContext(out, event, op);
+                break;
+        }
+    }
 }
 
-void FileLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event)
-{
-    if(level >= m_level) {
-        uint64_t now = event->getTime();
-        if(now >= (m_lastTime + 3)) {
-            reopen();
-            m_lastTime = now;
+void LogFormatter::appendContext(std::string& out, const LogEvent::ptr& event, const Op& op) {
+    const FiberContext::ptr& ctx = event->getContext();
+    if(!op.str.empty()) {
+        const std::string* value = ctx ? ctx->get(op.str) : nullptr;
+        if(value) {
+            appendEscaped(out, value->data(), value->size(), op.esc);
+        } else if(op.esc == Op::JSON) {
+            out.append("null");
         }
-        MutexType::Lock lock(m_mutex);
-        if(!m_formatter->format(m_filestream, logger, level, event)) {
-            std::cout << "error" << std::endl;
+        return;
+    }
+    if(!ctx) {
+        return;
+    }
+    bool first = true;
+    for(auto& i : ctx->getItems()) {
+        if(op.esc == Op::JSON) {
+            out.push_back(',');
+            append_json_string(out, i.first.data(), i.first.size());
+            out.push_back(':');
+            append_json_string(out, i.second.data(), i.second.size());
+        } else {
+            if(op.esc == Op::LOGFMT || !first) {
+                out.push_back(' ');
+            }
+            out.append(i.first);
+            out.push_back('=');
+            append_logfmt_value(out, i.second.data(), i.second.size());
         }
+        first = false;
     }
 }
 
-bool FileLogAppender::reopen()
-{
-    MutexType::Lock lock(m_mutex);
-    if (m_filestream)
-    {
-        m_filestream.close();
+void LogFormatter::appendEscaped(std::string& out, const char* s, size_t n, Op::Escape esc) {
+    switch(esc) {
+        case Op::JSON:
+            append_json_string(out, s, n);
+            break;
+        case Op::LOGFMT:
+            append_logfmt_value(out, s, n);
+            break;
+        default:
+            out.append(s, n);
+            break;
     }
-
-    m_filestream.open(m_filename);
-
-    return !!m_filestream; //  将非零值转成1，0值不变
 }
 
-void StdoutLogAppender::log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event)
-{
-    if (level >= LogAppender::getLevel())
-    {
-        MutexType::Lock lock(m_mutex);
-        m_formatter->format(std::cout, logger, level, event);
+void LogFormatter::appendFields(std::string& out, const LogEvent::ptr& event, Op::Escape esc) {
+    size_t pos = 0;
+    LogField field;
+    bool first = true;
+    while(event->nextField(pos, field)) {
+        if(esc == Op::JSON) {
+            out.push_back(',');
+            append_json_string(out, field.key, field.keyLen);
+            out.push_back(':');
+        } else {
+            // logfmt模式跟在其他属性之后, %K只在字段之间加空格
+            if(esc == Op::LOGFMT || !first) {
+                out.push_back(' ');
+            }
+            out.append(field.key, field.keyLen);
+            out.push_back('=');
+        }
+        first = false;
+        switch(field.type) {
+            case LogField::INT:
+                append_int(out, field.i);
+                break;
+            case LogField::UINT:
+                append_uint(out, field.u);
+                break;
+            case LogField::DOUBLE:
+                append_double(out, field.f, esc == Op::JSON);
+                break;
+            case LogField::BOOL:
+                out.append(field.b ? "true" : "false");
+                break;
+            case LogField::STRING:
+                if(esc == Op::JSON) {
+                    append_json_string(out, field.str, field.strLen);
+                } else {
+                    append_logfmt_value(out, field.str, field.strLen);
+                }
+                break;
+        }
     }
 }
 
-// --------------------------------------------------------
-// Logformatter implementation
-LogFormatter::LogFormatter(const std::string &pattern)
-    : m_pattern(pattern){
-    init();
-}
-
-std::string LogFormatter::format(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
-    std::stringstream ss;
-    for(auto& i : m_items) {
-        i->format(ss, logger, level, event);
+void LogFormatter::addOp(Op::Kind kind, const std::string& str, Op::Escape esc) {
+    if(kind == Op::STRING && !m_ops.empty() && m_ops.back().kind == Op::STRING) {
+        m_ops.back().str.append(str);
+        return;
     }
-    return ss.str();
+    Op op;
+    op.kind = kind;
+    op.esc = esc;
+    op.str = str;
+    m_ops.push_back(op);
 }
 
-std::ostream& LogFormatter::format(std::ostream& ofs, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
-    for(auto& i : m_items) {
-        i->format(ofs, logger, level, event);
+void LogFormatter::initStructured(Op::Escape esc) {
+    static const struct {
+        const char* key;
+        Op::Kind kind;
+    } s_items[] = {
+        {"time", Op::DATETIME},
+        {"level", Op::LEVEL},
+        {"logger", Op::NAME},
+        {"thread", Op::THREAD_ID},
+        {"thread_name", Op::THREAD_NAME},
+        {"fiber", Op::FIBER_ID},
+        {"file", Op::FILENAME},
+        {"line", Op::LINE},
+        {"msg", Op::MESSAGE},
+    };
+    bool json = esc == Op::JSON;
+    for(size_t i = 0; i < sizeof(s_items) / sizeof(s_items[0]); ++i) {
+        if(json) {
+            addOp(Op::STRING, std::string(i ? "," : "{") + "\"" + s_items[i].key + "\":");
+        } else {
+            addOp(Op::STRING, std::string(i ? " " : "") + s_items[i].key + "=");
+        }
+        // 时间和级别不含需转义的字符, JSON中只需加引号
+        bool quote = json && (s_items[i].kind == Op::DATETIME || s_items[i].kind == Op::LEVEL);
+        if(quote) {
+            addOp(Op::STRING, "\"");
+        }
+        addOp(s_items[i].kind, s_items[i].kind == Op::DATETIME ? "%Y-%m-%dT%H:%M:%S" : "", esc);
+        if(quote) {
+            addOp(Op::STRING, "\"");
+        }
     }
-    return ofs;
+    addOp(Op::CONTEXT, "", esc);
+    addOp(Op::FIELDS, "", esc);
+    addOp(Op::STRING, json ? "}\n" : "\n");
 }
 
 // 日志输出格式初始化
 void LogFormatter::init()
 {
+    if(m_pattern == "json") {
+        initStructured(Op::JSON);
+        return;
+    }
+    if(m_pattern == "logfmt") {
+        initStructured(Op::LOGFMT);
+        return;
+    }
+
     // str, format, type
     std::vector<std::tuple<std::string, std::string, int>> vec;
     std::string nstr;
@@ -527,44 +2222,51 @@ void LogFormatter::init()
     {
         vec.push_back(std::make_tuple(nstr, "", 0));
     }
-    static std::map<std::string, std::function<FormatItem::ptr(const std::string &str)>> s_format_items = {
+    static std::map<std::string, std::function<void(LogFormatter*, const std::string &fmt)>> s_format_items = {
 #define XX(str, C)                                                               \
 {                                                                            \
-#str, [](const std::string &fmt) { return FormatItem::ptr(new C(fmt)); } \
-}
-
-        XX(m, MessageFormatItem),       // m:消息
-        XX(p, LevelFormatItem),         // p:日志级别
-        XX(r, ElapseFormatItem),        // r:累计毫秒数
-        XX(c, NameFormatItem),          // c:日志名称
-        XX(t, ThreadIdFormatItem),      // t:线程id
-        XX(n, NewLineFormatItem),       // n:换行
-        XX(d, DateTimeFormatItem),      // d:时间
-        XX(f, FilenameFormatItem),      // f:文件名
-        XX(l, LineFormatItem),          // l:行号
-        XX(T, TabFormatItem),           // T:Tab
-        XX(F, FiberIdFormatItem),       // F:协程id
-        XX(N, ThreadNameFormatItem),    // N:线程名称
+#str, [](LogFormatter* self, const std::string &fmt) { self->addOp(Op::C); } \
+}
+
+        XX(m, MESSAGE),         // m:消息
+        XX(p, LEVEL),           // p:日志级别
+        XX(r, ELAPSE),          // r:累计毫秒数
+        XX(c, NAME),            // c:日志名称
+        XX(t, THREAD_ID),       // t:线程id
+        XX(f, FILENAME),        // f:文件名
+        XX(l, LINE),            // l:行号
+        XX(F, FIBER_ID),        // F:协程id
+        XX(N, THREAD_NAME),     // N:线程名称
+        XX(K, FIELDS),          // K:结构化字段
 #undef XX
+        // X:协程上下文, X{key}:上下文中key的值
+        {"X", [](LogFormatter* self, const std::string &fmt) { self->addOp(Op::CONTEXT, fmt); }},
+        // n:换行
+        {"n", [](LogFormatter* self, const std::string &fmt) { self->addOp(Op::STRING, "\n"); }},
+        // T:Tab
+        {"T", [](LogFormatter* self, const std::string &fmt) { self->addOp(Op::STRING, "\t"); }},
+        // d:时间
+        {"d", [](LogFormatter* self, const std::string &fmt) {
+            self->addOp(Op::DATETIME, fmt.empty() ? "%Y-%m-%d %H:%M:%S" : fmt); }},
     };
 
     for (auto &i : vec)
     {
         if (std::get<2>(i) == 0)
         {
-            m_items.push_back(FormatItem::ptr(new StringFormatItem(std::get<0>(i))));
+            addOp(Op::STRING, std::get<0>(i));
         }
         else
         {
             auto it = s_format_items.find(std::get<0>(i));
             if (it == s_format_items.end())
             {
-                m_items.push_back(FormatItem::ptr(new StringFormatItem("<<error_format %" + std::get<0>(i) + ">>")));
+                addOp(Op::STRING, "<<error_format %" + std::get<0>(i) + ">>");
                 m_error = true;
             }
             else
             {
-                m_items.push_back(it->second(std::get<1>(i)));
+                it->second(this, std::get<1>(i));
             }
         }
     }
@@ -573,46 +2275,116 @@ void LogFormatter::init()
 // ---------------------------------------------------
 // LoggerManager implementation
 LoggerManager::LoggerManager() {
+    for(int i = 0; i < s_dir_size; ++i) {
+        m_chunks[i].store(nullptr, std::memory_order_relaxed);
+    }
     m_root.reset(new Logger);
     m_root->addAppender(LogAppender::ptr(new StdoutLogAppender));
 
-    m_loggers[m_root->m_name] = m_root;
+    // 主日志器的句柄为0
+    Chunk* chunk = new Chunk;
+    chunk->loggers[0] = m_root;
+    m_chunks[0].store(chunk, std::memory_order_release);
+    NameIndex* index = new NameIndex;
+    (*index)[m_root->m_name] = 0;
+    m_index.store(index, std::memory_order_release);
+    m_size = 1;
 }
 
-Logger::ptr LoggerManager::getLogger(const std::string& name) {
-    MutexType::Lock lock(m_mutex);
+LoggerManager::~LoggerManager() {
+    for(int i = 0; i < s_dir_size; ++i) {
+        delete m_chunks[i].load();
+    }
+    delete m_index.load();
+}
 
-    auto it = m_loggers.find(name);
-    if(it != m_loggers.end()) {
-        return it->second;
+uint32_t LoggerManager::getHandle(const std::string& name) {
+    {
+        EpochGuard guard;
+        NameIndex* index = m_index.load(std::memory_order_acquire);
+        auto it = index->find(name);
+        if(it != index->end()) {
+            return it->second;
+        }
     }
 
-    Logger::ptr logger(new Logger(name));
-    /* 
-        每个logger里都会有一个名为“root”的主logger，
-        当没有为当前logger设置appender时，会自动调用“root” logger进行日志处理
-        经由日志管理器生成的logger中m_root的root都是一样的，只有一个
-    */
-    logger->m_root = m_root;   
-    m_loggers[name] = logger;
+    NameIndex* old = nullptr;
+    uint32_t handle = 0;
+    {
+        MutexType::Lock lock(m_mutex);
+        NameIndex* cur = m_index.load(std::memory_order_relaxed);
+        auto it = cur->find(name);
+        if(it != cur->end()) {
+            return it->second;
+        }
+        if(m_size >= (uint32_t)s_dir_size * s_chunk_size) {
+            std::cout << "LOGGER MANAGER FULL, NAME: " << name << " USE ROOT" << std::endl;
+            return 0;
+        }
+        handle = m_size;
+        std::atomic<Chunk*>& dir = m_chunks[handle >> s_chunk_bits];
+        Chunk* chunk = dir.load(std::memory_order_relaxed);
+        if(!chunk) {
+            chunk = new Chunk;
+        }
 
-    return logger;
+        Logger::ptr logger(new Logger(name));
+        /* 
+            每个logger里都会有一个名为“root”的主logger，
+            当没有为当前logger设置appender时，会自动调用“root” logger进行日志处理
+            经由日志管理器生成的logger中m_root的root都是一样的，只有一个
+        */
+        logger->m_root = m_root;   
+        chunk->loggers[handle & (s_chunk_size - 1)] = logger;
+        dir.store(chunk, std::memory_order_release);
+        ++m_size;
+
+        // 句柄先于索引发布, 从索引查到的句柄一定可用
+        NameIndex* index = new NameIndex(*cur);
+        (*index)[name] = handle;
+        m_index.store(index, std::memory_order_release);
+        old = cur;
+    }
+    retire_snapshot(old);
+    return handle;
 }
 
 
 // ----------------------------------------------------------
 // 自定义log
 struct LogAppenderDefine {
-    int type = 0;   // 1-FileAppender, 2-StdoutAppender
+    int type = 0;   // 1-FileAppender, 2-StdoutAppender, 3-BinaryAppender, 4-MmapAppender
     LogLevel::Level level = LogLevel::UNKNOWN;
     std::string formatter;
     std::string file;
+    bool async = false;     // 是否异步输出
+    uint32_t queueSize = 4096;
+    int overflow = AsyncLogAppender::BLOCK;
+    uint32_t sampleRate = 16;
+    // FileAppender的缓冲与滚动
+    uint32_t bufferSize = 256 * 1024;
+    uint32_t flushInterval = 1000;
+    uint64_t maxSize = 0;
+    int rotate = FileLogAppender::NONE;
+    bool compress = false;
+    // MmapAppender的段大小
+    uint64_t segmentSize = 32 * 1024 * 1024;
 
     bool operator==(const LogAppenderDefine& oth) const {
         return type == oth.type
             && level == oth.level
             && formatter == oth.formatter
-            && file == oth.file;
+            && file == oth.file
+            && async == oth.async
+            && queueSize == oth.queueSize
+            && overflow == oth.overflow
+            && sampleRate == oth.sampleRate
+            && bufferSize == oth.bufferSize
+            && flushInterval == oth.flushInterval
+            && maxSize == oth.maxSize
+            && rotate == oth.rotate
+            && compress == oth.compress
+            && segmentSize == oth.segmentSize;
     }
 };
 
@@ -635,12 +2407,11 @@ struct LogDefine {
     }
 };
 
-/* 模板类偏特化，从log到string的转换，解析yaml文件 */
+/* 模板类特化，从yaml节点解析出LogDefine */
 template<>
-class LexicalCast<std::string, LogDefine> {
+class FromNode<LogDefine> {
 public:
-    LogDefine operator()(const std::string& v) {
-        YAML::Node n = YAML::Load(v);
+    LogDefine operator()(const YAML::Node& n) {
         LogDefine ld;
         if(!n["name"].IsDefined()) {
             std::cout << "LOG CONFIG ERROR, LOG NAME IS NULL " << n
@@ -674,6 +2445,43 @@ public:
                     if(a["formatter"].IsDefined()) {
                         lad.formatter = a["formatter"].as<std::string>();
                     }
+                    if(a["buffer_size"].IsDefined()) {
+                        lad.bufferSize = a["buffer_size"].as<uint32_t>();
+                    }
+                    if(a["flush_interval"].IsDefined()) {
+                        lad.flushInterval = a["flush_interval"].as<uint32_t>();
+                    }
+                    if(a["max_size"].IsDefined()) {
+                        lad.maxSize = a["max_size"].as<uint64_t>();
+                    }
+                    if(a["rotate"].IsDefined()) {
+                        lad.rotate = FileLogAppender::RotateFromString(a["rotate"].as<std::string>());
+                    }
+                    if(a["compress"].IsDefined()) {
+                        lad.compress = a["compress"].as<bool>();
+                    }
+                } else if(type == "MmapLogAppender") {
+                    lad.type = 4;
+                    if(!a["file"].IsDefined()) {
+                        std::cout << "LOG CONFIG ERROR, FILE PATH IS NULL " << a
+                            << std::endl;
+                        continue;
+                    }
+                    lad.file = a["file"].as<std::string>();
+                    if(a["formatter"].IsDefined()) {
+                        lad.formatter = a["formatter"].as<std::string>();
+                    }
+                    if(a["segment_size"].IsDefined()) {
+                        lad.segmentSize = a["segment_size"].as<uint64_t>();
+                    }
+                } else if(type == "BinaryLogAppender") {
+                    lad.type = 3;
+                    if(!a["file"].IsDefined()) {
+                        std::cout << "LOG CONFIG ERROR, FILE PATH IS NULL " << a
+                            << std::endl;
+                        continue;
+                    }
+                    lad.file = a["file"].as<std::string>();
                 } else if(type == "StdoutLogAppender") {
                     lad.type = 2;
                     if(a["formatter"].IsDefined()) {
@@ -689,6 +2497,18 @@ public:
                 } else {
                     lad.level = LogLevel::UNKNOWN;
                 }
+                if(a["async"].IsDefined()) {
+                    lad.async = a["async"].as<bool>();
+                }
+                if(a["queue_size"].IsDefined()) {
+                    lad.queueSize = a["queue_size"].as<uint32_t>();
+                }
+                if(a["overflow"].IsDefined()) {
+                    lad.overflow = AsyncLogAppender::OverflowFromString(a["overflow"].as<std::string>());
+                }
+                if(a["sample_rate"].IsDefined()) {
+                    lad.sampleRate = a["sample_rate"].as<uint32_t>();
+                }
 
 
                 ld.appenders.push_back(lad);
@@ -699,9 +2519,9 @@ public:
 };
 
 template<>
-class LexicalCast<LogDefine, std::string> {
+class ToNode<LogDefine> {
 public:
-    std::string operator()(const LogDefine& i) {
+    YAML::Node operator()(const LogDefine& i) {
         YAML::Node n;
         n["name"] = i.name;
         if(i.level != LogLevel::UNKNOWN) {
@@ -716,8 +2536,26 @@ public:
             if(a.type == 1) {
                 na["type"] = "FileLogAppender";
                 na["file"] = a.file;
+                na["buffer_size"] = a.bufferSize;
+                na["flush_interval"] = a.flushInterval;
+                if(a.maxSize) {
+                    na["max_size"] = a.maxSize;
+                }
+                if(a.rotate != FileLogAppender::NONE) {
+                    na["rotate"] = FileLogAppender::RotateToString((FileLogAppender::Rotate)a.rotate);
+                }
+                if(a.compress) {
+                    na["compress"] = true;
+                }
             } else if(a.type == 2) {
                 na["type"] = "StdoutLogAppender";
+            } else if(a.type == 3) {
+                na["type"] = "BinaryLogAppender";
+                na["file"] = a.file;
+            } else if(a.type == 4) {
+                na["type"] = "MmapLogAppender";
+                na["file"] = a.file;
+                na["segment_size"] = a.segmentSize;
             }
             if(a.level != LogLevel::UNKNOWN) {
                 na["level"] = LogLevel::ToString(a.level);
@@ -727,10 +2565,34 @@ public:
                 na["formatter"] = a.formatter;
             }
 
+            if(a.async) {
+                na["async"] = true;
+                na["queue_size"] = a.queueSize;
+                na["overflow"] = AsyncLogAppender::OverflowToString((AsyncLogAppender::Overflow)a.overflow);
+                na["sample_rate"] = a.sampleRate;
+            }
+
             n["appenders"].push_back(na);
         }
+        return n;
+    }
+};
+
+/* 模板类特化，LogDefine与yaml字符串互相转换 */
+template<>
+class LexicalCast<std::string, LogDefine> {
+public:
+    LogDefine operator()(const std::string& v) {
+        return FromNode<LogDefine>()(YAML::Load(v));
+    }
+};
+
+template<>
+class LexicalCast<LogDefine, std::string> {
+public:
+    std::string operator()(const LogDefine& i) {
         std::stringstream ss;
-        ss << n;
+        ss << ToNode<LogDefine>()(i);
         return ss.str();
     }
 };
@@ -773,9 +2635,19 @@ struct LogIniter {
             for(auto& x : i.appenders) {
                 apollo::LogAppender::ptr ap;
                 if(x.type == 1) { // FileAppender
-                    ap.reset(new FileLogAppender(x.file));
+                    FileLogAppender::ptr file(new FileLogAppender(x.file));
+                    file->setBufferSize(x.bufferSize);
+                    file->setFlushInterval(x.flushInterval);
+                    file->setMaxSize(x.maxSize);
+                    file->setRotate((FileLogAppender::Rotate)x.rotate);
+                    file->setCompress(x.compress);
+                    ap = file;
                 } else if(x.type == 2) {
                     ap.reset(new StdoutLogAppender());
+                } else if(x.type == 3) {
+                    ap.reset(new BinaryLogAppender(x.file));
+                } else if(x.type == 4) {
+                    ap.reset(new MmapLogAppender(x.file, x.segmentSize));
                 } else {continue;}
 
                 ap->setLevel(x.level);
@@ -788,6 +2660,10 @@ struct LogIniter {
                             << " FORMATTER = " << x.formatter << " IS INVALID" << std::endl;
                     }
                 }
+                if(x.async) {
+                    ap.reset(new AsyncLogAppender(ap, x.queueSize
+                                ,(AsyncLogAppender::Overflow)x.overflow, x.sampleRate));
+                }
                 // 添加appender于logger中
                 logger->addAppender(ap);
             }
@@ -821,11 +2697,22 @@ std::string FileLogAppender::toYamlString() {
     if(m_level != LogLevel::UNKNOWN)
         node["level"] = LogLevel::ToString(m_level);
     
-    if(m_hasFormatter && m_formatter) {
-        node["formatter"] = m_formatter->getPattern();
+    if(m_hasFormatter && formatter()) {
+        node["formatter"] = formatter()->getPattern();
     }
 
     node["file"] = m_filename;
+    node["buffer_size"] = m_bufferSize;
+    node["flush_interval"] = m_flushInterval;
+    if(m_maxSize) {
+        node["max_size"] = m_maxSize;
+    }
+    if(m_rotate != NONE) {
+        node["rotate"] = RotateToString(m_rotate);
+    }
+    if(m_compress) {
+        node["compress"] = true;
+    }
 
     std::stringstream ss;
     ss << node;
@@ -842,8 +2729,24 @@ std::string StdoutLogAppender::toYamlString() {
     if(m_level != LogLevel::UNKNOWN)
         node["level"] = LogLevel::ToString(m_level); 
 
-    if(m_hasFormatter && m_formatter) {
-        node["formatter"] = m_formatter->getPattern();
+    if(m_hasFormatter && formatter()) {
+        node["formatter"] = formatter()->getPattern();
+    }
+
+    std::stringstream ss;
+    ss << node;
+
+    return ss.str();
+}
+
+std::string AsyncLogAppender::toYamlString() {
+    YAML::Node node = YAML::Load(m_target->toYamlString());
+
+    node["async"] = true;
+    node["queue_size"] = m_queueSize;
+    node["overflow"] = OverflowToString(m_overflow);
+    if(m_overflow == SAMPLE) {
+        node["sample_rate"] = m_sampleRate;
     }
 
     std::stringstream ss;
@@ -865,8 +2768,12 @@ std::string Logger::toYamlString() {
         node["formatter"] = m_formatter->getPattern();
     }
 
-    for(auto& i : m_appenders) {
-        node["appenders"].push_back(YAML::Load(i->toYamlString()));
+    // 列表只在持有m_mutex时替换
+    AppenderListPtr* list = m_appenders.load(std::memory_order_relaxed);
+    if(list) {
+        for(auto& i : **list) {
+            node["appenders"].push_back(YAML::Load(i->toYamlString()));
+        }
     }
 
     std::stringstream ss;
@@ -880,7 +2787,13 @@ std::string LoggerManager::toYamlString() {
 
     YAML::Node node;
 
-    for(auto& i : m_loggers) {
+    // 按名称排序输出
+    std::map<std::string, Logger*> loggers;
+    for(uint32_t i = 0; i < m_size; ++i) {
+        const Logger::ptr& logger = getByHandle(i);
+        loggers[logger->getName()] = logger.get();
+    }
+    for(auto& i : loggers) {
         node.push_back(YAML::Load(i.second->toYamlString()));
     }
 
@@ -10,29 +10,68 @@
 #include <vector>
 #include <stdarg.h>
 #include <map>
+#include <unordered_map>
+#include <atomic>
+#include <type_traits>
 
 #include "singleton.h"
 #include "util.h"
+#include "fiber.h"
 #include "thread.h"
 #include "mutex.h"
 
+// 编译期最低日志级别, 低于该级别的调用点条件恒为假, 由编译器整体去掉(如定义为2去掉DEBUG)
+#ifndef APOLLO_LOG_MIN_LEVEL
+#define APOLLO_LOG_MIN_LEVEL 0
+#endif
+
+// 日志级别level是否需要输出
+#define APOLLO_LOG_ENABLED(logger, level) \
+    ((level) >= APOLLO_LOG_MIN_LEVEL && logger->getLevel() <= level)
+
+// 在当前调用点生成日志事件
+#define APOLLO_LOG_EVENT(logger, level) \
+    apollo::LogEventWrap(apollo::LogEvent::Create(logger, level, \
+                    __FILE__, __LINE__, 0, apollo::GetThreadId(),\
+            apollo::GetFiberId(), time(0), apollo::Thread::GetName()))
+
 // 使用流式方式将日志级别level的日志写入到logger
 #define APOLLO_LOG_LEVEL(logger, level) \
-    if(logger->getLevel() <= level) \
-        apollo::LogEventWrap(apollo::LogEvent::ptr(new apollo::LogEvent(logger, level, \
-                        __FILE__, __LINE__, 0, apollo::GetThreadId(),\
-                apollo::GetFiberId(), time(0), apollo::Thread::GetName()))).getSS()
+    if(APOLLO_LOG_ENABLED(logger, level)) \
+        APOLLO_LOG_EVENT(logger, level).getSS()
+
+// 条件cond成立时写日志, cond在级别判断之后求值
+#define APOLLO_LOG_IF(logger, level, cond) \
+    if(APOLLO_LOG_ENABLED(logger, level) && (cond)) \
+        APOLLO_LOG_EVENT(logger, level).getSS()
+
+// 当前调用点的限流判断, 每个调用点一个静态的LogSiteLimiter
+#define APOLLO_LOG_SITE_LIMIT(method, arg) \
+    [&]() -> bool { \
+        static apollo::LogSiteLimiter s_apollo_log_site; \
+        return s_apollo_log_site.method(arg); \
+    }()
+
+// 每n次只写第1次
+#define APOLLO_LOG_EVERY_N(logger, level, n) \
+    APOLLO_LOG_IF(logger, level, APOLLO_LOG_SITE_LIMIT(everyN, n))
+// 只写前n次
+#define APOLLO_LOG_FIRST_N(logger, level, n) \
+    APOLLO_LOG_IF(logger, level, APOLLO_LOG_SITE_LIMIT(firstN, n))
+// 每ms毫秒最多写1次
+#define APOLLO_LOG_EVERY_MS(logger, level, ms) \
+    APOLLO_LOG_IF(logger, level, APOLLO_LOG_SITE_LIMIT(everyMs, ms))
 
 #define APOLLO_LOG_DEBUG(logger) APOLLO_LOG_LEVEL(logger, apollo::LogLevel::DEBUG)
 #define APOLLO_LOG_INFO(logger) APOLLO_LOG_LEVEL(logger, apollo::LogLevel::INFO)
 #define APOLLO_LOG_WARN(logger) APOLLO_LOG_LEVEL(logger, apollo::LogLevel::WARN)
 #define APOLLO_LOG_ERROR(logger) APOLLO_LOG_LEVEL(logger, apollo::LogLevel::ERROR)
 #define APOLLO_LOG_FATAL(logger) APOLLO_LOG_LEVEL(logger, apollo::LogLevel::FATAL)
+// 使用printf方式将日志级别level的日志写入到logger, 格式化延迟到第一次读取日志内容时
+// fmt必须是字符串字面量(拼接""保证), 运行时生成的格式串请用 APOLLO_LOG_EVENT(logger, level).getEvent()->format
 #define APOLLO_LOG_FMT_LEVEL(logger, level, fmt, ...) \
-    if(logger->getLevel() <= level) \
-        apollo::LogEventWrap(apollo::LogEvent::ptr(new apollo::LogEvent(logger, level, \
-                        __FILE__, __LINE__, 0, apollo::GetThreadId(),\
-                apollo::GetFiberId(), time(0), apollo::Thread::GetName()))).getEvent()->format(fmt, __VA_ARGS__)
+    if(APOLLO_LOG_ENABLED(logger, level)) \
+        APOLLO_LOG_EVENT(logger, level).getEvent()->formatLiteral("" fmt, __VA_ARGS__)
 
 #define APOLLO_LOG_FMT_DEBUG(logger, fmt, ...) APOLLO_LOG_FMT_LEVEL(logger, apollo::LogLevel::DEBUG, fmt, __VA_ARGS__)
 #define APOLLO_LOG_FMT_INFO(logger, fmt, ...)  APOLLO_LOG_FMT_LEVEL(logger, apollo::LogLevel::INFO, fmt, __VA_ARGS__)
@@ -43,6 +82,13 @@
 // 获取日志器
 #define APOLLO_LOG_ROOT() apollo::LoggerMgr::GetInstance()->getRoot()
 #define APOLLO_LOG_NAME(name) apollo::LoggerMgr::GetInstance()->getLogger(name)
+// 在调用点缓存日志器句柄, 之后只按句柄取日志器; 同一调用点的name必须不变
+#define APOLLO_LOG_NAME_CACHED(name) \
+    apollo::LoggerMgr::GetInstance()->getByHandle([&]() -> uint32_t { \
+        static const uint32_t s_apollo_log_handle = \
+            apollo::LoggerMgr::GetInstance()->getHandle(name); \
+        return s_apollo_log_handle; \
+    }())
 
 // namespace apollo
 namespace apollo { 
@@ -50,6 +96,48 @@ namespace apollo {
 class Logger;
 class LoggerManager;
 
+/**
+ *  日志调用点的限流状态, APOLLO_LOG_EVERY_N等宏在每个调用点生成一个静态实例
+ *  只用原子计数, 多线程同时命中时允许计数有少量偏差
+ */
+class LogSiteLimiter {
+public:
+    /**
+     *  第1, n+1, 2n+1...次命中时返回true
+     */
+    bool everyN(uint64_t n) {
+        return m_count.fetch_add(1, std::memory_order_relaxed) % (n ? n : 1) == 0;
+    }
+
+    /**
+     *  前n次命中时返回true
+     */
+    bool firstN(uint64_t n) {
+        // 超过后只读不写, 避免热点调用点反复写同一缓存行
+        if(m_count.load(std::memory_order_relaxed) >= n) {
+            return false;
+        }
+        return m_count.fetch_add(1, std::memory_order_relaxed) < n;
+    }
+
+    /**
+     *  距上次返回true超过ms毫秒时返回true
+     */
+    bool everyMs(uint64_t ms) {
+        uint64_t now = GetCurrentMS();
+        uint64_t last = m_last.load(std::memory_order_relaxed);
+        if(last && now - last < ms) {
+            return false;
+        }
+        return m_last.compare_exchange_strong(last, now, std::memory_order_relaxed);
+    }
+private:
+    // 命中次数
+    std::atomic<uint64_t> m_count {0};
+    // 上次输出的时间(毫秒)
+    std::atomic<uint64_t> m_last {0};
+};
+
 /**
  *  日志级别
  */
@@ -86,12 +174,112 @@ public:
     static LogLevel::Level FromString(const std::string& str);
 };
 
+class LogEvent;
+
+/**
+ *  日志内容缓冲区
+ * @details 先写入内联的定长数组, 超出后转存到std::string中继续写入;
+ *          缓冲区随日志事件复用, std::string的容量也随之保留, 稳定后不再分配内存
+ */
+class LogBuffer : public std::streambuf {
+public:
+    // 内联数组大小
+    static const size_t s_inline_size = 512;
+
+    LogBuffer();
+
+    /**
+     *  清空内容, 回到内联数组
+     */
+    void clear();
+
+    /**
+     *  返回内容起始地址(不以0结尾)
+     */
+    const char* data() const { return pbase();}
+
+    /**
+     *  返回内容长度
+     */
+    size_t size() const { return pptr() - pbase();}
+
+    /**
+     *  按printf格式追加内容
+     */
+    void appendf(const char* fmt, va_list al);
+
+    /**
+     *  按printf格式追加内容
+     */
+    void appendFormat(const char* fmt, ...);
+
+    /**
+     *  返回所属的日志事件
+     */
+    LogEvent* getOwner() const { return m_owner;}
+
+    /**
+     *  设置所属的日志事件
+     */
+    void setOwner(LogEvent* val) { m_owner = val;}
+protected:
+    int_type overflow(int_type ch) override;
+    std::streamsize xsputn(const char* s, std::streamsize n) override;
+private:
+    /**
+     *  保证至少还能写入n个字符
+     */
+    void reserve(size_t n);
+private:
+    // 内联数组
+    char m_inline[s_inline_size];
+    // 超出内联数组后的存储
+    std::string m_spill;
+    // 所属的日志事件
+    LogEvent* m_owner = nullptr;
+};
+
+/**
+ *  结构化字段, 由LogEvent::nextField解码得到, 指针指向事件内部
+ */
+struct LogField {
+    enum Type {
+        INT = 'i',
+        UINT = 'u',
+        DOUBLE = 'f',
+        BOOL = 'b',
+        STRING = 's'
+    };
+    Type type;
+    // 键, 不以0结尾
+    const char* key;
+    size_t keyLen;
+    union {
+        int64_t i;
+        uint64_t u;
+        double f;
+        bool b;
+    };
+    // STRING类型的值, 不以0结尾
+    const char* str;
+    size_t strLen;
+};
+
 /**
  *  日志事件
  */
 class LogEvent {
 public:
     typedef std::shared_ptr<LogEvent> ptr;
+
+    /**
+     *  从当前线程的事件池中取出一个空闲的事件并初始化, 池中没有空闲事件时新建
+     * @details 事件的引用只剩事件池本身时视为空闲, 参数同构造函数
+     */
+    static LogEvent::ptr Create(std::shared_ptr<Logger> logger, LogLevel::Level level
+            ,const char* file, int32_t line, uint32_t elapse
+            ,uint32_t thread_id, uint32_t fiber_id, uint64_t time
+            ,const std::string& thread_name);
     /**
      *  构造函数
      * @param[in] logger 日志器
@@ -144,10 +332,43 @@ public:
      */
     const std::string& getThreadName() const { return m_threadName;}
 
+    /**
+     *  返回生成事件时协程的上下文, 没有时为空
+     */
+    const FiberContext::ptr& getContext() const { return m_context;}
+
     /**
      *  返回日志内容
      */
-    std::string getContent() const { return m_ss.str();}
+    std::string getContent() const { render(); return std::string(m_buf.data(), m_buf.size());}
+
+    /**
+     *  返回日志内容起始地址(不以0结尾)
+     */
+    const char* getContentData() const { render(); return m_buf.data();}
+
+    /**
+     *  返回日志内容长度
+     */
+    size_t getContentSize() const { render(); return m_buf.size();}
+
+    /**
+     *  返回延迟格式化的printf格式串, 没有时返回nullptr
+     * @details APOLLO_LOG_FMT_*写入的参数可被完整编码时, 先只记录格式串和原始参数,
+     *          第一次读取日志内容时才生成文本; 二进制Appender直接写出原始参数
+     */
+    const char* getFormat() const { return m_fmt;}
+
+    /**
+     *  返回编码后的原始参数, 与getFormat配套
+     */
+    const std::string& getArgs() const { return m_args;}
+
+    /**
+     *  设置延迟格式化的格式串与编码后的参数(用于还原二进制日志)
+     * @details fmt需要在事件的生命周期内有效
+     */
+    void setFormat(const char* fmt, const std::string& args);
 
     /**
      *  返回日志器
@@ -160,20 +381,112 @@ public:
     LogLevel::Level getLevel() const { return m_level;}
 
     /**
-     *  返回日志内容字符串流
+     *  返回日志内容输出流
      */
-    std::stringstream& getSS() { return m_ss;}
+    std::ostream& getSS() {
+        if(m_fmt) {
+            materialize();
+        }
+        return m_ss;
+    }
 
     /**
-     *  格式化写入日志内容
+     *  格式化写入日志内容, 立即生成文本, fmt调用返回后即可释放
      */
     void format(const char* fmt, ...);
 
     /**
-     *  格式化写入日志内容
+     *  格式化写入日志内容, 立即生成文本
      */
     void format(const char* fmt, va_list al);
+
+    /**
+     *  延迟格式化写入日志内容(APOLLO_LOG_FMT_*使用)
+     * @details 参数可被完整编码时只记录fmt指针与编码后的参数, 文本可能在调用点返回之后
+     *          才在其他线程(如异步Appender)生成, 二进制Appender也按fmt指针区分调用点,
+     *          因此fmt必须是字符串字面量(静态存储期, 内容不变); 否则请使用format
+     */
+    void formatLiteral(const char* fmt, ...);
+
+    /**
+     *  添加结构化字段, 按类型编码追加到字段缓冲区, 缓冲区容量随事件复用保留
+     * @param[in] key 键, 超过255字节的部分截掉
+     * @param[in] v 值
+     */
+    void addField(const char* key, bool v);
+    void addField(const char* key, double v);
+    void addField(const char* key, const char* v);
+    void addField(const char* key, const std::string& v);
+    template<class T>
+    typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+    addField(const char* key, T v) {
+        if(std::is_signed<T>::value) {
+            int64_t i = (int64_t)v;
+            putField(LogField::INT, key, &i, sizeof(i));
+        } else {
+            uint64_t u = (uint64_t)v;
+            putField(LogField::UINT, key, &u, sizeof(u));
+        }
+    }
+
+    /**
+     *  是否有结构化字段
+     */
+    bool hasFields() const { return !m_fields.empty();}
+
+    /**
+     *  返回编码后的结构化字段
+     */
+    const std::string& getFields() const { return m_fields;}
+
+    /**
+     *  解码下一个结构化字段
+     * @param[in, out] pos 解码位置, 从0开始
+     * @param[out] field 字段
+     * @return 没有更多字段时返回false
+     */
+    bool nextField(size_t& pos, LogField& field) const;
+
+    /**
+     *  返回写入os的日志事件, os不是日志事件的内容流时返回nullptr
+     */
+    static LogEvent* FromStream(std::ostream& os);
+private:
+    /**
+     *  追加一个字段: 类型(1) 键长(1) 键 值
+     */
+    void putField(char type, const char* key, const void* data, size_t len);
+
+    /**
+     *  复用前重新初始化, 参数同构造函数
+     */
+    void reset(std::shared_ptr<Logger> logger, LogLevel::Level level
+            ,const char* file, int32_t line, uint32_t elapse
+            ,uint32_t thread_id, uint32_t fiber_id, uint64_t time
+            ,const std::string& thread_name);
+
+    /**
+     *  生成延迟格式化的文本, 可被多个线程同时调用
+     */
+    void render() const {
+        if(m_rendered.load(std::memory_order_acquire) != RENDERED) {
+            doRender();
+        }
+    }
+    void doRender() const;
+
+    /**
+     *  生成文本并放弃原始参数, 之后的内容只能以文本追加
+     */
+    void materialize();
 private:
+    // 延迟格式化状态
+    enum RenderState {
+        PENDING = 0,
+        RENDERING = 1,
+        RENDERED = 2
+    };
+
     // 文件名
     const char* m_file = nullptr;
     // 行号
@@ -188,8 +501,20 @@ private:
     uint64_t m_time = 0;
     // 线程名称
     std::string m_threadName;
-    // 日志内容流
-    std::stringstream m_ss;
+    // 协程上下文
+    FiberContext::ptr m_context;
+    // 日志内容缓冲区
+    mutable LogBuffer m_buf;
+    // 日志内容流, 写入m_buf
+    std::ostream m_ss;
+    // 延迟格式化的格式串
+    const char* m_fmt = nullptr;
+    // 编码后的原始参数
+    std::string m_args;
+    // 编码后的结构化字段
+    std::string m_fields;
+    // 延迟格式化状态
+    mutable std::atomic<int> m_rendered {RENDERED};
     // 日志器
     std::shared_ptr<Logger> m_logger;
     // 日志等级
@@ -199,6 +524,34 @@ private:
 /**
  *  日志事件包装器
  */
+/**
+ *  结构化字段的流式写法: APOLLO_LOG_INFO(logger) << apollo::kv("uid", uid) << "login";
+ */
+template<class T>
+struct LogKV {
+    const char* key;
+    const T& value;
+};
+
+template<class T>
+LogKV<T> kv(const char* key, const T& value) {
+    return LogKV<T>{key, value};
+}
+
+/**
+ *  写入日志事件时作为结构化字段, 写入其他流时输出key=value
+ */
+template<class T>
+std::ostream& operator<<(std::ostream& os, const LogKV<T>& kv) {
+    LogEvent* event = LogEvent::FromStream(os);
+    if(event) {
+        event->addField(kv.key, kv.value);
+    } else {
+        os << kv.key << '=' << kv.value;
+    }
+    return os;
+}
+
 class LogEventWrap {
 public:
 
@@ -221,7 +574,7 @@ public:
     /**
      *  获取日志内容流
      */
-    std::stringstream& getSS();
+    std::ostream& getSS();
 private:
     /**
      *  日志事件
@@ -252,8 +605,11 @@ public:
      *  %T 制表符
      *  %F 协程id
      *  %N 线程名称
+     *  %K 结构化字段, 以key=value空格分隔
+     *  %X 协程上下文, 以key=value空格分隔; %X{key}只输出key的值
      *
      *  默认格式 "%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n"
+     *  模板为"json"或"logfmt"时每条日志输出一行JSON对象或logfmt, 包含全部事件属性和结构化字段
      */
     LogFormatter(const std::string& pattern);
 
@@ -265,31 +621,18 @@ public:
      */
     std::string format(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event);
     std::ostream& format(std::ostream& ofs, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event);
-public:
+
     /**
-     *  日志内容项格式化
-     */
-    class FormatItem {
-    public:
-        typedef std::shared_ptr<FormatItem> ptr;
-
-        /**
-         *  析构函数
-         */
-        virtual ~FormatItem() {}
-
-        /**
-         *  格式化日志到流
-         * @param[in, out] os 日志输出流
-         * @param[in] logger 日志器
-         * @param[in] level 日志等级
-         * @param[in] event 日志事件
-         */
-        virtual void format(std::ostream& os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) = 0;
-    };
+     *  将格式化日志文本追加到out
+     * @param[in, out] out 输出缓冲区, 复用时其容量保留
+     * @param[in] logger 日志器
+     * @param[in] level 日志级别
+     * @param[in] event 日志事件
+     */
+    void format(std::string& out, const std::shared_ptr<Logger>& logger, LogLevel::Level level, const LogEvent::ptr& event);
 
     /**
-     *  初始化,解析日志模板
+     *  初始化,解析日志模板并编译成指令序列
      */
     void init();
 
@@ -302,11 +645,91 @@ public:
      *  返回日志模板
      */
     const std::string getPattern() const { return m_pattern;}
+private:
+    /**
+     *  编译后的指令
+     */
+    struct Op {
+        enum Kind {
+            // 文本(相邻的文本,%T,%n已合并)
+            STRING,
+            // 消息
+            MESSAGE,
+            // 日志级别
+            LEVEL,
+            // 累计毫秒数
+            ELAPSE,
+            // 日志名称
+            NAME,
+            // 线程id
+            THREAD_ID,
+            // 时间
+            DATETIME,
+            // 文件名
+            FILENAME,
+            // 行号
+            LINE,
+            // 协程id
+            FIBER_ID,
+            // 线程名称
+            THREAD_NAME,
+            // 结构化字段
+            FIELDS,
+            // 协程上下文, str为空时输出全部
+            CONTEXT
+        };
+        // 字符串值的转义方式
+        enum Escape {
+            // 原样输出
+            NONE,
+            // JSON字符串
+            JSON,
+            // logfmt值, 含空白等字符时加引号
+            LOGFMT
+        };
+        Kind kind;
+        Escape esc;
+        // STRING为文本, DATETIME为strftime格式
+        std::string str;
+    };
+
+    /**
+     *  追加一条指令, 相邻文本合并
+     */
+    void addOp(Op::Kind kind, const std::string& str = "", Op::Escape esc = Op::NONE);
+
+    /**
+     *  按json/logfmt编译固定的指令序列
+     */
+    void initStructured(Op::Escape esc);
+
+    /**
+     *  按转义方式追加字符串值
+     */
+    static void appendEscaped(std::string& out, const char* s, size_t n, Op::Escape esc);
+
+    /**
+     *  追加事件的协程上下文
+     */
+    void appendContext(std::string& out, const LogEvent::ptr& event, const Op& op);
+
+    /**
+     *  追加事件的结构化字段
+     */
+    void appendFields(std::string& out, const LogEvent::ptr& event, Op::Escape esc);
+
+    /**
+     *  追加按秒缓存的时间文本
+     * @param[in] index 指令下标
+     */
+    void appendDateTime(std::string& out, size_t index, time_t time);
 private:
     // 日志格式模板
     std::string m_pattern;
-    // 日志格式解析后格式
-    std::vector<FormatItem::ptr> m_items;
+    // 编译后的指令序列
+    std::vector<Op> m_ops;
+    // 实例id, 用于区分时间缓存
+    uint64_t m_id;
     // 是否有错误
     bool m_error = false;
 
@@ -317,6 +740,7 @@ private:
  */
 class LogAppender {
 friend class Logger;
+friend class AsyncLogAppender;
 public:
     typedef std::shared_ptr<LogAppender> ptr;
 
@@ -325,7 +749,7 @@ public:
     /**
      *  析构函数
      */
-    virtual ~LogAppender() {}
+    virtual ~LogAppender();
 
     /**
      *  写入日志
@@ -359,14 +783,28 @@ public:
      *  设置日志级别
      */
     void setLevel(LogLevel::Level val) { m_level = val;}
+protected:
+    /**
+     *  获取日志格式器快照, 不加锁, 需在EpochGuard作用域内使用
+     */
+    LogFormatter* formatter() const {
+        LogFormatter::ptr* fmt = m_formatter.load(std::memory_order_acquire);
+        return fmt ? fmt->get() : nullptr;
+    }
+private:
+    /**
+     *  发布新的格式器快照, 需持有m_mutex
+     * @return 旧快照, 由调用方释放锁后交给EpochMgr回收
+     */
+    LogFormatter::ptr* swapFormatter(const LogFormatter::ptr& val);
 protected:
     // 日志级别
     LogLevel::Level m_level = LogLevel::DEBUG;
     // 是否有自己的日志格式器
     bool m_hasFormatter = false;
-    // 日志格式器
-    LogFormatter::ptr m_formatter;
-    // mutex
+    // 日志格式器快照, 只在持有m_mutex时替换
+    std::atomic<LogFormatter::ptr*> m_formatter {nullptr};
+    // mutex, 保护格式器的修改及各Appender自己的输出
     MutexType m_mutex;
 };
 
@@ -386,6 +824,11 @@ public:
      */
     Logger(const std::string& name = "root");
 
+    /**
+     *  析构函数
+     */
+    ~Logger();
+
     /**
      *  写日志
      * @param[in] level 日志级别
@@ -475,17 +918,23 @@ public:
      */
     std::string toYamlString();
 private:
+    // 日志输出器列表, 发布后不再修改
+    typedef std::vector<LogAppender::ptr> AppenderList;
+    // 列表快照的计数引用: 写日志时在EpochGuard内取得引用, 在guard外调用Appender
+    typedef std::shared_ptr<const AppenderList> AppenderListPtr;
+
     // 日志名称
     std::string m_name;
     // 日志级别
     LogLevel::Level m_level;
-    // 日志输出器集合
-    std::list<LogAppender::ptr> m_appenders;
+    // 日志输出器列表快照, 为空时使用主日志器; 修改时复制一份再整体替换,
+    // 旧的引用由EpochMgr回收, 列表在最后一个引用释放时析构
+    std::atomic<AppenderListPtr*> m_appenders {nullptr};
     // 日志格式器
     LogFormatter::ptr m_formatter;
     // 主日志器
     Logger::ptr m_root;
-    // mutex
+    // mutex, 只在修改时加锁, 写日志不加锁
     MutexType m_mutex;
 };
 
@@ -501,28 +950,475 @@ public:
  *  输出到文件的Appender
  */
 class FileLogAppender : public LogAppender {
+friend class LogFileWorker;
 public:
     typedef std::shared_ptr<FileLogAppender> ptr;
+
+    /**
+     *  按时间滚动的周期
+     */
+    enum Rotate {
+        // 不按时间滚动
+        NONE = 0,
+        // 每小时
+        HOURLY = 1,
+        // 每天
+        DAILY = 2
+    };
+
+    /**
+     *  将滚动周期转成文本
+     */
+    static const char* RotateToString(Rotate v);
+
+    /**
+     *  将文本转成滚动周期, 无法识别时返回NONE
+     */
+    static Rotate RotateFromString(const std::string& str);
+
+    /**
+     *  构造函数, 以追加方式打开文件
+     * @details 日志先写入用户态缓冲区, 缓冲区满, 距上次写出超过flush_interval,
+     *          或有ERROR及以上级别的日志时写出; 后台线程也会按flush_interval写出空闲的缓冲区
+     */
     FileLogAppender(const std::string& filename);
+
+    /**
+     *  析构函数, 写出缓冲区
+     */
+    ~FileLogAppender();
+
+    void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+    std::string toYamlString() override;
+
+    /**
+     *  重新打开日志文件(如文件被外部移走后)
+     * @return 成功返回true
+     */
+    bool reopen();
+
+    /**
+     *  写出缓冲区
+     */
+    void flush();
+
+    /**
+     *  设置缓冲区大小, 0表示每条日志都写出
+     */
+    void setBufferSize(size_t v);
+    size_t getBufferSize() const { return m_bufferSize;}
+
+    /**
+     *  设置最长写出间隔(毫秒)
+     */
+    void setFlushInterval(uint64_t v);
+    uint64_t getFlushInterval() const { return m_flushInterval;}
+
+    /**
+     *  设置按大小滚动的阈值(字节), 0表示不按大小滚动
+     */
+    void setMaxSize(uint64_t v);
+    uint64_t getMaxSize() const { return m_maxSize;}
+
+    /**
+     *  设置按时间滚动的周期
+     */
+    void setRotate(Rotate v);
+    Rotate getRotate() const { return m_rotate;}
+
+    /**
+     *  设置是否在后台线程中用gzip压缩滚动出的文件
+     */
+    void setCompress(bool v);
+    bool getCompress() const { return m_compress;}
+private:
+    /**
+     *  写出缓冲区, 需持有m_mutex
+     */
+    void flushLocked();
+
+    /**
+     *  打开日志文件并计算下一次按时间滚动的时刻, 需持有m_mutex
+     */
+    bool reopenLocked(time_t now);
+
+    /**
+     *  滚动: 将当前文件改名后重新打开, 需持有m_mutex
+     * @param[in] stamp 用于生成文件名的时间
+     */
+    void rotateLocked(time_t stamp, time_t now);
+
+    /**
+     *  后台线程定时调用, 写出超过间隔未写出的缓冲区
+     */
+    void onTimer(uint64_t now_ms);
+private:
+    // 文件路径
+    std::string m_filename;
+    // 文件流
+    std::ofstream m_filestream;
+    // 待写出的日志
+    std::string m_buf;
+    // 缓冲区大小
+    size_t m_bufferSize = 256 * 1024;
+    // 最长写出间隔(毫秒)
+    uint64_t m_flushInterval = 1000;
+    // 上次写出的时间(毫秒)
+    uint64_t m_lastFlush = 0;
+    // 按大小滚动的阈值
+    uint64_t m_maxSize = 0;
+    // 当前文件大小(含未写出的部分)
+    uint64_t m_fileSize = 0;
+    // 按时间滚动的周期
+    Rotate m_rotate = NONE;
+    // 当前周期的开始时间
+    time_t m_periodBegin = 0;
+    // 下一次按时间滚动的时刻
+    time_t m_periodEnd = 0;
+    // 是否压缩滚动出的文件
+    bool m_compress = false;
+};
+
+/**
+ *  写入内存映射文件的Appender
+ * @details 文件按段预分配并映射到内存, 写日志时原子地推进写入位置后直接拷贝到映射区,
+ *          不需要系统调用; 进程崩溃后已写入映射区的日志仍由内核写回文件.
+ *          当前段写满时将文件改名为<文件名>.<时间>并映射新的一段.
+ *          崩溃后文件末尾会留有未使用的0, 下次启动时去掉并改名
+ */
+class MmapLogAppender : public LogAppender {
+public:
+    typedef std::shared_ptr<MmapLogAppender> ptr;
+
+    /**
+     *  构造函数
+     * @param[in] filename 文件路径
+     * @param[in] segment_size 每段大小(字节)
+     */
+    MmapLogAppender(const std::string& filename, size_t segment_size = 32 * 1024 * 1024);
+
+    /**
+     *  析构函数, 将文件截断到实际写入的长度
+     */
+    ~MmapLogAppender();
+
     void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
     std::string toYamlString() override;
 
     /**
-     *  重新打开日志文件
+     *  返回每段大小
+     */
+    size_t getSegmentSize() const { return m_segmentSize;}
+private:
+    // 一段映射
+    struct Segment {
+        // 文件句柄
+        int fd = -1;
+        // 映射起始地址
+        char* base = nullptr;
+        // 段大小
+        size_t size = 0;
+        // 下一个写入位置, 可能超过size
+        std::atomic<size_t> offset {0};
+        // 有效数据的结尾(越过段尾的那次写入的起始位置)
+        std::atomic<size_t> end {0};
+        // 正在写入的线程数
+        std::atomic<int> writers {0};
+    };
+
+    /**
+     *  映射新的一段到slot, 需持有m_rollMutex
+     */
+    bool openSegment(Segment& seg);
+
+    /**
+     *  等待写入完成后截断文件并解除映射, 需持有m_rollMutex
+     */
+    void closeSegment(Segment& seg);
+
+    /**
+     *  当前段写满后切换到新的一段
+     * @param[in] full 写满的段
+     */
+    void roll(Segment* full);
+
+    /**
+     *  处理上次运行(可能崩溃)留下的文件: 去掉末尾的0并改名
+     */
+    void recover();
+private:
+    // 文件路径
+    std::string m_filename;
+    // 每段大小
+    size_t m_segmentSize;
+    // 两个段交替使用, 切换后等旧段的写入者离开再关闭
+    Segment m_segments[2];
+    // 当前段
+    std::atomic<Segment*> m_active {nullptr};
+    // 保护段的切换
+    Mutex m_rollMutex;
+};
+
+/**
+ *  输出二进制日志的Appender
+ * @details 不生成文本: 调用点(文件,行号,格式串)与线程名,日志器名第一次出现时写一条定义记录,
+ *          之后每条日志只写它们的id, 时间等定长字段, 以及APOLLO_LOG_FMT_*的原始参数
+ *          (流式日志写入文本). 文件由BinaryLogReader或log_decode工具还原成文本
+ *
+ *  文件由记录组成, 整数为本机字节序:
+ *  'H' "APLB" u32版本          文件头, 每次打开文件时写入, 之后的id重新编号
+ *  'S' u32id i32行号 u16长度 文件名 u8是否有格式串 u16长度 格式串
+ *  'N' u32id u16长度 名称
+ *  'L' u32调用点 u8级别 u64时间 u32耗时 u32线程id u32协程id u32线程名 u32日志器名 u32长度 内容
+ */
+class BinaryLogAppender : public LogAppender {
+public:
+    typedef std::shared_ptr<BinaryLogAppender> ptr;
+
+    // 文件格式版本
+    static const uint32_t s_version = 1;
+
+    BinaryLogAppender(const std::string& filename);
+    ~BinaryLogAppender();
+    void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+    std::string toYamlString() override;
+
+    /**
+     *  重新打开日志文件(追加)
      * @return 成功返回true
      */
     bool reopen();
+
+    /**
+     *  写出缓冲区
+     */
+    void flush();
+private:
+    // 调用点
+    struct Site {
+        const char* file;
+        int32_t line;
+        const char* fmt;
+
+        bool operator==(const Site& oth) const {
+            return file == oth.file && line == oth.line && fmt == oth.fmt;
+        }
+    };
+
+    struct SiteHash {
+        size_t operator()(const Site& s) const {
+            return std::hash<const void*>()(s.file) ^ (std::hash<const void*>()(s.fmt) << 1) ^ s.line;
+        }
+    };
+
+    /**
+     *  获取调用点id, 第一次出现时写入定义记录, 需持有m_mutex
+     */
+    uint32_t getSiteId(const LogEvent::ptr& event);
+
+    /**
+     *  获取名称id, 第一次出现时写入定义记录, 需持有m_mutex
+     */
+    uint32_t getNameId(const std::string& name);
+
+    /**
+     *  写出缓冲区, 需持有m_mutex
+     */
+    void flushLocked();
 private:
     // 文件路径
     std::string m_filename;
     // 文件流
     std::ofstream m_filestream;
-    // 上次重新打开时间
-    uint64_t m_lastTime = 0;
+    // 待写出的记录
+    std::string m_buf;
+    // 上次写出的时间(秒)
+    uint64_t m_lastFlush = 0;
+    // 调用点id
+    std::unordered_map<Site, uint32_t, SiteHash> m_sites;
+    // 名称id
+    std::unordered_map<std::string, uint32_t> m_names;
+};
+
+/**
+ *  读取BinaryLogAppender写出的文件
+ */
+class BinaryLogReader {
+public:
+    BinaryLogReader(const std::string& filename);
+
+    /**
+     *  是否打开成功且文件头正确
+     */
+    bool isOpen() const { return m_ok;}
+
+    /**
+     *  读取下一条日志
+     * @details 事件中的文件名与格式串指向读取器内部, 需在读取器销毁前使用
+     * @return 文件结束或记录损坏时返回nullptr
+     */
+    LogEvent::ptr next();
+private:
+    // 调用点
+    struct Site {
+        std::string file;
+        int32_t line;
+        bool hasFmt;
+        std::string fmt;
+    };
+
+    /**
+     *  读取文件头(不含类型字节)
+     */
+    bool readHeader();
+private:
+    // 文件流
+    std::ifstream m_filestream;
+    // 文件头是否正确
+    bool m_ok = false;
+    // 调用点
+    std::map<uint32_t, Site> m_sites;
+    // 名称
+    std::map<uint32_t, std::string> m_names;
+    // 按名称还原的日志器
+    std::map<std::string, Logger::ptr> m_loggers;
+};
+
+/**
+ *  异步输出的Appender
+ * @details 包装一个同步的Appender. 写日志的线程只把日志事件放入本线程独占的
+ *          单生产者单消费者环形队列, 由后台线程批量取出, 交给被包装的Appender格式化并写入
+ */
+class AsyncLogAppender : public LogAppender {
+public:
+    typedef std::shared_ptr<AsyncLogAppender> ptr;
+
+    /**
+     *  队列满时的处理策略
+     */
+    enum Overflow {
+        // 等待后台线程腾出空间
+        BLOCK = 0,
+        // 丢弃新的日志
+        DROP = 1,
+        // 队列超过3/4后按比例采样(ERROR及以上不采样), 满后丢弃
+        SAMPLE = 2
+    };
+
+    /**
+     *  将队列满时的处理策略转成文本
+     */
+    static const char* OverflowToString(Overflow v);
+
+    /**
+     *  将文本转成队列满时的处理策略, 无法识别时返回BLOCK
+     */
+    static Overflow OverflowFromString(const std::string& str);
+
+    /**
+     *  构造函数
+     * @param[in] target 实际输出的Appender
+     * @param[in] queue_size 每个线程的队列长度, 向上取整为2的幂
+     * @param[in] overflow 队列满时的处理策略
+     * @param[in] sample_rate SAMPLE策略下每sample_rate条保留1条
+     */
+    AsyncLogAppender(LogAppender::ptr target, size_t queue_size = 4096
+                    ,Overflow overflow = BLOCK, uint32_t sample_rate = 16);
+
+    /**
+     *  析构函数, 写出队列中剩余的日志后停止后台线程
+     */
+    ~AsyncLogAppender();
+
+    void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+    std::string toYamlString() override;
+
+    /**
+     *  等待调用前已入队的日志全部写出, 不能在后台线程中调用
+     */
+    void flush();
+
+    /**
+     *  返回实际输出的Appender
+     */
+    LogAppender::ptr getTarget() const { return m_target;}
+
+    /**
+     *  返回队列满时的处理策略
+     */
+    Overflow getOverflow() const { return m_overflow;}
+
+    /**
+     *  返回因队列满而丢弃的日志数
+     */
+    uint64_t getDropped() const { return m_dropped;}
+
+    /**
+     *  返回因采样而丢弃的日志数
+     */
+    uint64_t getSampled() const { return m_sampled;}
+private:
+    // 每个写日志线程独占的环形队列
+    struct Ring;
+
+    /**
+     *  获取当前线程的队列, 第一次调用时创建并登记
+     */
+    Ring* getRing();
+
+    /**
+     *  唤醒后台线程
+     */
+    void wake();
+
+    /**
+     *  后台线程主函数
+     */
+    void run();
+
+    /**
+     *  写出所有队列中的日志
+     * @return 是否写出了日志
+     */
+    bool drain();
+
+    /**
+     *  是否有未写出的日志
+     */
+    bool pending();
+private:
+    // 实际输出的Appender
+    LogAppender::ptr m_target;
+    // 队列长度
+    size_t m_queueSize;
+    // 队列满时的处理策略
+    Overflow m_overflow;
+    // 采样比例
+    uint32_t m_sampleRate;
+    // 实例id, 用于查找线程的队列
+    uint64_t m_id;
+    // 因队列满丢弃的日志数
+    std::atomic<uint64_t> m_dropped {0};
+    // 因采样丢弃的日志数
+    std::atomic<uint64_t> m_sampled {0};
+    // 保护m_rings
+    Mutex m_ringMutex;
+    // 所有线程的队列
+    std::vector<std::shared_ptr<Ring> > m_rings;
+    // 后台线程是否即将等待
+    std::atomic<bool> m_sleeping {false};
+    // 是否停止
+    std::atomic<bool> m_stop {false};
+    // 唤醒后台线程
+    Semaphore m_sem;
+    // 后台线程
+    Thread::ptr m_thread;
 };
 
 /**
  *  日志器管理类
+ *  日志器按名称登记后得到一个不变的整数句柄, 按句柄查找只是下标访问;
+ *  按名称查找读取名称索引的快照, 不加锁. 日志器登记后不会删除
  */
 class LoggerManager {
 public:
@@ -534,25 +1430,64 @@ public:
     LoggerManager();
 
     /**
-     *  获取日志器
+     *  析构函数
      */
-    Logger::ptr getLogger(const std::string& name);
+    ~LoggerManager();
+
+    /**
+     *  获取日志器, 不存在时创建
+     */
+    const Logger::ptr& getLogger(const std::string& name) {
+        return getByHandle(getHandle(name));
+    }
+
+    /**
+     *  获取日志器的句柄, 不存在时创建日志器
+     */
+    uint32_t getHandle(const std::string& name);
+
+    /**
+     *  按句柄获取日志器
+     * @param[in] handle 由getHandle返回的句柄
+     */
+    const Logger::ptr& getByHandle(uint32_t handle) const {
+        Chunk* chunk = m_chunks[handle >> s_chunk_bits].load(std::memory_order_acquire);
+        return chunk->loggers[handle & (s_chunk_size - 1)];
+    }
 
     /**
      *  返回主日志器
      */
-    Logger::ptr getRoot() const { return m_root;}
+    const Logger::ptr& getRoot() const { return m_root;}
 
     /**
      *  将所有的日志器配置转成YAML String
      */
     std::string toYamlString();
 private:
-    // 日志器容器
-    std::map<std::string, Logger::ptr> m_loggers;
+    // 每块的日志器数
+    static const int s_chunk_bits = 6;
+    static const int s_chunk_size = 1 << s_chunk_bits;
+    // 块目录大小
+    static const int s_dir_size = 1024;
+
+    // 一块日志器, 槽位写入后不再修改
+    struct Chunk {
+        Logger::ptr loggers[s_chunk_size];
+    };
+
+    // 名称到句柄的索引, 发布后不再修改
+    typedef std::unordered_map<std::string, uint32_t> NameIndex;
+
+    // 按句柄分块存放的日志器
+    std::atomic<Chunk*> m_chunks[s_dir_size];
+    // 名称索引快照, 登记新日志器时复制一份再整体替换, 旧索引由EpochMgr回收
+    std::atomic<NameIndex*> m_index {nullptr};
+    // 已登记的日志器数
+    uint32_t m_size = 0;
     // 主日志器
     Logger::ptr m_root;
-    // mutex
+    // mutex, 只在登记时加锁
     MutexType m_mutex;
 };
 
@@ -225,6 +225,7 @@ void Scheduler::run() {
             } else {    // 否则，new一个
                 cb_fiber.reset(new Fiber(tk.cb));
             }
+            cb_fiber->m_context = std::move(tk.context);
 
             tk.reset();
 
@@ -119,6 +119,8 @@ private:
         std::function<void()> cb;
         // 线程
         int thread;
+        // 调度回调时的协程上下文, 执行时交给运行回调的协程
+        FiberContext::ptr context;
 
         // 构造函数
         // 1)协程+线程
@@ -134,11 +136,13 @@ private:
         // 2)协程执行函数+线程
         Task(std::function<void()> f, int thr) 
                 : cb(f)
-                , thread(thr) {
+                , thread(thr)
+                , context(Fiber::GetContext()) {
         }
         Task(std::function<void()> *f, int thr) 
                 : cb(std::move(*f))
-                , thread(thr) {
+                , thread(thr)
+                , context(Fiber::GetContext()) {
         }
 
         // 无参构造函数
@@ -150,6 +154,7 @@ private:
             fiber = nullptr;
             cb = nullptr;
             thread = -1;
+            context = nullptr;
         }
     };
 
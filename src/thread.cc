@@ -16,7 +16,7 @@ Thread* Thread::GetThis() {
 }
 
 // 针对日志模块，获取线程名称
-const std::string Thread::GetName() {
+const std::string& Thread::GetName() {
     return t_thread_name;
 }
 
@@ -9,6 +9,7 @@
 #include <functional>
 #include <memory>
 #include <pthread.h>
+#include <string>
 
 #include "noncopyable.h"
 #include "mutex.h"
@@ -35,7 +36,7 @@ public:
     static Thread* GetThis();
 
     // 针对日志模块，获取线程名称
-    static const std::string GetName();
+    static const std::string& GetName();
 
     // 设置线程名称
     static void SetName(const std::string& name);
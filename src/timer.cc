@@ -22,6 +22,7 @@ Timer::Timer(uint64_t ms, std::function<void()> cb,
         : m_recurring(recurring)
         , m_ms(ms)
         , m_cb(cb)
+        , m_context(Fiber::GetContext())
         , m_mgr(manager) {
     // ms传入的是相对时间，需要转换成绝对时间
     m_next = apollo::GetCurrentMS() + ms;
@@ -36,6 +37,7 @@ bool Timer::cancel() {
     TimerManager::RWMutexType::WriteLock lock(m_mgr->m_mutex);
     if(m_cb) {
         m_cb = nullptr;
+        m_context = nullptr;
         auto it = m_mgr->m_timers.find(shared_from_this());
         m_mgr->m_timers.erase(it);
         return true;
@@ -199,13 +201,24 @@ void TimerManager::listExpiredCbs(std::vector<std::function<void()>>& cbs) {
     cbs.reserve(expired.size());
 
     for(auto& it : expired) {
-        cbs.push_back(it->m_cb);
+        if(it->m_context) {
+            // 回调由idle协程调度, 需要带上添加定时器时的上下文
+            FiberContext::ptr ctx = it->m_context;
+            std::function<void()> cb = it->m_cb;
+            cbs.push_back([ctx, cb]() {
+                Fiber::SetContext(ctx);
+                cb();
+            });
+        } else {
+            cbs.push_back(it->m_cb);
+        }
         // 如果循环定时，需要重新加入定时器列表中
         if(it->m_recurring) {
             it->m_next = now_ms + it->m_ms;
             m_timers.insert(it);
         } else {
             it->m_cb = nullptr;
+            it->m_context = nullptr;
         }
     }
 }
@@ -5,6 +5,7 @@
 #include <set>
 #include <vector>
 
+#include "fiber.h"
 #include "mutex.h"
 
 namespace apollo
@@ -39,6 +40,8 @@ private:
     uint64_t m_next = 0;
     // 回调函数
     std::function<void()> m_cb;
+    // 添加定时器时的协程上下文, 回调执行时恢复
+    FiberContext::ptr m_context;
     // 定时器管理器
     TimerManager* m_mgr = nullptr;
 private:
@@ -59,11 +62,11 @@ public:
     // 虚析构函数，本类将由IOmanager类继承
     virtual ~TimerManager();
 
-    // 添加定时器
+    // 添加定时器, 回调在添加时所在协程的上下文(FiberContext)中执行
     Timer::ptr addTimer(uint64_t ms, std::function<void()> cb, 
             bool recurring = false);
 
-    // 添加条件定时器
+    // 添加条件定时器, 上下文同addTimer
     Timer::ptr addConditionTimer(uint64_t ms, std::function<void()> cb, 
             std::weak_ptr<void> weak_cond,
             bool recurring = false);
@@ -81,4 +81,10 @@ uint64_t GetCurrentMS() {
     return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
+uint64_t GetCurrentUS() {
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000ul + ts.tv_nsec / 1000;
+}
+
 }
\ No newline at end of file
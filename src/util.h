@@ -36,6 +36,9 @@ std::string BacktraceToString(int size = 64, int skip = 2, const std::string& pr
 // 获取毫秒
 uint64_t GetCurrentMS();
 
+// 获取微秒
+uint64_t GetCurrentUS();
+
 
 }   // namespace apollo
 
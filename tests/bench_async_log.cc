@@ -0,0 +1,69 @@
+#include "../src/apollo.h"
+
+#include <time.h>
+
+// 线程数
+static const int s_threads = 4;
+// 每个线程的日志条数
+static const int s_lines = 50000;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 写日志耗时(生产者视角)
+static std::atomic<uint64_t> s_nanos {0};
+
+void worker(apollo::Logger::ptr logger) {
+    uint64_t start = now_ns();
+    for(int i = 0; i < s_lines; ++i) {
+        APOLLO_LOG_INFO(logger) << "bench line " << i << " payload abcdefghijklmnopqrstuvwxyz";
+    }
+    s_nanos += now_ns() - start;
+}
+
+void run(const std::string& name, apollo::LogAppender::ptr appender) {
+    apollo::Logger::ptr logger(new apollo::Logger(name));
+    logger->addAppender(appender);
+
+    s_nanos = 0;
+    std::vector<apollo::Thread::ptr> thrs;
+    for(int i = 0; i < s_threads; ++i) {
+        thrs.push_back(apollo::Thread::ptr(new apollo::Thread(std::bind(worker, logger)
+                        ,name + "_" + std::to_string(i))));
+    }
+    for(auto& i : thrs) {
+        i->join();
+    }
+
+    uint64_t flush_start = now_ns();
+    auto async = std::dynamic_pointer_cast<apollo::AsyncLogAppender>(appender);
+    if(async) {
+        async->flush();
+    }
+    uint64_t lines = (uint64_t)s_threads * s_lines;
+    std::cout << name << ": threads=" << s_threads << " lines=" << lines
+              << " ns/log=" << (double)s_nanos / lines
+              << " flush_ms=" << (now_ns() - flush_start) / 1000000;
+    if(async) {
+        std::cout << " dropped=" << async->getDropped()
+                  << " sampled=" << async->getSampled();
+    }
+    std::cout << std::endl;
+}
+
+int main(int argc, char** argv) {
+    std::string file = "/tmp/apollo_bench_async_log.txt";
+    run("sync", apollo::LogAppender::ptr(new apollo::FileLogAppender(file)));
+    run("async_block", apollo::LogAppender::ptr(new apollo::AsyncLogAppender(
+                apollo::LogAppender::ptr(new apollo::FileLogAppender(file)))));
+    run("async_drop", apollo::LogAppender::ptr(new apollo::AsyncLogAppender(
+                apollo::LogAppender::ptr(new apollo::FileLogAppender(file))
+                ,1024, apollo::AsyncLogAppender::DROP)));
+    run("async_sample", apollo::LogAppender::ptr(new apollo::AsyncLogAppender(
+                apollo::LogAppender::ptr(new apollo::FileLogAppender(file))
+                ,1024, apollo::AsyncLogAppender::SAMPLE, 8)));
+    return 0;
+}
@@ -0,0 +1,126 @@
+#include "../src/apollo.h"
+
+#include <fstream>
+#include <sys/stat.h>
+#include <time.h>
+
+// 配置文件数
+static const int s_files = 32;
+// 每个文件的标量配置项数
+static const int s_scalars = 1000;
+// 每个文件的容器配置项数
+static const int s_containers = 100;
+
+static const std::string s_dir = "/tmp/apollo_bench_config_load";
+static const std::string s_snapshot = "/tmp/apollo_bench_config_load.snapshot";
+// 生成快照时配置目录的指纹
+static uint64_t s_sources = 0;
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static std::string file_name(int f) {
+    // 一半文件放在子目录下
+    return s_dir + (f % 2 ? "/sub/" : "/") + "f" + std::to_string(f) + ".yml";
+}
+
+// 注册全部配置项
+void register_vars() {
+    for(int f = 0; f < s_files; ++f) {
+        std::string prefix = "bench.f" + std::to_string(f) + ".";
+        for(int i = 0; i < s_scalars; ++i) {
+            apollo::Config::Lookup(prefix + "i" + std::to_string(i), (int)0, "");
+        }
+        for(int i = 0; i < s_containers; ++i) {
+            apollo::Config::Lookup(prefix + "v" + std::to_string(i), std::vector<int>(), "");
+            apollo::Config::Lookup(prefix + "m" + std::to_string(i)
+                    , std::map<std::string, std::vector<int> >(), "");
+        }
+    }
+}
+
+// 生成配置文件, round不同则全部配置值不同
+void write_files(int round) {
+    mkdir(s_dir.c_str(), 0755);
+    mkdir((s_dir + "/sub").c_str(), 0755);
+    for(int f = 0; f < s_files; ++f) {
+        std::ofstream ofs(file_name(f));
+        ofs << "bench:\n  f" << f << ":\n";
+        for(int i = 0; i < s_scalars; ++i) {
+            ofs << "    i" << i << ": " << i + round << "\n";
+        }
+        for(int i = 0; i < s_containers; ++i) {
+            ofs << "    v" << i << ": [";
+            for(int j = 0; j < 20; ++j) {
+                ofs << (j ? ", " : "") << j + round;
+            }
+            ofs << "]\n    m" << i << ": {";
+            for(int j = 0; j < 5; ++j) {
+                ofs << (j ? ", " : "") << "k" << j << ": [" << j << ", " << round << "]";
+            }
+            ofs << "}\n";
+        }
+    }
+}
+
+// 原方式: 逐个文件串行加载
+int load_serial() {
+    for(int f = 0; f < s_files; ++f) {
+        apollo::Config::LoadFromYaml(YAML::LoadFile(file_name(f)));
+    }
+    return -1;
+}
+
+int load_dir_1() {
+    return apollo::Config::LoadFromConfDir(s_dir, false, 1);
+}
+
+int load_dir_n() {
+    return apollo::Config::LoadFromConfDir(s_dir);
+}
+
+int load_cached() {
+    return apollo::Config::LoadFromConfDirCached(s_dir, s_snapshot);
+}
+
+// 只加载快照, 不检查配置目录
+int load_snapshot() {
+    return apollo::Config::LoadSnapshot(s_snapshot, s_sources);
+}
+
+void run(const char* name, int round, int (*load)(), bool rewrite = true) {
+    if(rewrite) {
+        write_files(round);
+    }
+    uint64_t start = now_us();
+    int changed = load();
+    uint64_t us = now_us() - start;
+    std::cout << name << ": files=" << s_files
+              << " keys=" << s_files * (s_scalars + s_containers * 2)
+              << " changed=" << changed
+              << " ms=" << us / 1000.0 << std::endl;
+}
+
+int main(int argc, char** argv) {
+    APOLLO_LOG_ROOT()->setLevel(apollo::LogLevel::ERROR);
+    register_vars();
+    run("serial", 1, load_serial);
+    run("dir_1", 2, load_dir_1);
+    run("dir_n", 3, load_dir_n);
+
+    // 文件未变化: 只解析与比较, 不发布
+    run("dir_n_unchanged", 3, load_dir_n, false);
+
+    // 二进制快照: 目录变化时回退到yaml并重新生成快照, 否则直接加载快照
+    remove(s_snapshot.c_str());
+    run("cached_miss", 4, load_cached);
+    run("cached_hit", 4, load_cached, false);
+    s_sources = apollo::Config::ConfDirFingerprint(s_dir);
+    // 当前值与快照不同, 快照中的值全部重新发布
+    run("dir_n", 5, load_dir_n);
+    run("snapshot_changed", 5, load_snapshot, false);
+    return 0;
+}
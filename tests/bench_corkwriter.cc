@@ -0,0 +1,129 @@
+#include "../src/apollo.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <string.h>
+
+static apollo::Logger::ptr g_logger = APOLLO_LOG_ROOT();
+
+// 请求数量
+static const int s_requests = 10000;
+// 每个响应的片段数量(状态行/头部/分隔/正文等小片段)
+static const int s_pieces = 16;
+// 每个片段大小
+static const int s_piece_size = 48;
+
+static bool loopback_pair(int& client, int& server) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0;
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr.s_addr);
+    socklen_t len = sizeof(addr);
+    if(bind(listener, (const sockaddr*)&addr, sizeof(addr))
+            || listen(listener, 1)
+            || getsockname(listener, (sockaddr*)&addr, &len)) {
+        close(listener);
+        return false;
+    }
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    if(connect(client, (const sockaddr*)&addr, sizeof(addr))) {
+        close(listener);
+        close(client);
+        return false;
+    }
+    server = accept(listener, nullptr, nullptr);
+    close(listener);
+    if(server < 0) {
+        return false;
+    }
+    // 关闭Nagle, 只比较系统调用次数的差别
+    int on = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return true;
+}
+
+static bool read_full(int fd, char* buf, size_t len) {
+    while(len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if(n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief 一问一答: 客户端发1字节请求, 服务端回复s_pieces个小片段
+ * @param[in] cork 服务端是否使用CorkWriter合并写出
+ */
+void bench(bool cork) {
+    int client = -1, server = -1;
+    if(!loopback_pair(client, server)) {
+        APOLLO_LOG_ERROR(g_logger) << "loopback_pair failed errno=" << errno;
+        return;
+    }
+
+    apollo::IOManager::GetThis()->schedule([client]() {
+        char req = 'q';
+        std::vector<char> resp(s_pieces * s_piece_size);
+        for(int i = 0; i < s_requests; ++i) {
+            if(write(client, &req, 1) != 1
+                    || !read_full(client, &resp[0], resp.size())) {
+                APOLLO_LOG_ERROR(g_logger) << "client i=" << i << " errno=" << errno;
+                break;
+            }
+        }
+        close(client);
+    });
+
+    char piece[s_piece_size];
+    memset(piece, 'p', sizeof(piece));
+    uint64_t syscalls = 0;
+    uint64_t start = apollo::GetCurrentMS();
+    if(cork) {
+        apollo::CorkWriter writer(server);
+        char req;
+        // 读下一个请求挂起之前, 暂存的响应会被自动写出
+        while(read(server, &req, 1) == 1) {
+            for(int i = 0; i < s_pieces; ++i) {
+                writer.appendRef(piece, sizeof(piece));
+            }
+        }
+        syscalls = writer.getSyscalls();
+    } else {
+        char req;
+        while(read(server, &req, 1) == 1) {
+            for(int i = 0; i < s_pieces; ++i) {
+                write(server, piece, sizeof(piece));
+                ++syscalls;
+            }
+        }
+    }
+    uint64_t used = apollo::GetCurrentMS() - start;
+    APOLLO_LOG_INFO(g_logger) << (cork ? "corkwriter" : "write") << ": requests="
+        << s_requests << " write_syscalls=" << syscalls
+        << " per_response=" << (double)syscalls / s_requests
+        << " used=" << used << "ms";
+    close(server);
+}
+
+void run() {
+    bench(false);
+    bench(true);
+}
+
+int main(int argc, char** argv) {
+    // 屏蔽system日志, 避免hook内的日志输出影响计时
+    APOLLO_LOG_NAME("system")->setLevel(apollo::LogLevel::ERROR);
+    apollo::IOManager iom;
+    iom.schedule(run);
+    return 0;
+}
@@ -0,0 +1,163 @@
+#include "../src/apollo.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <time.h>
+
+static apollo::Logger::ptr g_logger = APOLLO_LOG_ROOT();
+
+// 线程数
+static const int s_threads = 4;
+// 协程数
+static const int s_fibers = 1000;
+// 每个协程的查询次数
+static const int s_lookups = 2000;
+// 句柄数
+static const int s_fds = 256;
+
+/**
+ * @brief 原实现: 读写锁保护的vector, 每次查询拷贝shared_ptr
+ */
+class LegacyFdManager {
+public:
+    struct Ctx {
+        typedef std::shared_ptr<Ctx> ptr;
+        bool isSocket = true;
+        bool isClosed = false;
+    };
+
+    LegacyFdManager() {
+        m_datas.resize(64);
+    }
+
+    Ctx::ptr get(int fd, bool auto_create = false) {
+        if(fd == -1) {
+            return nullptr;
+        }
+        apollo::RWMutex::ReadLock lock(m_mutex);
+        if((int)m_datas.size() <= fd) {
+            if(auto_create == false) {
+                return nullptr;
+            }
+        } else {
+            if(m_datas[fd] || !auto_create) {
+                return m_datas[fd];
+            }
+        }
+        lock.unlock();
+
+        apollo::RWMutex::WriteLock lock2(m_mutex);
+        Ctx::ptr ctx(new Ctx);
+        if(fd >= (int)m_datas.size()) {
+            m_datas.resize(fd * 1.5);
+        }
+        m_datas[fd] = ctx;
+        return ctx;
+    }
+private:
+    apollo::RWMutex m_mutex;
+    std::vector<Ctx::ptr> m_datas;
+};
+
+static LegacyFdManager s_legacy;
+static std::vector<int> s_fdlist;
+static std::atomic<uint64_t> s_hits {0};
+// 查询耗时(不含协程切换与调度器启停)
+static std::atomic<uint64_t> s_nanos {0};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void legacy_worker(int seed) {
+    uint64_t hits = 0;
+    uint64_t nanos = 0;
+    uint64_t start = now_ns();
+    for(int i = 0; i < s_lookups; ++i) {
+        int fd = s_fdlist[(seed + i * 7) % s_fdlist.size()];
+        LegacyFdManager::Ctx::ptr ctx = s_legacy.get(fd);
+        if(ctx && ctx->isSocket && !ctx->isClosed) {
+            ++hits;
+        }
+        if(i % 100 == 99) {
+            nanos += now_ns() - start;
+            apollo::Fiber::YieldToReady();
+            start = now_ns();
+        }
+    }
+    nanos += now_ns() - start;
+    s_hits += hits;
+    s_nanos += nanos;
+}
+
+void slab_worker(int seed) {
+    uint64_t hits = 0;
+    uint64_t nanos = 0;
+    uint64_t start = now_ns();
+    for(int i = 0; i < s_lookups; ++i) {
+        int fd = s_fdlist[(seed + i * 7) % s_fdlist.size()];
+        {
+            // EpochGuard作用域内不能挂起协程
+            apollo::EpochGuard guard;
+            apollo::FdCtx* ctx = apollo::FdMgr::GetInstance()->get(fd);
+            if(ctx && ctx->isSocket() && !ctx->isClose()) {
+                ++hits;
+            }
+        }
+        if(i % 100 == 99) {
+            nanos += now_ns() - start;
+            apollo::Fiber::YieldToReady();
+            start = now_ns();
+        }
+    }
+    nanos += now_ns() - start;
+    s_hits += hits;
+    s_nanos += nanos;
+}
+
+void run(const char* name, void (*worker)(int)) {
+    s_hits = 0;
+    s_nanos = 0;
+    {
+        apollo::IOManager iom(s_threads, false, name);
+        for(int i = 0; i < s_fibers; ++i) {
+            iom.schedule(std::bind(worker, i));
+        }
+    }
+    uint64_t lookups = (uint64_t)s_fibers * s_lookups;
+    APOLLO_LOG_INFO(g_logger) << name << ": threads=" << s_threads << " fibers=" << s_fibers
+        << " lookups=" << lookups << " hits=" << s_hits
+        << " ns/lookup=" << (double)s_nanos / lookups;
+}
+
+void test_delete_reuse() {
+    // 反复创建/删除, 验证slab复用与epoch回收
+    for(int i = 0; i < 10000; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        apollo::FdMgr::GetInstance()->get(fd, true);
+        apollo::FdMgr::GetInstance()->del(fd);
+        close(fd);
+    }
+    APOLLO_LOG_INFO(g_logger) << "create/delete 10000 fds epoch="
+        << apollo::EpochMgr::GetInstance()->getEpoch();
+}
+
+int main(int argc, char** argv) {
+    APOLLO_LOG_NAME("system")->setLevel(apollo::LogLevel::ERROR);
+    for(int i = 0; i < s_fds; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        s_fdlist.push_back(fd);
+        s_legacy.get(fd, true);
+        apollo::FdMgr::GetInstance()->get(fd, true);
+    }
+    run("slab", slab_worker);
+    run("legacy", legacy_worker);
+    test_delete_reuse();
+    for(auto fd : s_fdlist) {
+        close(fd);
+    }
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include "../src/apollo.h"
+
+#include <new>
+#include <stdlib.h>
+#include <time.h>
+
+// 全局内存分配计数
+static std::atomic<uint64_t> s_allocs {0};
+
+void* operator new(size_t size) {
+    ++s_allocs;
+    void* p = malloc(size ? size : 1);
+    if(!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+// 日志条数
+static const int s_lines = 100000;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void run(const char* name, apollo::Logger::ptr logger, void (*emit)(apollo::Logger::ptr, int)) {
+    // 预热: 事件池, 线程名, 时区等
+    for(int i = 0; i < 100; ++i) {
+        emit(logger, i);
+    }
+    uint64_t allocs = s_allocs;
+    uint64_t start = now_ns();
+    for(int i = 0; i < s_lines; ++i) {
+        emit(logger, i);
+    }
+    uint64_t ns = now_ns() - start;
+    allocs = s_allocs - allocs;
+    std::cout << name << ": lines=" << s_lines
+              << " allocs/line=" << (double)allocs / s_lines
+              << " ns/line=" << (double)ns / s_lines << std::endl;
+}
+
+void emit_stream(apollo::Logger::ptr logger, int i) {
+    APOLLO_LOG_INFO(logger) << "stream line " << i << " value=" << 3.14 << " ok=" << true;
+}
+
+void emit_fmt(apollo::Logger::ptr logger, int i) {
+    APOLLO_LOG_FMT_INFO(logger, "fmt line %d value=%s", i, "abc");
+}
+
+void emit_kv(apollo::Logger::ptr logger, int i) {
+    APOLLO_LOG_INFO(logger) << "kv line" << apollo::kv("i", i) << apollo::kv("name", "abc")
+        << apollo::kv("cost", 0.25) << apollo::kv("ok", true);
+}
+
+void emit_long(apollo::Logger::ptr logger, int i) {
+    // 超出内联数组, 走std::string转存
+    static const std::string s_long(2000, 'x');
+    APOLLO_LOG_INFO(logger) << "long line " << i << " " << s_long;
+}
+
+void emit_legacy(apollo::Logger::ptr logger, int i) {
+    // 对照: 每条日志新建事件
+    apollo::LogEventWrap(apollo::LogEvent::ptr(new apollo::LogEvent(logger, apollo::LogLevel::INFO
+                    ,__FILE__, __LINE__, 0, apollo::GetThreadId(), apollo::GetFiberId()
+                    ,time(0), apollo::Thread::GetName()))).getSS() << "legacy line " << i;
+}
+
+int main(int argc, char** argv) {
+    apollo::Logger::ptr logger(new apollo::Logger("bench"));
+    logger->addAppender(apollo::LogAppender::ptr(new apollo::FileLogAppender("/dev/null")));
+
+    run("stream", logger, emit_stream);
+    run("fmt", logger, emit_fmt);
+    run("long", logger, emit_long);
+    run("new_event", logger, emit_legacy);
+
+    // 结构化字段按JSON输出
+    apollo::Logger::ptr json(new apollo::Logger("json"));
+    apollo::LogAppender::ptr json_appender(new apollo::FileLogAppender("/dev/null"));
+    json_appender->setFormatter(apollo::LogFormatter::ptr(new apollo::LogFormatter("json")));
+    json->addAppender(json_appender);
+    run("kv_text", logger, emit_kv);
+    run("kv_json", json, emit_kv);
+
+    // 二进制日志: 只写调用点id与原始参数, 不生成文本
+    std::string file = "/tmp/apollo_bench_log_alloc.bin";
+    remove(file.c_str());
+    apollo::Logger::ptr binary(new apollo::Logger("binary"));
+    binary->addAppender(apollo::LogAppender::ptr(new apollo::BinaryLogAppender(file)));
+    run("binary_stream", binary, emit_stream);
+    run("binary_fmt", binary, emit_fmt);
+    return 0;
+}
@@ -1,9 +1,12 @@
 #include <iostream>
+#include <fstream>
+#include <unistd.h>
 #include <yaml-cpp/yaml.h>
 
 #include "../src/log.h"
 #include "../src/util.h"
 #include "../src/config.h"
+#include "../src/iomanager.h"
 
 apollo::ConfigVar<int>::ptr g_int_value_config =
     apollo::Config::Lookup("system.port", (int)8080, "system port");
@@ -66,7 +69,8 @@ void test_config() {
 
 #define XX(g_var, name, prefix) \
     { \
-        auto& v = g_var->getValue(); \
+        apollo::EpochGuard guard; \
+        auto& v = g_var->getValue(guard); \
         for(auto& i : v) { \
             APOLLO_LOG_INFO(APOLLO_LOG_ROOT()) << #prefix " " #name ": " << i; \
         } \
@@ -75,7 +79,8 @@ void test_config() {
 
 #define XX_M(g_var, name, prefix) \
     { \
-        auto& v = g_var->getValue(); \
+        apollo::EpochGuard guard; \
+        auto& v = g_var->getValue(guard); \
         for(auto& i : v) { \
             APOLLO_LOG_INFO(APOLLO_LOG_ROOT()) << #prefix " " #name ": {" \
                     << i.first << " - " << i.second << "}"; \
@@ -205,10 +210,76 @@ void test_log() {
     std::cout << apollo::LoggerMgr::GetInstance()->toYamlString() << std::endl;
 }
 
+void test_watcher() {
+    static const std::string s_file = "/tmp/apollo_test_watcher.yml";
+    // 先写临时文件再改名, 与编辑器保存文件的方式一致
+    auto write = [](const std::string& content) {
+        std::string tmp = s_file + ".tmp";
+        std::ofstream ofs(tmp);
+        ofs << content;
+        ofs.close();
+        rename(tmp.c_str(), s_file.c_str());
+    };
+    write("system:\n    port: 8080\n    value: 10.2\n");
+
+    int port_changes = 0;
+    int value_changes = 0;
+    uint64_t port_key = g_int_value_config->addListener([&port_changes](const int& old_val, const int& new_val) {
+            ++port_changes;
+            });
+    uint64_t value_key = g_float_value_config->addListener([&value_changes](const float& old_val, const float& new_val) {
+            ++value_changes;
+            APOLLO_LOG_INFO(APOLLO_LOG_ROOT()) << "system.value " << old_val << " -> " << new_val;
+            });
+
+    apollo::IOManager iom(1, false, "watcher");
+    apollo::ConfigWatcher::ptr watcher(new apollo::ConfigWatcher(&iom, 50));
+    watcher->addFile(s_file);
+    watcher->start();
+    usleep(100 * 1000);
+
+    // 只有system.value变化
+    write("system:\n    port: 8080\n    value: 20.5\n");
+    usleep(300 * 1000);
+    // system.value转换失败, system.port也不会提交
+    write("system:\n    port: 9090\n    value: abc\n");
+    usleep(300 * 1000);
+    watcher->stop();
+
+    APOLLO_LOG_INFO(APOLLO_LOG_ROOT()) << "reloads=" << watcher->getReloads()
+        << " failures=" << watcher->getFailures()
+        << " port=" << g_int_value_config->getValue() << " port_changes=" << port_changes
+        << " value=" << g_float_value_config->getValue() << " value_changes=" << value_changes;
+    g_int_value_config->delListener(port_key);
+    g_float_value_config->delListener(value_key);
+}
+
+void test_async_listener() {
+    std::atomic<int> calls {0};
+    std::atomic<int> last {0};
+    apollo::IOManager iom(1, false, "listener");
+    // 异步监听器: 回调中读取配置项不会死锁, 连续的变更合并派发
+    uint64_t key = g_int_value_config->addListener([&calls, &last](const int& old_val, const int& new_val) {
+            ++calls;
+            last = g_int_value_config->getValue();
+            usleep(1000);
+            }, &iom);
+    for(int i = 1; i <= 1000; ++i) {
+        g_int_value_config->setValue(10000 + i);
+    }
+    usleep(200 * 1000);
+    g_int_value_config->delListener(key);
+    APOLLO_LOG_INFO(APOLLO_LOG_ROOT()) << "changes=1000 calls=" << calls << " last=" << last
+        << " value=" << g_int_value_config->getValue();
+    g_int_value_config->setValue(8080);
+}
+
 int main(int argc, char** argv) {
     /* test_yaml(); */
     /* test_config(); */
     /* test_class(); */
+    test_async_listener();
+    test_watcher();
     test_log();
 
     apollo::Config::Visit([](apollo::ConfigVarBase::ptr var) {
@@ -0,0 +1,88 @@
+#include "../src/apollo.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static apollo::Logger::ptr g_logger = APOLLO_LOG_ROOT();
+
+static void run(const std::vector<apollo::Address::ptr>& addrs) {
+    apollo::Address::ptr connected;
+    uint64_t start = apollo::GetCurrentMS();
+    int fd = apollo::Connector::Connect(addrs, SOCK_STREAM, 2000, 250, &connected);
+    uint64_t used = apollo::GetCurrentMS() - start;
+    if(fd == -1) {
+        APOLLO_LOG_INFO(g_logger) << "connect failed errno=" << errno
+            << " " << strerror(errno) << " used=" << used << "ms";
+        return;
+    }
+    APOLLO_LOG_INFO(g_logger) << "connected " << connected->toString()
+        << " fd=" << fd << " used=" << used << "ms";
+    close(fd);
+}
+
+void test_connect() {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    apollo::IPv4Address::ptr local = apollo::IPv4Address::Create("127.0.0.1", 0);
+    socklen_t len = local->getAddrLen();
+    if(bind(listener, local->getAddr(), len)
+            || listen(listener, 16)
+            || getsockname(listener, local->getAddr(), &len)) {
+        APOLLO_LOG_ERROR(g_logger) << "listen errno=" << errno;
+        return;
+    }
+    uint16_t port = local->getPort();
+
+    // 没有监听的IPv6地址立即失败, 不等stagger直接尝试IPv4
+    std::vector<apollo::Address::ptr> addrs;
+    addrs.push_back(apollo::IPv6Address::Create("::1", port + 1));
+    addrs.push_back(local);
+    run(addrs);
+
+    // 构造一个连接会挂起的地址: 全连接队列已满且不accept时, 新的SYN会被丢弃
+    int stall = socket(AF_INET, SOCK_STREAM, 0);
+    apollo::IPv4Address::ptr stall_addr = apollo::IPv4Address::Create("127.0.0.1", 0);
+    len = stall_addr->getAddrLen();
+    bind(stall, stall_addr->getAddr(), len);
+    listen(stall, 0);
+    getsockname(stall, stall_addr->getAddr(), &len);
+    std::vector<int> fillers;
+    for(int i = 0; i < 8; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        fillers.push_back(fd);
+        if(connect_with_timeout(fd, stall_addr->getAddr(), len, 100) && errno == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    // 挂起的地址在前, stagger后第二个地址胜出, 挂起的连接被取消
+    addrs.clear();
+    addrs.push_back(stall_addr);
+    addrs.push_back(apollo::IPv6Address::Create("::1", port + 1));
+    addrs.push_back(local);
+    run(addrs);
+    for(auto fd : fillers) {
+        close(fd);
+    }
+    close(stall);
+
+    // 全部失败
+    addrs.clear();
+    addrs.push_back(apollo::IPv6Address::Create("::1", port + 1));
+    addrs.push_back(apollo::IPv4Address::Create("127.0.0.1", port + 1));
+    run(addrs);
+
+    // 解析域名后并发连接
+    int fd = apollo::Connector::Connect("localhost:" + std::to_string(port));
+    APOLLO_LOG_INFO(g_logger) << "connect localhost fd=" << fd << " errno=" << errno;
+    if(fd != -1) {
+        close(fd);
+    }
+    close(listener);
+}
+
+int main(int argc, char** argv) {
+    apollo::IOManager iom;
+    iom.schedule(test_connect);
+    return 0;
+}
@@ -0,0 +1,113 @@
+#include "../src/apollo.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+
+static apollo::Logger::ptr g_logger = APOLLO_LOG_ROOT();
+
+static const int s_total = 1000;
+
+void test_batch() {
+    int receiver = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0;
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr.s_addr);
+    socklen_t len = sizeof(addr);
+    if(bind(receiver, (const sockaddr*)&addr, sizeof(addr))
+            || getsockname(receiver, (sockaddr*)&addr, &len)) {
+        APOLLO_LOG_ERROR(g_logger) << "bind errno=" << errno;
+        return;
+    }
+    apollo::DatagramBatch::EnableGro(receiver);
+    // 丢包时接收方按超时退出
+    timeval tv = {1, 0};
+    setsockopt(receiver, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    apollo::IOManager::GetThis()->schedule([receiver]() {
+        apollo::DatagramBatch batch(64, 65535);
+        int total = 0;
+        int wakeups = 0;
+        while(total < s_total) {
+            int n = batch.recv(receiver);
+            if(n <= 0) {
+                APOLLO_LOG_ERROR(g_logger) << "recv n=" << n << " errno=" << errno;
+                break;
+            }
+            ++wakeups;
+            for(int i = 0; i < n; ++i) {
+                // GRO合并后的数据报按分段大小拆分计数
+                size_t seg = batch.segmentSize(i);
+                total += seg ? (batch.size(i) + seg - 1) / seg : 1;
+            }
+        }
+        APOLLO_LOG_INFO(g_logger) << "received datagrams=" << total
+            << " wakeups=" << wakeups;
+        close(receiver);
+    });
+
+    int sender = socket(AF_INET, SOCK_DGRAM, 0);
+    connect(sender, (const sockaddr*)&addr, sizeof(addr));
+
+    char payload[512];
+    memset(payload, 'u', sizeof(payload));
+    apollo::DatagramBatch batch(64);
+    int sent = 0;
+    while(sent < s_total) {
+        while(sent + (int)batch.pending() < s_total
+                && batch.add(payload, sizeof(payload))) {
+        }
+        int n = batch.send(sender);
+        if(n <= 0) {
+            APOLLO_LOG_ERROR(g_logger) << "send n=" << n << " errno=" << errno;
+            break;
+        }
+        sent += n;
+        // 让出协程, 避免接收缓冲区溢出
+        usleep(1000);
+    }
+    APOLLO_LOG_INFO(g_logger) << "sent datagrams=" << sent;
+    close(sender);
+}
+
+void test_partial() {
+    int receiver = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr.s_addr);
+    socklen_t len = sizeof(addr);
+    bind(receiver, (const sockaddr*)&addr, sizeof(addr));
+    getsockname(receiver, (sockaddr*)&addr, &len);
+    int sender = socket(AF_INET, SOCK_DGRAM, 0);
+    connect(sender, (const sockaddr*)&addr, sizeof(addr));
+
+    // 第二个数据报超过UDP上限, sendmmsg在它之前停下, 剩余的数据报留在队列中
+    static char small[64];
+    static char huge[70000];
+    apollo::DatagramBatch batch(8);
+    batch.add(small, sizeof(small));
+    batch.add(huge, sizeof(huge));
+    batch.add(small, sizeof(small));
+    int n = batch.send(sender);
+    APOLLO_LOG_INFO(g_logger) << "first send n=" << n << " pending=" << batch.pending();
+    n = batch.send(sender);
+    APOLLO_LOG_INFO(g_logger) << "second send n=" << n << " errno=" << errno
+        << " pending=" << batch.pending();
+    batch.clear();
+    n = batch.send(sender);
+    APOLLO_LOG_INFO(g_logger) << "empty send n=" << n;
+    close(sender);
+    close(receiver);
+}
+
+int main(int argc, char** argv) {
+    apollo::IOManager iom;
+    iom.schedule(test_partial);
+    iom.schedule(test_batch);
+    return 0;
+}
@@ -61,14 +61,170 @@ void test_sock() {
     APOLLO_LOG_INFO(g_logger) << buff;
 }
 
+// 本地回环上建立一对已连接的socket
+static bool loopback_pair(int& client, int& server) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0;
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr.s_addr);
+    socklen_t len = sizeof(addr);
+    if(bind(listener, (const sockaddr*)&addr, sizeof(addr))
+            || listen(listener, 1)
+            || getsockname(listener, (sockaddr*)&addr, &len)) {
+        close(listener);
+        return false;
+    }
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    if(connect(client, (const sockaddr*)&addr, sizeof(addr))) {
+        close(listener);
+        close(client);
+        return false;
+    }
+    server = accept(listener, nullptr, nullptr);
+    close(listener);
+    return server >= 0;
+}
+
+void test_sendfile() {
+    int client = -1, server = -1;
+    if(!loopback_pair(client, server)) {
+        APOLLO_LOG_ERROR(g_logger) << "loopback_pair failed errno=" << errno;
+        return;
+    }
+
+    char path[] = "/tmp/apollo_sendfile_XXXXXX";
+    int filefd = mkstemp(path);
+    unlink(path);
+    std::string content(256 * 1024, 'a');
+    write(filefd, content.data(), content.size());
+
+    apollo::IOManager::GetThis()->schedule([server, content]() {
+        std::string buff;
+        buff.resize(content.size());
+        size_t total = 0;
+        while(total < buff.size()) {
+            int rt = recv(server, &buff[total], buff.size() - total, 0);
+            if(rt <= 0) {
+                break;
+            }
+            total += rt;
+        }
+        APOLLO_LOG_INFO(g_logger) << "recv total = " << total
+            << " match = " << (buff == content);
+        close(server);
+    });
+
+    off_t offset = 0;
+    while(offset < (off_t)content.size()) {
+        ssize_t rt = sendfile(client, filefd, &offset, content.size() - offset);
+        if(rt <= 0) {
+            APOLLO_LOG_ERROR(g_logger) << "sendfile rt = " << rt << " errno = " << errno;
+            break;
+        }
+    }
+    APOLLO_LOG_INFO(g_logger) << "sendfile offset = " << offset;
+    close(filefd);
+    close(client);
+}
+
+void test_zerocopy() {
+    int client = -1, server = -1;
+    if(!loopback_pair(client, server)) {
+        APOLLO_LOG_ERROR(g_logger) << "loopback_pair failed errno=" << errno;
+        return;
+    }
+
+    // 对端读协程挂起在client上, 等待零拷贝完成不能占用client的READ事件
+    apollo::IOManager::GetThis()->schedule([client]() {
+        char buf[16];
+        int rt = recv(client, buf, sizeof(buf), 0);
+        APOLLO_LOG_INFO(g_logger) << "client recv rt = " << rt << " errno = " << errno;
+    });
+    usleep(10 * 1000);
+
+    std::string data(64 * 1024, 'z');
+    ssize_t rt = send_zerocopy(client, data.data(), data.size(), 0);
+    APOLLO_LOG_INFO(g_logger) << "send_zerocopy rt = " << rt << " errno = " << errno;
+    uint64_t start = apollo::GetCurrentMS();
+    rt = send_zerocopy_wait(client);
+    APOLLO_LOG_INFO(g_logger) << "send_zerocopy_wait rt = " << rt << " errno = " << errno
+        << " used=" << apollo::GetCurrentMS() - start << "ms";
+    // 唤醒client上的读协程
+    send(server, "bye", 3, 0);
+    usleep(10 * 1000);
+    close(client);
+    close(server);
+}
+
+void test_deadline() {
+    int client = -1, server = -1;
+    if(!loopback_pair(client, server)) {
+        APOLLO_LOG_ERROR(g_logger) << "loopback_pair failed errno=" << errno;
+        return;
+    }
+
+    // 整个"请求"共享300ms预算, 第一次read等满预算, 第二次read直接失败
+    apollo::FiberDeadline deadline(300);
+    char buf[16];
+    uint64_t start = apollo::GetCurrentMS();
+    int rt = read(server, buf, sizeof(buf));
+    APOLLO_LOG_INFO(g_logger) << "first read rt=" << rt << " errno=" << errno
+        << " used=" << apollo::GetCurrentMS() - start << "ms";
+    start = apollo::GetCurrentMS();
+    rt = read(server, buf, sizeof(buf));
+    APOLLO_LOG_INFO(g_logger) << "second read rt=" << rt << " errno=" << errno
+        << " used=" << apollo::GetCurrentMS() - start << "ms";
+    close(client);
+    close(server);
+}
+
+void test_fd_stats() {
+    int client = -1, server = -1;
+    if(!loopback_pair(client, server)) {
+        APOLLO_LOG_ERROR(g_logger) << "loopback_pair failed errno=" << errno;
+        return;
+    }
+
+    apollo::IOManager::GetThis()->schedule([client]() {
+        char buf[4096] = {0};
+        for(int i = 0; i < 100; ++i) {
+            usleep(1000);
+            write(client, buf, sizeof(buf));
+        }
+        close(client);
+    });
+
+    // server每次读都会先挂起等待数据
+    char buf[4096];
+    while(read(server, buf, sizeof(buf)) > 0) {
+    }
+
+    // 需要cmake -DAPOLLO_FD_STATS=ON, 否则统计全为0
+    std::vector<apollo::FdStats> stats;
+    apollo::FdMgr::GetInstance()->topStats(stats, 5, apollo::FdStats::PARKS);
+    for(auto& st : stats) {
+        APOLLO_LOG_INFO(g_logger) << "fd=" << st.fd << " in=" << st.bytesIn
+            << " out=" << st.bytesOut << " syscalls=" << st.syscalls
+            << " parks=" << st.parks << " timeouts=" << st.timeouts
+            << " parked=" << st.parkedUs << "us";
+    }
+    close(server);
+}
+
 int main(int argc, char** argv)
 {
     apollo::Thread::SetName("main");
 
     // test_sleep();
-    // test_sock();
     apollo::IOManager iom;
+    // 以下用例使用IOManager::GetThis(), 需在iom中调度
     iom.schedule(test_sock);
+    iom.schedule(test_sendfile);
+    iom.schedule(test_zerocopy);
+    iom.schedule(test_deadline);
+    iom.schedule(test_fd_stats);
 
     return 0;
 }
\ No newline at end of file
@@ -61,8 +61,29 @@ void test_timer() {
     }, true);
 }
 
+// 定时器回调带着添加定时器时的协程上下文执行
+void test_timer_context() {
+    // 条件需要比iom活得久, 否则条件定时器不执行
+    std::shared_ptr<int> cond(new int(0));
+    apollo::IOManager iom(2, false, "timer_ctx");
+    iom.schedule([cond]() {
+        apollo::FiberContextScope trace("trace_id", "timer-1");
+        apollo::IOManager::GetThis()->addTimer(10, []() {
+            const std::string* v = apollo::Fiber::GetContext()
+                ? apollo::Fiber::GetContext()->get("trace_id") : nullptr;
+            APOLLO_LOG_INFO(g_logger) << "timer trace_id=" << (v ? *v : "(none)");
+        });
+        apollo::IOManager::GetThis()->addConditionTimer(20, []() {
+            const std::string* v = apollo::Fiber::GetContext()
+                ? apollo::Fiber::GetContext()->get("trace_id") : nullptr;
+            APOLLO_LOG_INFO(g_logger) << "condition timer trace_id=" << (v ? *v : "(none)");
+        }, cond);
+    });
+}
+
 int main(int agrc, char** argv) {
     // test1();
+    test_timer_context();
     test_timer();
     return 0;
 }
\ No newline at end of file
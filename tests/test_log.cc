@@ -2,6 +2,59 @@
 #include "../src/log.h"
 #include "../src/util.h"
 
+#include <unistd.h>
+
+// 按大小滚动并压缩
+void test_rolling() {
+    apollo::Logger::ptr logger(new apollo::Logger("rolling"));
+    apollo::FileLogAppender::ptr file(new apollo::FileLogAppender("rolling.txt"));
+    file->setMaxSize(64 * 1024);
+    file->setCompress(true);
+    logger->addAppender(file);
+    for(int i = 0; i < 5000; ++i) {
+        APOLLO_LOG_INFO(logger) << "rolling line " << i;
+    }
+    // 等待后台线程压缩
+    usleep(500 * 1000);
+    std::cout << "rolling done, see rolling.txt*" << std::endl;
+}
+
+void test_mmap() {
+    apollo::Logger::ptr logger(new apollo::Logger("mmap"));
+    // 小段便于观察换段, 未写满部分在换段或析构时截掉
+    logger->addAppender(apollo::LogAppender::ptr(new apollo::MmapLogAppender("mmap.txt", 64 * 1024)));
+    for(int i = 0; i < 5000; ++i) {
+        APOLLO_LOG_INFO(logger) << "mmap line " << i;
+    }
+    std::cout << "mmap done, see mmap.txt*" << std::endl;
+}
+
+void test_structured() {
+    apollo::Logger::ptr logger(new apollo::Logger("structured"));
+    const char* patterns[] = {"json", "logfmt", "%p%T%m%T%K%n"};
+    for(auto pattern : patterns) {
+        apollo::LogAppender::ptr appender(new apollo::StdoutLogAppender);
+        appender->setFormatter(apollo::LogFormatter::ptr(new apollo::LogFormatter(pattern)));
+        logger->clearAppenders();
+        logger->addAppender(appender);
+        APOLLO_LOG_INFO(logger) << "user \"login\"" << apollo::kv("uid", 10086)
+            << apollo::kv("name", "tom cat") << apollo::kv("cost", 1.5)
+            << apollo::kv("ok", true) << apollo::kv("retry", -1);
+    }
+}
+
+void test_limited(apollo::Logger::ptr logger) {
+    for(int i = 0; i < 100; ++i) {
+        // 第0, 40, 80次
+        APOLLO_LOG_EVERY_N(logger, apollo::LogLevel::INFO, 40) << "every 40, i=" << i;
+        // 第0, 1次
+        APOLLO_LOG_FIRST_N(logger, apollo::LogLevel::WARN, 2) << "first 2, i=" << i;
+        // 约每10ms一次
+        APOLLO_LOG_EVERY_MS(logger, apollo::LogLevel::INFO, 10) << "every 10ms, i=" << i;
+        usleep(1000);
+    }
+}
+
 int main(int argc, char** argv) {
     apollo::Logger::ptr logger(new apollo::Logger);
     logger->addAppender(apollo::LogAppender::ptr(new apollo::StdoutLogAppender));
@@ -20,6 +73,11 @@ int main(int argc, char** argv) {
     APOLLO_LOG_ERROR(logger) << "test macro error";
 
     APOLLO_LOG_FMT_ERROR(logger, "test macro fmt error %s", "aa");
+    {
+        // 运行时生成的格式串立即格式化, 调用返回后即可释放
+        std::string runtime_fmt = std::string("test runtime fmt error ") + "%d";
+        APOLLO_LOG_EVENT(logger, apollo::LogLevel::ERROR).getEvent()->format(runtime_fmt.c_str(), 42);
+    }
 
     auto loggermgr = apollo::LoggerMgr::GetInstance()->getLogger("apolxo");
     // std::cout << loggermgr << " ***** " << std::endl;
@@ -28,6 +86,16 @@ int main(int argc, char** argv) {
     auto loggermgr2 = apollo::LoggerMgr::GetInstance()->getLogger("root");
     // std::cout << loggermgr << " ***** " << std::endl;
     APOLLO_LOG_INFO(loggermgr2) << "test root logger manager";
+
+    // 调用点缓存句柄, 之后不再按名称查找
+    for(int i = 0; i < 3; ++i) {
+        APOLLO_LOG_INFO(APOLLO_LOG_NAME_CACHED("cached")) << "test cached logger handle " << i;
+    }
+
+    test_limited(logger);
+    test_structured();
+    test_rolling();
+    test_mmap();
     
     return 0;
 }
\ No newline at end of file
@@ -12,7 +12,39 @@ void test_fiber() {
     }
 }
 
+static apollo::Logger::ptr g_ctx_logger = APOLLO_LOG_NAME("context");
+
+void handle_step(int step) {
+    // 在另一个协程中执行, 仍带着请求的上下文
+    APOLLO_LOG_INFO(g_ctx_logger) << "step " << step;
+}
+
+void handle_request(int id) {
+    apollo::FiberContextScope trace("trace_id", "t-" + std::to_string(id));
+    apollo::FiberContextScope request("request_id", std::to_string(id));
+    APOLLO_LOG_INFO(g_ctx_logger) << "request begin";
+    for(int i = 0; i < 2; ++i) {
+        apollo::Scheduler::GetThis()->schedule(std::bind(&handle_step, i));
+    }
+}
+
+void test_context() {
+    apollo::LogAppender::ptr appender(new apollo::StdoutLogAppender);
+    appender->setFormatter(apollo::LogFormatter::ptr(
+                new apollo::LogFormatter("%t%T%F%T[%X{trace_id}]%T%m%T%X%n")));
+    g_ctx_logger->addAppender(appender);
+
+    apollo::Scheduler sc(2, false, "context");
+    sc.start();
+    for(int i = 0; i < 3; ++i) {
+        sc.schedule(std::bind(&handle_request, i));
+    }
+    sc.stop();
+}
+
 int main(int argc, char** argv) {
+    test_context();
+
     APOLLO_LOG_INFO(g_logger) << "-----  main  -----";
     apollo::Scheduler sc(3, true, "test");
     sc.start();
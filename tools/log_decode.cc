@@ -0,0 +1,37 @@
+#include "../src/log.h"
+
+#include <iostream>
+
+// 将BinaryLogAppender写出的二进制日志按LogFormatter模板还原成文本
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        std::cout << "usage: " << argv[0] << " <binary log file> [pattern]" << std::endl;
+        return 1;
+    }
+    std::string pattern = "%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n";
+    if(argc > 2) {
+        pattern = argv[2];
+    }
+    apollo::LogFormatter::ptr fmt(new apollo::LogFormatter(pattern));
+    if(fmt->isError()) {
+        std::cerr << "invalid pattern: " << pattern << std::endl;
+        return 1;
+    }
+
+    apollo::BinaryLogReader reader(argv[1]);
+    if(!reader.isOpen()) {
+        std::cerr << "open " << argv[1] << " failed or not a binary log" << std::endl;
+        return 1;
+    }
+
+    std::string buf;
+    uint64_t count = 0;
+    while(apollo::LogEvent::ptr event = reader.next()) {
+        buf.clear();
+        fmt->format(buf, event->getLogger(), event->getLevel(), event);
+        std::cout.write(buf.data(), buf.size());
+        ++count;
+    }
+    std::cerr << count << " events" << std::endl;
+    return 0;
+}